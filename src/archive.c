@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "archive.h"
+#include "hash.h"
+#include "inflate.h"
+
+#define GZIP_FTEXT    0b00000001
+#define GZIP_FHCRC    0b00000010
+#define GZIP_FEXTRA   0b00000100
+#define GZIP_FNAME    0b00001000
+#define GZIP_FCOMMENT 0b00010000
+
+#define ZIP_LOCAL_HEADER   0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END_OF_DIR     0x06054b50
+
+
+static inline uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+ArchiveType archive_type(const uint8_t *file, size_t file_size) {
+    if (file_size >= 18 && file[0] == 0x1F && file[1] == 0x8B) {
+        return ARCHIVE_GZIP;
+    }
+    if (file_size >= 22 && le32(file) == ZIP_LOCAL_HEADER) {
+        return ARCHIVE_ZIP;
+    }
+    return ARCHIVE_NONE;
+}
+
+
+/****************************** GZIP ******************************/
+
+static bool gzip_find(const uint8_t *file, size_t file_size, ArchiveMember *m) {
+    const uint8_t *p = file + 10, *end = file + file_size - 8;
+    uint8_t flags = file[3];
+
+    if (file[2] != 8) {
+        return false; // only DEFLATE is defined
+    }
+    if (flags & GZIP_FEXTRA) {
+        if (p + 2 > end) {
+            return false;
+        }
+        p += 2 + le16(p);
+    }
+    if (flags & GZIP_FNAME) {
+        while (p < end && *p++);
+    }
+    if (flags & GZIP_FCOMMENT) {
+        while (p < end && *p++);
+    }
+    if (flags & GZIP_FHCRC) {
+        p += 2;
+    }
+    if (p > end) {
+        return false;
+    }
+
+    // the trailer holds CRC-32 and size modulo 2^32 of the data
+    m->data = p;
+    m->data_size = end - p;
+    m->crc32 = le32(end);
+    m->size = le32(end + 4);
+    m->stored = false;
+    return true;
+}
+
+
+/******************************* ZIP ******************************/
+
+static bool zip_find(const uint8_t *file, size_t file_size, ArchiveMember *m) {
+    const uint8_t *eocd = NULL, *dir, *dir_end, *chosen = NULL;
+    size_t min = file_size > 0xFFFF + 22 ? file_size - (0xFFFF + 22) : 0;
+
+    // the end of central directory record is followed by a comment of up to 64 KB
+    for (size_t i = file_size - 22; i + 1 > min; i--) {
+        if (le32(file + i) == ZIP_END_OF_DIR) {
+            eocd = file + i;
+            break;
+        }
+    }
+    if (!eocd) {
+        return false;
+    }
+
+    dir = file + le32(eocd + 16);
+    dir_end = dir + le32(eocd + 12);
+    if (dir < file || dir_end > eocd || dir > dir_end) {
+        return false;
+    }
+
+    for (const uint8_t *e = dir; e + 46 <= dir_end && le32(e) == ZIP_CENTRAL_HEADER;) {
+        uint16_t name_len = le16(e + 28);
+        const char *name = (const char *)e + 46;
+        if (e + 46 + name_len > dir_end) {
+            break;
+        }
+        if (!chosen) {
+            chosen = e;
+        }
+        if (name_len > 4 && strncasecmp(name + name_len - 4, ".nes", 4) == 0) {
+            chosen = e;
+            break;
+        }
+        e += 46 + name_len + le16(e + 30) + le16(e + 32);
+    }
+    if (!chosen) {
+        return false;
+    }
+
+    // sizes come from the central directory, the local header may defer them
+    // to a data descriptor
+    uint16_t method = le16(chosen + 10);
+    const uint8_t *local = file + le32(chosen + 42);
+    if (method != 0 && method != 8) {
+        return false;
+    }
+    if (local + 30 > file + file_size || le32(local) != ZIP_LOCAL_HEADER) {
+        return false;
+    }
+
+    m->data = local + 30 + le16(local + 26) + le16(local + 28);
+    m->data_size = le32(chosen + 20);
+    m->size = le32(chosen + 24);
+    m->crc32 = le32(chosen + 16);
+    m->stored = method == 0;
+    return m->data + m->data_size <= file + file_size;
+}
+
+
+/***************************** PUBLIC *****************************/
+
+bool archive_find_rom(const uint8_t *file, size_t file_size, ArchiveMember *m) {
+    memset(m, 0, sizeof(*m));
+    m->type = archive_type(file, file_size);
+    switch (m->type) {
+        case ARCHIVE_GZIP: return gzip_find(file, file_size, m);
+        case ARCHIVE_ZIP:  return zip_find(file, file_size, m);
+        default:           return false;
+    }
+}
+
+bool archive_extract(const ArchiveMember *m, uint8_t *out) {
+    size_t produced;
+
+    if (m->stored) {
+        if (m->data_size != m->size) {
+            return false;
+        }
+        memcpy(out, m->data, m->size);
+    } else if (!inflate_raw(m->data, m->data_size, out, m->size, &produced) || produced != m->size) {
+        return false;
+    }
+    return hash_crc32(0, out, m->size) == m->crc32;
+}
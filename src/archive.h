@@ -0,0 +1,41 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+/*
+    Compressed rom containers: gzip (RFC 1952) and zip (PKWARE APPNOTE, no zip64).
+
+    archive_find_rom() locates the rom inside an archive already in memory (usually
+    mmap'd) and archive_extract() inflates it into a caller-provided buffer of
+    `size` bytes, checking the CRC-32 stored in the archive. In a zip, the first
+    member ending with ".nes" is picked, or the first member if none does.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum ArchiveType {
+    ARCHIVE_NONE = 0,
+    ARCHIVE_GZIP,
+    ARCHIVE_ZIP,
+} ArchiveType;
+
+typedef struct {
+    ArchiveType type;
+    const uint8_t *data;      // compressed (or stored) data
+    size_t data_size;
+    uint32_t size;            // uncompressed size
+    uint32_t crc32;           // CRC-32 of the uncompressed data
+    bool stored;              // zip method 0, data is not compressed
+} ArchiveMember;
+
+// identify the container from its magic number
+ArchiveType archive_type(const uint8_t *file, size_t file_size);
+
+// fill `m` with the rom member of the archive, false if there is none or it is malformed
+bool archive_find_rom(const uint8_t *file, size_t file_size, ArchiveMember *m);
+
+// decode the member into `out`, which must hold m->size bytes
+bool archive_extract(const ArchiveMember *m, uint8_t *out);
+
+#endif /* ARCHIVE_H */
@@ -1,67 +1,381 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "archive.h"
 #include "cartridge.h"
 #include "libretro/libretro.h"
 #include "cpu.h"
+#include "gamedb.h"
+#include "hash.h"
+#include "mapper.h"
+#include "patch.h"
+#include "ppu.h"
 
 extern retro_log_printf_t log_cb;
 
-uint16_t pgr_rom_size, chr_rom_size;
+uint32_t pgr_rom_size, chr_rom_size;
 uint8_t expansion_device;
 bool mirroring;
-bool ppu_timing;
+bool four_screen;
+uint8_t ppu_timing;
+uint16_t mapper;
+uint8_t submapper;
+bool battery;
 
-void cartridge_parse_header(const struct retro_game_info *info)
+// open bus when no cartridge is loaded
+static uint8_t prg_ram_none[CPU_PRG_RAM_SIZE];
+uint8_t *prg_ram = prg_ram_none;
+uint32_t prg_ram_size;
+bool prg_ram_dirty;
+static int save_fd = -1;
+
+uint8_t *rom_data;
+uint32_t rom_size;
+uint8_t *prg_rom, *chr_rom;
+uint8_t chr_ram[0x2000];
+uint64_t *chr_rom_rows;
+uint64_t chr_ram_rows[0x2000 / 2];
+uint32_t rom_crc32;
+const GameDBEntry *rom_gamedb;
+
+bool cartridge_parse_ines(const uint8_t *data, uint32_t size, CartridgeHeader *h)
+{
+   uint32_t offset;
+
+   memset(h, 0, sizeof(*h));
+   if (size < 16 || memcmp(data, "NES\x1a", 4) != 0)
+      return false;
+
+   // validate file type
+   h->nes2 = (data[7] & 0b1100) == 0b1000;
+
+   // PGR ROM size in 16 KB units, CHR ROM size in 8 KB units
+   h->prg_rom_size = (((data[9] & 0x0F) << 8) | data[4]) * 16 * 1024;
+   h->chr_rom_size = (((data[9] & 0xF0) << 4) | data[5]) * 8 * 1024;
+
+   // 1 for vertical, 0 for horizontal
+   h->mirroring = data[6] & 0b1;
+   h->battery = data[6] & 0b10;
+   h->trainer = data[6] & 0b100;
+   h->four_screen = data[6] & 0b1000;
+
+   // mapper D0..D3 in byte 6, D4..D7 in byte 7, D8..D11 and submapper in byte 8
+   h->mapper = (data[6] >> 4) | (data[7] & 0xF0);
+   if (h->nes2) {
+      h->mapper |= (data[8] & 0x0F) << 8;
+      h->submapper = data[8] >> 4;
+   }
+
+   // PRG RAM: shift counts in NES 2.0, 8 KB units in iNES (0 meaning 8 KB)
+   if (h->nes2) {
+      h->prg_ram_size = (data[10] & 0x0F) ? 64 << (data[10] & 0x0F) : 0;
+      h->prg_nvram_size = (data[10] >> 4) ? 64 << (data[10] >> 4) : 0;
+   } else {
+      h->prg_ram_size = (data[8] ? data[8] : 1) * 8 * 1024;
+      if (h->battery) {
+         h->prg_nvram_size = h->prg_ram_size;
+         h->prg_ram_size = 0;
+      }
+   }
+
+   // 0 for NTSC, 1 for PAL, 2 for multi, 3 for dendy
+   h->timing = data[12] & 0b11;
+
+   // 1 for Standard NES controllers
+   h->expansion_device = data[15] & 0b111111;
+
+   // PRG and CHR follow the header and the optional 512-byte trainer,
+   // sizes are clamped to what the file actually holds
+   offset = 16 + (h->trainer ? 512 : 0);
+   if (offset > size)
+      offset = size;
+   h->prg_offset = offset;
+   h->truncated = h->prg_rom_size + h->chr_rom_size > size - offset;
+   if (h->prg_rom_size > size - offset)
+      h->prg_rom_size = size - offset;
+   offset += h->prg_rom_size;
+   if (h->chr_rom_size > size - offset)
+      h->chr_rom_size = size - offset;
+
+   return true;
+}
+
+void cartridge_apply_gamedb(CartridgeHeader *h, const GameDBEntry *entry)
+{
+   if (entry->overrides & GAMEDB_OVERRIDE_MAPPER) {
+      h->mapper = entry->mapper;
+      h->submapper = entry->submapper;
+   }
+   if (entry->overrides & GAMEDB_OVERRIDE_MIRRORING)
+      h->mirroring = entry->mirroring;
+   if (entry->overrides & GAMEDB_OVERRIDE_TIMING)
+      h->timing = entry->timing;
+   if (entry->overrides & GAMEDB_OVERRIDE_BATTERY) {
+      h->battery = entry->battery;
+      if (h->battery && !h->prg_nvram_size) {
+         h->prg_nvram_size = h->prg_ram_size ? h->prg_ram_size : 8 * 1024;
+         h->prg_ram_size = 0;
+      }
+   }
+}
+
+// decode a gzip/zip rom straight into rom_data, the archive is only mapped
+static bool cartridge_read_archive(const char *path, FILE *ptr, long size)
+{
+   ArchiveMember m;
+   bool ok;
+   uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(ptr), 0);
+
+   if (file == MAP_FAILED) {
+      log_cb(RETRO_LOG_ERROR, "Could not map rom %s\n", path);
+      return false;
+   }
+
+   if (!archive_find_rom(file, size, &m) || m.size < 16) {
+      log_cb(RETRO_LOG_ERROR, "No rom found in archive %s\n", path);
+      munmap(file, size);
+      return false;
+   }
+
+   rom_data = malloc(m.size);
+   ok = rom_data && archive_extract(&m, rom_data);
+   munmap(file, size);
+   if (!ok) {
+      log_cb(RETRO_LOG_ERROR, "Corrupted archive %s\n", path);
+      free(rom_data);
+      rom_data = NULL;
+      return false;
+   }
+
+   rom_size = m.size;
+   return true;
+}
+
+// read the whole file in a single buffer
+static bool cartridge_read_file(const char *path)
 {
-   uint8_t buf[1+3*16], *header;
-   uint8_t lsb, msb;
-   bool is_nes2dot0 = false;
+   FILE *ptr = fopen(path, "rb");
+   // archive_type() wants as many bytes as the smallest zip or gzip file
+   uint8_t magic[22] = { 0 };
+   long size;
+   bool ok;
+
+   if (!ptr) {
+      log_cb(RETRO_LOG_ERROR, "Could not open rom %s\n", path);
+      return false;
+   }
+
+   fseek(ptr, 0, SEEK_END);
+   size = ftell(ptr);
+   fseek(ptr, 0, SEEK_SET);
+
+   if (size >= 22 && fread(magic, sizeof(magic), 1, ptr) == 1 &&
+       archive_type(magic, sizeof(magic)) != ARCHIVE_NONE) {
+      ok = cartridge_read_archive(path, ptr, size);
+      fclose(ptr);
+      return ok;
+   }
+   fseek(ptr, 0, SEEK_SET);
+
+   rom_data = malloc(size > 0 ? size : 1);
+   if (size < 16 || fread(rom_data, size, 1, ptr) != 1) {
+      log_cb(RETRO_LOG_ERROR, "Could not read rom %s\n", path);
+      fclose(ptr);
+      free(rom_data);
+      rom_data = NULL;
+      return false;
+   }
+   fclose(ptr);
+
+   rom_size = size;
+   return true;
+}
+
+// patch the whole file image, before the header is parsed
+static bool cartridge_apply_patch(const char *path)
+{
+   struct stat st;
+   uint8_t *patch;
+   bool ok;
+   int fd = open(path, O_RDONLY);
+
+   if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0) {
+      log_cb(RETRO_LOG_ERROR, "Could not open patch %s\n", path);
+      if (fd >= 0)
+         close(fd);
+      return false;
+   }
+   patch = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (patch == MAP_FAILED) {
+      log_cb(RETRO_LOG_ERROR, "Could not map patch %s\n", path);
+      return false;
+   }
+
+   ok = patch_apply(patch, st.st_size, &rom_data, &rom_size);
+   munmap(patch, st.st_size);
+   if (!ok) {
+      log_cb(RETRO_LOG_ERROR, "Patch %s does not apply to this rom\n", path);
+      return false;
+   }
+   log_cb(RETRO_LOG_INFO, "Applied patch %s\n", path);
+   return true;
+}
+
+bool cartridge_parse_header(const struct retro_game_info *info, const char *patch_path)
+{
+   CartridgeHeader h;
+   char buf[1+3*16];
 
-   FILE *ptr = fopen(info->path,"rb");
    log_cb(RETRO_LOG_INFO, "Rom path %s\n", info->path);
+   if (!cartridge_read_file(info->path))
+      return false;
 
-   fread(&mem[CPU_CARTRIDGE_ADDR_START], CPU_CARTRIDGE_SIZE, 1, ptr);
-   header = &mem[CPU_CARTRIDGE_ADDR_START];
+   if (patch_path && (!cartridge_apply_patch(patch_path) || rom_size < 16)) {
+      cartridge_unload();
+      return false;
+   }
 
    for(int i=0; i<16; i++){
-      sprintf(&buf[i*3], "%02x ", header[i]);
+      sprintf(&buf[i*3], "%02x ", rom_data[i]);
    }
    log_cb(RETRO_LOG_INFO, "header: %s\n", buf);
 
-   log_cb(RETRO_LOG_INFO, "header[4]: %o\n", header[4]);
-   log_cb(RETRO_LOG_INFO, "header[9]: %o\n", header[9]);
-
-   // PGR ROM size in 16 KB units
-   lsb = header[4];
-   msb = header[9] & 0x0F;
-   pgr_rom_size = ((msb << 8) | lsb) * 16 * 1024;
-   log_cb(RETRO_LOG_INFO, "pgr_rom_size LSB: 0x%02x (%d B)\n", lsb, lsb);
-   log_cb(RETRO_LOG_INFO, "pgr_rom_size MSB: 0x%02x (%d B)\n", msb, msb);
-   log_cb(RETRO_LOG_INFO, "pgr_rom_size: 0x%02x (%d B)\n", pgr_rom_size, pgr_rom_size);
-
-   // CHR ROM size in 8 KB units
-   lsb = header[5];
-   msb = (header[9] & 0xF0) >> 4;
-   chr_rom_size = ((msb << 8) | lsb) * 8 * 1024;
-   log_cb(RETRO_LOG_INFO, "chr_rom_size_LSB: 0x%02x (%d B)\n", lsb, lsb);
-   log_cb(RETRO_LOG_INFO, "chr_rom_size_MSB: 0x%02x (%d B)\n", msb, msb);
-   log_cb(RETRO_LOG_INFO, "chr_rom_size: 0x%02x (%d B)\n", chr_rom_size, chr_rom_size);
+   if (!cartridge_parse_ines(rom_data, rom_size, &h)) {
+      log_cb(RETRO_LOG_ERROR, "Not an iNES file\n");
+      cartridge_unload();
+      return false;
+   }
+   if (h.truncated)
+      log_cb(RETRO_LOG_WARN, "PRG/CHR ROM truncated to the file size\n");
 
-   // 1 for vertical, 0 for horizontal
-   mirroring = header[6] & 0b1;
-   log_cb(RETRO_LOG_INFO, "mirroring: %s (%d)\n", mirroring ? "vertical" : "horizontal", mirroring);
+   prg_rom = rom_data + h.prg_offset;
+   chr_rom = prg_rom + h.prg_rom_size;
 
-   // validate file type
-   is_nes2dot0 = (header[7] & 0b1100) == 2;
-   log_cb(RETRO_LOG_INFO, "is_nes2dot0: %s (%d)\n", is_nes2dot0 ? "true" : "false", is_nes2dot0);
+   // PRG and CHR are contiguous in the file, hash them in one go
+   rom_crc32 = hash_crc32(0, prg_rom, h.prg_rom_size + h.chr_rom_size);
+   rom_gamedb = gamedb_lookup(rom_crc32);
+   if (rom_gamedb) {
+      cartridge_apply_gamedb(&h, rom_gamedb);
+      log_cb(RETRO_LOG_INFO, "gamedb: overrides 0x%02x, hints 0x%02x\n",
+             rom_gamedb->overrides, rom_gamedb->hints);
+   }
 
-   // 0 for NTSC, 1 for PAL, 2 for multi, 3 for dendy
-   ppu_timing = header[12] & 0b11;
-   log_cb(RETRO_LOG_INFO, "ppu_timing: %s (%d)\n", ppu_timing ? "PAL" : "NTSC", ppu_timing);
+   pgr_rom_size = h.prg_rom_size;
+   chr_rom_size = h.chr_rom_size;
+   mirroring = h.mirroring;
+   four_screen = h.four_screen;
+   mapper = h.mapper;
+   submapper = h.submapper;
+   ppu_timing = h.timing;
+   expansion_device = h.expansion_device;
+   battery = h.battery;
 
-   // 1 for Standard NES controllers
-   expansion_device = header[15] & 0b111111;
-   log_cb(RETRO_LOG_INFO, "expansion_device: %x\n", expansion_device);
+   // the $6000-$7FFF window is always backed, even if the header declares no RAM
+   prg_ram_size = h.prg_ram_size + h.prg_nvram_size;
+   if (prg_ram_size < CPU_PRG_RAM_SIZE)
+      prg_ram_size = CPU_PRG_RAM_SIZE;
+   prg_ram = calloc(prg_ram_size, 1);
+   prg_ram_dirty = false;
+
+   // pattern tables are only ever fetched decoded, CHR RAM starts blank
+   chr_rom_rows = calloc(chr_rom_size / 2 + 1, sizeof(uint64_t));
+   if (!prg_ram || !chr_rom_rows) {
+      log_cb(RETRO_LOG_ERROR, "Out of memory for PRG RAM or CHR ROM\n");
+      cartridge_unload();
+      return false;
+   }
+   ppu_decode_chr(chr_rom, chr_rom_rows, chr_rom_size);
+   memset(chr_ram, 0, sizeof(chr_ram));
+   memset(chr_ram_rows, 0, sizeof(chr_ram_rows));
+
+   if (!mapper_init())
+      log_cb(RETRO_LOG_WARN, "Mapper %d is not supported, using NROM banking\n", mapper);
+
+   log_cb(RETRO_LOG_INFO, "%s, mapper %d.%d, PRG %u B, CHR %u B, PRG RAM %u B%s, %s mirroring, %s, crc32 %08X\n",
+          h.nes2 ? "NES 2.0" : "iNES", mapper, submapper, pgr_rom_size, chr_rom_size,
+          prg_ram_size, battery ? " (battery)" : "",
+          four_screen ? "four-screen" : mirroring ? "vertical" : "horizontal",
+          ppu_timing ? "PAL" : "NTSC", rom_crc32);
+
+   return true;
+}
+
+bool cartridge_map_save_file(const char *path)
+{
+   struct stat st;
+   uint8_t *map;
+   int fd = open(path, O_RDWR | O_CREAT, 0644);
+
+   if (fd < 0 || fstat(fd, &st) != 0) {
+      log_cb(RETRO_LOG_ERROR, "Could not open save file %s\n", path);
+      if (fd >= 0)
+         close(fd);
+      return false;
+   }
+   if ((uint64_t)st.st_size < prg_ram_size && ftruncate(fd, prg_ram_size) != 0) {
+      log_cb(RETRO_LOG_ERROR, "Could not resize save file %s\n", path);
+      close(fd);
+      return false;
+   }
+
+   map = mmap(NULL, prg_ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED) {
+      log_cb(RETRO_LOG_ERROR, "Could not map save file %s\n", path);
+      close(fd);
+      return false;
+   }
+
+   // the file content is the save, whatever was in PRG RAM is dropped
+   if (prg_ram != prg_ram_none)
+      free(prg_ram);
+   prg_ram = map;
+   prg_ram_dirty = false;
+   save_fd = fd;
+   log_cb(RETRO_LOG_INFO, "PRG RAM mapped to %s\n", path);
+   return true;
+}
+
+bool cartridge_save_file_mapped()
+{
+   return save_fd >= 0;
+}
+
+void cartridge_flush_save()
+{
+   if (save_fd < 0 || !prg_ram_dirty)
+      return;
+   msync(prg_ram, prg_ram_size, MS_ASYNC);
+   prg_ram_dirty = false;
+}
+
+void cartridge_unload()
+{
+   if (save_fd >= 0) {
+      msync(prg_ram, prg_ram_size, MS_SYNC);
+      munmap(prg_ram, prg_ram_size);
+      close(save_fd);
+      save_fd = -1;
+   } else if (prg_ram != prg_ram_none) {
+      free(prg_ram);
+   }
+   prg_ram = prg_ram_none;
+   prg_ram_size = 0;
+   prg_ram_dirty = false;
+   battery = false;
+
+   free(rom_data);
+   rom_data = NULL;
+   rom_size = 0;
+   prg_rom = chr_rom = NULL;
+   free(chr_rom_rows);
+   chr_rom_rows = NULL;
+   pgr_rom_size = chr_rom_size = 0;
+   rom_crc32 = 0;
+   rom_gamedb = NULL;
 }
@@ -5,11 +5,49 @@
 #include <stdint.h>
 
 #include "libretro/libretro.h"
+#include "gamedb.h"
 
-extern uint16_t pgr_rom_size, chr_rom_size;
+extern uint32_t pgr_rom_size, chr_rom_size;
 extern uint8_t expansion_device; // 1 for Standard NES controllers
 extern bool mirroring;           // 1 for vertical, 0 for horizontal
-extern bool ppu_timing;          // 0 for NTSC, 1 for PAL
+extern bool four_screen;         // 4 KB of nametables, the cart provides the other 2 KB
+extern uint8_t ppu_timing;       // 0 for NTSC, 1 for PAL, 2 for multi, 3 for dendy
+extern uint16_t mapper;          // iNES / NES 2.0 mapper number
+extern uint8_t submapper;        // NES 2.0 submapper number
+extern bool battery;             // PRG RAM is battery backed
+
+extern uint8_t *prg_ram;         // mapped at $6000-$7FFF, at least 8 KB
+extern uint32_t prg_ram_size;
+extern bool prg_ram_dirty;       // set by every CPU write to PRG RAM
+
+extern uint8_t *rom_data;        // the whole rom file
+extern uint32_t rom_size;
+extern uint8_t *prg_rom;         // PRG ROM inside rom_data
+extern uint8_t *chr_rom;         // CHR ROM inside rom_data, right after PRG ROM
+extern uint8_t chr_ram[0x2000];  // pattern tables of carts without CHR ROM
+extern uint64_t *chr_rom_rows;   // CHR ROM pre-decoded by ppu_decode_chr(), 8 bytes per row
+extern uint64_t chr_ram_rows[0x2000 / 2];
+extern uint32_t rom_crc32;       // CRC-32 of PRG ROM + CHR ROM
+extern const GameDBEntry *rom_gamedb; // game database entry, NULL if unknown
+
+// fields of an iNES / NES 2.0 header
+typedef struct {
+   uint32_t prg_rom_size;     // in bytes, clamped to the file size
+   uint32_t chr_rom_size;     // in bytes, clamped to the file size
+   uint32_t prg_offset;       // offset of PRG ROM in the file
+   uint32_t prg_ram_size;     // volatile PRG RAM, in bytes
+   uint32_t prg_nvram_size;   // battery-backed PRG RAM, in bytes
+   uint16_t mapper;
+   uint8_t submapper;
+   uint8_t timing;            // 0 for NTSC, 1 for PAL, 2 for multi, 3 for dendy
+   uint8_t expansion_device;
+   bool mirroring;            // 1 for vertical, 0 for horizontal
+   bool four_screen;          // hard-wired four-screen VRAM, `mirroring` is ignored
+   bool battery;
+   bool trainer;
+   bool nes2;
+   bool truncated;            // the file is shorter than the header says
+} CartridgeHeader;
 
 /*
    https://www.nesdev.org/wiki/NES_2.0
@@ -121,8 +159,37 @@ extern bool ppu_timing;          // 0 for NTSC, 1 for PAL
         ++-++++- Default Expansion Device
 
     BY NOW, WE ONLY PARSE `NES 2.0` FORMAT
+
+    cartridge_parse_ines() decodes a header from memory without any side effect, so
+    tools can use it on many files at once; it returns false if the magic is missing.
+
+    cartridge_parse_header() loads a rom for the core. The whole file is kept in `rom_data`.
+    If `patch_path` is not NULL, that IPS/UPS/BPS patch is applied to the file image,
+    before the header is parsed, so only the patched rom stays in memory. PRG+CHR are
+    hashed with CRC-32 and looked up in the game database, which may override the
+    mapper, mirroring and timing fields.
+    Returns false if the file cannot be read or the patch does not apply.
+*/
+bool cartridge_parse_ines(const uint8_t *data, uint32_t size, CartridgeHeader *h);
+bool cartridge_parse_header(const struct retro_game_info *info, const char *patch_path);
+
+// replace the header fields overridden by a game database entry
+void cartridge_apply_gamedb(CartridgeHeader *h, const GameDBEntry *entry);
+
+// release the rom loaded by cartridge_parse_header()
+void cartridge_unload();
+
+/*
+   Battery-backed PRG RAM is exposed to the frontend as RETRO_MEMORY_SAVE_RAM, unless
+   it was mapped to a save file: cartridge_map_save_file() replaces `prg_ram` with a
+   shared mapping of `path` (created or extended to prg_ram_size), so the kernel
+   writes the saves back. cartridge_flush_save() schedules that write back with an
+   asynchronous msync, only if PRG RAM was written since the last call; call it once
+   per frame. The mapping is synced and released by cartridge_unload().
 */
-void cartridge_parse_header(const struct retro_game_info *info);
+bool cartridge_map_save_file(const char *path);
+bool cartridge_save_file_mapped();
+void cartridge_flush_save();
 
 
 #endif /* CARTRIDGE_H */
@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cartridge.h"
+#include "cdl.h"
+#include "cpu.h"
+#include "ppu.h"
+
+#define CDL_EXPORT_MASK 0x7F // FCEUX leaves bit 7 unused
+
+bool cdl_enabled;
+uint8_t *cdl_prg;
+uint8_t *cdl_chr;
+
+bool cdl_enable() {
+    cdl_disable();
+    cdl_prg = calloc(pgr_rom_size + chr_rom_size + 1, 1);
+    if (!cdl_prg) {
+        return false;
+    }
+    cdl_chr = cdl_prg + pgr_rom_size;
+    cdl_enabled = true;
+    return true;
+}
+
+void cdl_disable() {
+    cdl_enabled = false;
+    free(cdl_prg);
+    cdl_prg = cdl_chr = NULL;
+}
+
+bool cdl_load(const char *path) {
+    uint32_t size = pgr_rom_size + chr_rom_size;
+    uint8_t buf[4096];
+    uint32_t done = 0;
+    size_t n;
+    FILE *f;
+
+    if (!cdl_enabled || !(f = fopen(path, "rb"))) {
+        return false;
+    }
+    fseek(f, 0, SEEK_END);
+    if ((uint32_t)ftell(f) != size) {
+        fclose(f);
+        return false;
+    }
+    fseek(f, 0, SEEK_SET);
+    while (done < size && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (size_t i = 0; i < n && done < size; i++) {
+            cdl_prg[done++] |= buf[i];
+        }
+    }
+    fclose(f);
+    return done == size;
+}
+
+bool cdl_save(const char *path) {
+    uint32_t size = pgr_rom_size + chr_rom_size;
+    uint8_t buf[4096];
+    bool ok = true;
+    FILE *f;
+
+    if (!cdl_enabled || !(f = fopen(path, "wb"))) {
+        return false;
+    }
+    for (uint32_t i = 0; i < size && ok; i += sizeof(buf)) {
+        uint32_t n = size - i < sizeof(buf) ? size - i : sizeof(buf);
+        for (uint32_t j = 0; j < n; j++) {
+            buf[j] = cdl_prg[i + j] & CDL_EXPORT_MASK;
+        }
+        ok = fwrite(buf, 1, n, f) == n;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+// the logs follow the banks: find the rom offset behind the CPU or PPU page
+void cdl_log_prg(uint16_t addr, uint8_t flags) {
+    const uint8_t *p = cpu_prg_map[(addr >> 13) & 3] + (addr & 0x1FFF);
+    if (p >= prg_rom && p < prg_rom + pgr_rom_size) {
+        cdl_prg[p - prg_rom] |= flags | ((addr >> 11) & CDL_BANK);
+    }
+}
+
+void cdl_log_chr(uint16_t addr, uint8_t flags) {
+    const uint8_t *p = ppu_chr_map[(addr >> 10) & 7] + (addr & 0x3FF);
+    if (p >= chr_rom && p < chr_rom + chr_rom_size) {
+        cdl_chr[p - chr_rom] |= flags;
+    }
+}
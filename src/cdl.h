@@ -0,0 +1,61 @@
+#ifndef CDL_H
+#define CDL_H
+
+/*
+    Code/Data Logger: one byte of flags per byte of PRG ROM and CHR ROM, recording
+    how the game used it. The layout is the one of FCEUX .cdl files (PRG bytes, then
+    CHR bytes), so logs can be exchanged with its tools:
+
+    PRG   7654 3210
+          ---------
+          OPIC BBDC
+          |||| |||+- C code, executed (opcode or operand)
+          |||| ||+-- D data, read by an instruction
+          |||| ++--- B CPU window it was accessed through: ($8000 + B * $2000)
+          |||+------ C indirect code, target of JMP ($aaaa)
+          ||+------- I indirect data, read through a pointer ($aa),Y
+          |+-------- P PCM sample, read by the APU DMC
+          +--------- O opcode, first byte of an instruction (not exported)
+
+    CHR   .... ..RD
+                 |+- D drawn by the PPU
+                 +-- R read through $2007
+
+    Logging costs one branch on `cdl_enabled` per access when disabled. The flags
+    are only ever OR-ed, so a log loaded at startup keeps accumulating across runs.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum CDLFlags {
+    CDL_CODE          = 0b00000001,
+    CDL_DATA          = 0b00000010,
+    CDL_BANK          = 0b00001100,
+    CDL_INDIRECT_CODE = 0b00010000,
+    CDL_INDIRECT_DATA = 0b00100000,
+    CDL_PCM           = 0b01000000,
+    CDL_OPCODE        = 0b10000000,
+    CDL_CHR_DRAWN     = 0b00000001,
+    CDL_CHR_READ      = 0b00000010,
+} CDLFlags;
+
+extern bool cdl_enabled;
+extern uint8_t *cdl_prg;      // pgr_rom_size bytes of flags, NULL while disabled
+extern uint8_t *cdl_chr;      // chr_rom_size bytes of flags
+
+// allocate (cleared) logs for the loaded cartridge and start logging
+bool cdl_enable();
+// stop logging and release the logs
+void cdl_disable();
+
+// OR the flags of a FCEUX .cdl file into the logs, false if it is for another rom
+bool cdl_load(const char *path);
+// write the logs as a FCEUX .cdl file
+bool cdl_save(const char *path);
+
+// log a CPU access to $8000-$FFFF, or a PPU access to $0000-$1FFF (CHR ROM only)
+void cdl_log_prg(uint16_t addr, uint8_t flags);
+void cdl_log_chr(uint16_t addr, uint8_t flags);
+
+#endif /* CDL_H */
@@ -1,163 +1,183 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
+#include "cdl.h"
 #include "cpu.h"
+#include "mapper.h"
+#include "ppu.h"
 
 
 /**************************** CONSTANTS ****************************/
 
+const char *cpu_addr_mode_names[] = {
+    [CPU_ADDR_IMPLIED]     = "",
+    [CPU_ADDR_ACCUMULATOR] = "accumulator",
+    [CPU_ADDR_IMMEDIATE]   = "immediate",
+    [CPU_ADDR_ZERO_PAGE]   = "zero page",
+    [CPU_ADDR_ZERO_PAGE_X] = "zero page, x indexed",
+    [CPU_ADDR_ZERO_PAGE_Y] = "zero page, y indexed",
+    [CPU_ADDR_ABSOLUTE]    = "absolute",
+    [CPU_ADDR_ABSOLUTE_X]  = "absolute, x indexed",
+    [CPU_ADDR_ABSOLUTE_Y]  = "absolute, y indexed",
+    [CPU_ADDR_INDIRECT]    = "indirect",
+    [CPU_ADDR_INDIRECT_X]  = "indirect, x indexed",
+    [CPU_ADDR_INDIRECT_Y]  = "indirect, y indexed",
+    [CPU_ADDR_RELATIVE]    = "relative",
+};
+
 CPUInstruction cpu_instruction_table[256] = {
-    [0x61] = {"ADC", 2, 6, "indirect, x indexed"},
-    [0x65] = {"ADC", 2, 3, "zero page"},
-    [0x69] = {"ADC", 2, 2, "immediate"},
-    [0x6D] = {"ADC", 3, 4, "absolute"},
-    [0x71] = {"ADC", 2, 5, "indirect, y indexed"},
-    [0x75] = {"ADC", 2, 4, "zero page, x indexed"},
-    [0x79] = {"ADC", 3, 4, "absolute, y indexed"},
-    [0x7D] = {"ADC", 3, 4, "absolute, x indexed"},
-    [0x21] = {"AND", 2, 6, "indirect, x indexed"},
-    [0x25] = {"AND", 2, 3, "zero page"},
-    [0x29] = {"AND", 2, 2, "immediate"},
-    [0x2D] = {"AND", 3, 4, "absolute"},
-    [0x31] = {"AND", 2, 5, "indirect, y indexed"},
-    [0x35] = {"AND", 2, 4, "zero page, x indexed"},
-    [0x39] = {"AND", 3, 4, "absolute, y indexed"},
-    [0x3D] = {"AND", 3, 4, "absolute, x indexed"},
-    [0x06] = {"ASL", 2, 5, "zero page"},
-    [0x0A] = {"ASL", 1, 2, "accumulator"},
-    [0x0E] = {"ASL", 3, 6, "absolute"},
-    [0x16] = {"ASL", 2, 6, "zero page, x indexed"},
-    [0x1E] = {"ASL", 3, 7, "absolute, x indexed"},
-    [0x90] = {"BCC", 2, 2, ""},
-    [0xB0] = {"BCS", 2, 2, ""},
-    [0xF0] = {"BEQ", 2, 2, ""},
-    [0x24] = {"BIT", 2, 3, "zero page"},
-    [0x2C] = {"BIT", 3, 4, "absolute"},
-    [0x30] = {"BMI", 2, 2, ""},
-    [0xD0] = {"BNE", 2, 2, ""},
-    [0x10] = {"BPL", 2, 2, ""},
-    [0x00] = {"BRK", 1, 7, ""},
-    [0x50] = {"BVC", 2, 2, ""},
-    [0x70] = {"BVS", 2, 2, ""},
-    [0x18] = {"CLC", 1, 2, ""},
-    [0xD8] = {"CLD", 1, 2, ""},
-    [0x58] = {"CLI", 1, 2, ""},
-    [0xB8] = {"CLV", 1, 2, ""},
-    [0xC1] = {"CMP", 2, 6, "indirect, x indexed"},
-    [0xC5] = {"CMP", 2, 3, "zero page"},
-    [0xC9] = {"CMP", 2, 2, "immediate"},
-    [0xCD] = {"CMP", 3, 4, "absolute"},
-    [0xD1] = {"CMP", 2, 5, "indirect, y indexed"},
-    [0xD5] = {"CMP", 2, 4, "zero page, x indexed"},
-    [0xD9] = {"CMP", 3, 4, "absolute, y indexed"},
-    [0xDD] = {"CMP", 3, 4, "absolute, x indexed"},
-    [0xE0] = {"CPX", 2, 2, "immediate"},
-    [0xE4] = {"CPX", 2, 3, "zero page"},
-    [0xEC] = {"CPX", 3, 4, "absolute"},
-    [0xC0] = {"CPY", 2, 2, "immediate"},
-    [0xC4] = {"CPY", 2, 3, "zero page"},
-    [0xCC] = {"CPY", 3, 4, "absolute"},
-    [0xC6] = {"DEC", 2, 5, "zero page"},
-    [0xCE] = {"DEC", 3, 6, "absolute"},
-    [0xD6] = {"DEC", 2, 6, "zero page, x indexed"},
-    [0xDE] = {"DEC", 3, 7, "absolute, x indexed"},
-    [0xCA] = {"DEX", 1, 2, ""},
-    [0x88] = {"DEY", 1, 2, ""},
-    [0x41] = {"EOR", 2, 6, "indirect, x indexed"},
-    [0x45] = {"EOR", 2, 3, "zero page"},
-    [0x49] = {"EOR", 2, 2, "immediate"},
-    [0x4D] = {"EOR", 3, 4, "absolute"},
-    [0x51] = {"EOR", 2, 5, "indirect, y indexed"},
-    [0x55] = {"EOR", 2, 4, "zero page, x indexed"},
-    [0x59] = {"EOR", 3, 4, "absolute, y indexed"},
-    [0x5D] = {"EOR", 3, 4, "absolute, x indexed"},
-    [0xE6] = {"INC", 2, 5, "zero page"},
-    [0xEE] = {"INC", 3, 6, "absolute"},
-    [0xF6] = {"INC", 2, 6, "zero page, x indexed"},
-    [0xFE] = {"INC", 3, 7, "absolute, x indexed"},
-    [0xE8] = {"INX", 1, 2, ""},
-    [0xC8] = {"INY", 1, 2, ""},
-    [0x4C] = {"JMP", 3, 3, "absolute"},
-    [0x6C] = {"JMP", 3, 5, "indirect"},
-    [0x20] = {"JSR", 3, 6, ""},
-    [0xA1] = {"LDA", 2, 6, "indirect, x indexed"},
-    [0xA5] = {"LDA", 2, 3, "zero page"},
-    [0xA9] = {"LDA", 2, 2, "immediate"},
-    [0xAD] = {"LDA", 3, 4, "absolute"},
-    [0xB1] = {"LDA", 2, 5, "indirect, y indexed"},
-    [0xB5] = {"LDA", 2, 4, "zero page, x indexed"},
-    [0xB9] = {"LDA", 3, 4, "absolute, y indexed"},
-    [0xBD] = {"LDA", 3, 4, "absolute, x indexed"},
-    [0xA2] = {"LDX", 2, 2, "immediate"},
-    [0xA6] = {"LDX", 2, 3, "zero page"},
-    [0xAE] = {"LDX", 3, 4, "absolute"},
-    [0xB6] = {"LDX", 2, 4, "zero page, y indexed"},
-    [0xBE] = {"LDX", 3, 4, "absolute, y indexed"},
-    [0xA0] = {"LDY", 2, 2, "immediate"},
-    [0xA4] = {"LDY", 2, 3, "zero page"},
-    [0xAC] = {"LDY", 3, 4, "absolute"},
-    [0xB4] = {"LDY", 2, 4, "zero page, x indexed"},
-    [0xBC] = {"LDY", 3, 4, "absolute, x indexed"},
-    [0x46] = {"LSR", 2, 5, "zero page"},
-    [0x4A] = {"LSR", 1, 2, "accumulator"},
-    [0x4E] = {"LSR", 3, 6, "absolute"},
-    [0x56] = {"LSR", 2, 6, "zero page, x indexed"},
-    [0x5E] = {"LSR", 3, 7, "absolute, x indexed"},
-    [0xEA] = {"NOP", 1, 2, ""},
-    [0x01] = {"ORA", 2, 6, "indirect, x indexed"},
-    [0x05] = {"ORA", 2, 3, "zero page"},
-    [0x09] = {"ORA", 2, 2, "immediate"},
-    [0x0D] = {"ORA", 3, 4, "absolute"},
-    [0x11] = {"ORA", 2, 5, "indirect, y indexed"},
-    [0x15] = {"ORA", 2, 4, "zero page, x indexed"},
-    [0x19] = {"ORA", 3, 4, "absolute, y indexed"},
-    [0x1D] = {"ORA", 3, 4, "absolute, x indexed"},
-    [0x48] = {"PHA", 1, 3, ""},
-    [0x08] = {"PHP", 1, 3, ""},
-    [0x68] = {"PLA", 1, 4, ""},
-    [0x28] = {"PLP", 1, 4, ""},
-    [0x26] = {"ROL", 2, 5, "zero page"},
-    [0x2A] = {"ROL", 1, 2, "accumulator"},
-    [0x2E] = {"ROL", 3, 6, "absolute"},
-    [0x36] = {"ROL", 2, 6, "zero page, x indexed"},
-    [0x3E] = {"ROL", 3, 7, "absolute, x indexed"},
-    [0x66] = {"ROR", 2, 5, "zero page"},
-    [0x6A] = {"ROR", 1, 2, "accumulator"},
-    [0x6E] = {"ROR", 3, 6, "absolute"},
-    [0x76] = {"ROR", 2, 6, "zero page, x indexed"},
-    [0x7E] = {"ROR", 3, 7, "absolute, x indexed"},
-    [0x40] = {"RTI", 1, 6, ""},
-    [0x60] = {"RTS", 1, 6, ""},
-    [0xE1] = {"SBC", 2, 6, "indirect, x indexed"},
-    [0xE5] = {"SBC", 2, 3, "zero page"},
-    [0xE9] = {"SBC", 2, 2, "immediate"},
-    [0xED] = {"SBC", 3, 4, "absolute"},
-    [0xF1] = {"SBC", 2, 5, "indirect, y indexed"},
-    [0xF5] = {"SBC", 2, 4, "zero page, x indexed"},
-    [0xF9] = {"SBC", 3, 4, "absolute, y indexed"},
-    [0xFD] = {"SBC", 3, 4, "absolute, x indexed"},
-    [0x38] = {"SEC", 1, 2, ""},
-    [0xF8] = {"SED", 1, 2, ""},
-    [0x78] = {"SEI", 1, 2, ""},
-    [0x81] = {"STA", 2, 6, "indirect, x indexed"},
-    [0x85] = {"STA", 2, 3, "zero page"},
-    [0x8D] = {"STA", 3, 4, "absolute"},
-    [0x91] = {"STA", 2, 6, "indirect, y indexed"},
-    [0x95] = {"STA", 2, 4, "zero page, x indexed"},
-    [0x99] = {"STA", 3, 5, "absolute, y indexed"},
-    [0x9D] = {"STA", 3, 5, "absolute, x indexed"},
-    [0x86] = {"STX", 2, 3, "zero page"},
-    [0x8E] = {"STX", 3, 4, "absolute"},
-    [0x96] = {"STX", 2, 4, "zero page, y indexed"},
-    [0x84] = {"STY", 2, 3, "zero page"},
-    [0x8C] = {"STY", 3, 4, "absolute"},
-    [0x94] = {"STY", 2, 4, "zero page, x indexed"},
-    [0xAA] = {"TAX", 1, 2, ""},
-    [0xA8] = {"TAY", 1, 2, ""},
-    [0xBA] = {"TSX", 1, 2, ""},
-    [0x8A] = {"TXA", 1, 2, ""},
-    [0x9A] = {"TXS", 1, 2, ""},
-    [0x98] = {"TYA", 1, 2, ""},
+    [0x61] = {"ADC", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0x65] = {"ADC", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x69] = {"ADC", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0x6D] = {"ADC", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x71] = {"ADC", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0x75] = {"ADC", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0x79] = {"ADC", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0x7D] = {"ADC", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0x21] = {"AND", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0x25] = {"AND", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x29] = {"AND", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0x2D] = {"AND", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x31] = {"AND", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0x35] = {"AND", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0x39] = {"AND", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0x3D] = {"AND", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0x06] = {"ASL", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0x0A] = {"ASL", 1, 2, CPU_ADDR_ACCUMULATOR},
+    [0x0E] = {"ASL", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0x16] = {"ASL", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0x1E] = {"ASL", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0x90] = {"BCC", 2, 2, CPU_ADDR_RELATIVE},
+    [0xB0] = {"BCS", 2, 2, CPU_ADDR_RELATIVE},
+    [0xF0] = {"BEQ", 2, 2, CPU_ADDR_RELATIVE},
+    [0x24] = {"BIT", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x2C] = {"BIT", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x30] = {"BMI", 2, 2, CPU_ADDR_RELATIVE},
+    [0xD0] = {"BNE", 2, 2, CPU_ADDR_RELATIVE},
+    [0x10] = {"BPL", 2, 2, CPU_ADDR_RELATIVE},
+    [0x00] = {"BRK", 1, 7, CPU_ADDR_IMPLIED},
+    [0x50] = {"BVC", 2, 2, CPU_ADDR_RELATIVE},
+    [0x70] = {"BVS", 2, 2, CPU_ADDR_RELATIVE},
+    [0x18] = {"CLC", 1, 2, CPU_ADDR_IMPLIED},
+    [0xD8] = {"CLD", 1, 2, CPU_ADDR_IMPLIED},
+    [0x58] = {"CLI", 1, 2, CPU_ADDR_IMPLIED},
+    [0xB8] = {"CLV", 1, 2, CPU_ADDR_IMPLIED},
+    [0xC1] = {"CMP", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0xC5] = {"CMP", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xC9] = {"CMP", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xCD] = {"CMP", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xD1] = {"CMP", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0xD5] = {"CMP", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0xD9] = {"CMP", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0xDD] = {"CMP", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0xE0] = {"CPX", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xE4] = {"CPX", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xEC] = {"CPX", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xC0] = {"CPY", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xC4] = {"CPY", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xCC] = {"CPY", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xC6] = {"DEC", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0xCE] = {"DEC", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0xD6] = {"DEC", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0xDE] = {"DEC", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0xCA] = {"DEX", 1, 2, CPU_ADDR_IMPLIED},
+    [0x88] = {"DEY", 1, 2, CPU_ADDR_IMPLIED},
+    [0x41] = {"EOR", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0x45] = {"EOR", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x49] = {"EOR", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0x4D] = {"EOR", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x51] = {"EOR", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0x55] = {"EOR", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0x59] = {"EOR", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0x5D] = {"EOR", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0xE6] = {"INC", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0xEE] = {"INC", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0xF6] = {"INC", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0xFE] = {"INC", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0xE8] = {"INX", 1, 2, CPU_ADDR_IMPLIED},
+    [0xC8] = {"INY", 1, 2, CPU_ADDR_IMPLIED},
+    [0x4C] = {"JMP", 3, 3, CPU_ADDR_ABSOLUTE},
+    [0x6C] = {"JMP", 3, 5, CPU_ADDR_INDIRECT},
+    [0x20] = {"JSR", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0xA1] = {"LDA", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0xA5] = {"LDA", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xA9] = {"LDA", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xAD] = {"LDA", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xB1] = {"LDA", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0xB5] = {"LDA", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0xB9] = {"LDA", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0xBD] = {"LDA", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0xA2] = {"LDX", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xA6] = {"LDX", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xAE] = {"LDX", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xB6] = {"LDX", 2, 4, CPU_ADDR_ZERO_PAGE_Y},
+    [0xBE] = {"LDX", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0xA0] = {"LDY", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xA4] = {"LDY", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xAC] = {"LDY", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xB4] = {"LDY", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0xBC] = {"LDY", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0x46] = {"LSR", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0x4A] = {"LSR", 1, 2, CPU_ADDR_ACCUMULATOR},
+    [0x4E] = {"LSR", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0x56] = {"LSR", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0x5E] = {"LSR", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0xEA] = {"NOP", 1, 2, CPU_ADDR_IMPLIED},
+    [0x01] = {"ORA", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0x05] = {"ORA", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x09] = {"ORA", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0x0D] = {"ORA", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x11] = {"ORA", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0x15] = {"ORA", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0x19] = {"ORA", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0x1D] = {"ORA", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0x48] = {"PHA", 1, 3, CPU_ADDR_IMPLIED},
+    [0x08] = {"PHP", 1, 3, CPU_ADDR_IMPLIED},
+    [0x68] = {"PLA", 1, 4, CPU_ADDR_IMPLIED},
+    [0x28] = {"PLP", 1, 4, CPU_ADDR_IMPLIED},
+    [0x26] = {"ROL", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0x2A] = {"ROL", 1, 2, CPU_ADDR_ACCUMULATOR},
+    [0x2E] = {"ROL", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0x36] = {"ROL", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0x3E] = {"ROL", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0x66] = {"ROR", 2, 5, CPU_ADDR_ZERO_PAGE},
+    [0x6A] = {"ROR", 1, 2, CPU_ADDR_ACCUMULATOR},
+    [0x6E] = {"ROR", 3, 6, CPU_ADDR_ABSOLUTE},
+    [0x76] = {"ROR", 2, 6, CPU_ADDR_ZERO_PAGE_X},
+    [0x7E] = {"ROR", 3, 7, CPU_ADDR_ABSOLUTE_X},
+    [0x40] = {"RTI", 1, 6, CPU_ADDR_IMPLIED},
+    [0x60] = {"RTS", 1, 6, CPU_ADDR_IMPLIED},
+    [0xE1] = {"SBC", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0xE5] = {"SBC", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0xE9] = {"SBC", 2, 2, CPU_ADDR_IMMEDIATE},
+    [0xED] = {"SBC", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0xF1] = {"SBC", 2, 5, CPU_ADDR_INDIRECT_Y},
+    [0xF5] = {"SBC", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0xF9] = {"SBC", 3, 4, CPU_ADDR_ABSOLUTE_Y},
+    [0xFD] = {"SBC", 3, 4, CPU_ADDR_ABSOLUTE_X},
+    [0x38] = {"SEC", 1, 2, CPU_ADDR_IMPLIED},
+    [0xF8] = {"SED", 1, 2, CPU_ADDR_IMPLIED},
+    [0x78] = {"SEI", 1, 2, CPU_ADDR_IMPLIED},
+    [0x81] = {"STA", 2, 6, CPU_ADDR_INDIRECT_X},
+    [0x85] = {"STA", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x8D] = {"STA", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x91] = {"STA", 2, 6, CPU_ADDR_INDIRECT_Y},
+    [0x95] = {"STA", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0x99] = {"STA", 3, 5, CPU_ADDR_ABSOLUTE_Y},
+    [0x9D] = {"STA", 3, 5, CPU_ADDR_ABSOLUTE_X},
+    [0x86] = {"STX", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x8E] = {"STX", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x96] = {"STX", 2, 4, CPU_ADDR_ZERO_PAGE_Y},
+    [0x84] = {"STY", 2, 3, CPU_ADDR_ZERO_PAGE},
+    [0x8C] = {"STY", 3, 4, CPU_ADDR_ABSOLUTE},
+    [0x94] = {"STY", 2, 4, CPU_ADDR_ZERO_PAGE_X},
+    [0xAA] = {"TAX", 1, 2, CPU_ADDR_IMPLIED},
+    [0xA8] = {"TAY", 1, 2, CPU_ADDR_IMPLIED},
+    [0xBA] = {"TSX", 1, 2, CPU_ADDR_IMPLIED},
+    [0x8A] = {"TXA", 1, 2, CPU_ADDR_IMPLIED},
+    [0x9A] = {"TXS", 1, 2, CPU_ADDR_IMPLIED},
+    [0x98] = {"TYA", 1, 2, CPU_ADDR_IMPLIED},
 };
 
 
@@ -173,6 +193,80 @@ uint8_t flags = 0;
 // we only store the least significant byte of the stack pointer
 // because the most significant byte is always 0x01
 uint8_t reg_sp = CPU_STACK_SIZE - 1;
+uint16_t reg_pc = 0;
+
+
+/***************************** MEMORY BUS ****************************/
+
+// open bus until a cartridge maps its PRG ROM
+static const uint8_t cpu_unmapped[0x2000];
+const uint8_t *cpu_prg_map[4] = { cpu_unmapped, cpu_unmapped, cpu_unmapped, cpu_unmapped };
+uint8_t cpu_irq;
+bool cpu_nmi;
+uint64_t cpu_clock;
+
+uint8_t cpu_read(uint16_t addr) {
+    if (addr >= 0x8000) {
+        if (cdl_enabled) {
+            cdl_log_prg(addr, CDL_DATA);
+        }
+        return cpu_prg_map[(addr >> 13) & 3][addr & 0x1FFF];
+    }
+    if (addr < 0x2000) {
+        return mem[addr & 0x07FF];
+    }
+    if (addr < 0x4000) {
+        ppu_sync();
+        return ppu_read_register(addr);
+    }
+    if (addr >= CPU_PRG_RAM_ADDR_START) {
+        return prg_ram[addr & 0x1FFF];
+    }
+    return mem[addr];
+}
+
+uint8_t cpu_fetch(uint16_t pc, bool opcode) {
+    if (pc >= 0x8000) {
+        if (cdl_enabled) {
+            cdl_log_prg(pc, opcode ? CDL_CODE | CDL_OPCODE : CDL_CODE);
+        }
+        return cpu_prg_map[(pc >> 13) & 3][pc & 0x1FFF];
+    }
+    return cpu_read(pc);
+}
+
+void cpu_write(uint16_t addr, uint8_t value) {
+    if (addr >= 0x8000) {
+        mapper_write(addr, value);
+        return;
+    }
+    if (addr < 0x2000) {
+        mem[addr & 0x07FF] = value;
+        return;
+    }
+    if (addr < 0x4000) {
+        ppu_sync();
+        ppu_write_register(addr, value);
+        return;
+    }
+    if (addr == 0x4014) {
+        ppu_sync();
+        ppu_oam_dma(value);
+        return;
+    }
+    if (addr >= CPU_PRG_RAM_ADDR_START) {
+        prg_ram[addr & 0x1FFF] = value;
+        prg_ram_dirty = true;
+        return;
+    }
+    mem[addr] = value;
+}
+
+// write the result of a read-modify-write instruction and return it
+static uint8_t cpu_write_back(uint16_t addr, uint8_t value) {
+    cpu_write(addr, value);
+    return value;
+}
 
 
 /*********************** AUXILIARY FUNCTIONS ***********************/
@@ -196,7 +290,6 @@ void set_flags_n_z(uint8_t result) {
 
 void stack_push(uint8_t value) {
     mem[CPU_STACK_ADDR_START + reg_sp--] = value;
-    reg_sp--;
 }
 
 uint8_t stack_pull() {
@@ -232,49 +325,49 @@ uint16_t indirect_y(uint8_t addr) {
 void cpu_lda_immediate(uint8_t operand) { set_flags_n_z(reg_a = operand); }
 void cpu_lda_zero_page(uint8_t addr)   { cpu_lda_immediate(mem[addr]); }
 void cpu_lda_zero_page_x(uint8_t addr) { cpu_lda_immediate(mem[zero_page_x(addr)]); }
-void cpu_lda_absolute(uint16_t addr)   { cpu_lda_immediate(mem[addr]); }
-void cpu_lda_absolute_x(uint16_t addr) { cpu_lda_immediate(mem[addr + reg_x]); }
-void cpu_lda_absolute_y(uint16_t addr) { cpu_lda_immediate(mem[addr + reg_y]); }
-void cpu_lda_indirect_x(uint8_t addr)  { cpu_lda_immediate(mem[indirect_x(addr)]); }
-void cpu_lda_indirect_y(uint8_t addr)  { cpu_lda_immediate(mem[indirect_y(addr)]); }
+void cpu_lda_absolute(uint16_t addr)   { cpu_lda_immediate(cpu_read(addr)); }
+void cpu_lda_absolute_x(uint16_t addr) { cpu_lda_immediate(cpu_read(addr + reg_x)); }
+void cpu_lda_absolute_y(uint16_t addr) { cpu_lda_immediate(cpu_read(addr + reg_y)); }
+void cpu_lda_indirect_x(uint8_t addr)  { cpu_lda_immediate(cpu_read(indirect_x(addr))); }
+void cpu_lda_indirect_y(uint8_t addr)  { cpu_lda_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** LDX **************************/
 void cpu_ldx_immediate(uint8_t operand) { set_flags_n_z(reg_x = operand); }
 void cpu_ldx_zero_page(uint8_t addr)   { cpu_ldx_immediate(mem[addr]); }
 void cpu_ldx_zero_page_y(uint8_t addr) { cpu_ldx_immediate(mem[zero_page_y(addr)]); }
-void cpu_ldx_absolute(uint16_t addr)   { cpu_ldx_immediate(mem[addr]); }
-void cpu_ldx_absolute_y(uint16_t addr) { cpu_ldx_immediate(mem[addr + reg_y]); }
+void cpu_ldx_absolute(uint16_t addr)   { cpu_ldx_immediate(cpu_read(addr)); }
+void cpu_ldx_absolute_y(uint16_t addr) { cpu_ldx_immediate(cpu_read(addr + reg_y)); }
 
 
 /************************** LDY **************************/
 void cpu_ldy_immediate(uint8_t operand) { set_flags_n_z(reg_y = operand); }
 void cpu_ldy_zero_page(uint8_t addr)   { cpu_ldy_immediate(mem[addr]); }
 void cpu_ldy_zero_page_x(uint8_t addr) { cpu_ldy_immediate(mem[zero_page_x(addr)]); }
-void cpu_ldy_absolute(uint16_t addr)   { cpu_ldy_immediate(mem[addr]); }
-void cpu_ldy_absolute_x(uint16_t addr) { cpu_ldy_immediate(mem[addr + reg_x]); }
+void cpu_ldy_absolute(uint16_t addr)   { cpu_ldy_immediate(cpu_read(addr)); }
+void cpu_ldy_absolute_x(uint16_t addr) { cpu_ldy_immediate(cpu_read(addr + reg_x)); }
 
 
 /************************** STA **************************/
 void cpu_sta_zero_page(uint8_t addr)   { mem[addr] = reg_a; }
 void cpu_sta_zero_page_x(uint8_t addr) { mem[zero_page_x(addr)] = reg_a; }
-void cpu_sta_absolute(uint16_t addr)   { mem[addr] = reg_a; }
-void cpu_sta_absolute_x(uint16_t addr) { mem[addr + reg_x] = reg_a; }
-void cpu_sta_absolute_y(uint16_t addr) { mem[addr + reg_y] = reg_a; }
-void cpu_sta_indirect_x(uint8_t addr)  { mem[indirect_x(addr)] = reg_a; }
-void cpu_sta_indirect_y(uint8_t addr)  { mem[indirect_y(addr)] = reg_a; }
+void cpu_sta_absolute(uint16_t addr)   { cpu_write(addr, reg_a); }
+void cpu_sta_absolute_x(uint16_t addr) { cpu_write(addr + reg_x, reg_a); }
+void cpu_sta_absolute_y(uint16_t addr) { cpu_write(addr + reg_y, reg_a); }
+void cpu_sta_indirect_x(uint8_t addr)  { cpu_write(indirect_x(addr), reg_a); }
+void cpu_sta_indirect_y(uint8_t addr)  { cpu_write(indirect_y(addr), reg_a); }
 
 
 /************************** STX **************************/
 void cpu_stx_zero_page(uint8_t addr)   { mem[addr] = reg_x; }
 void cpu_stx_zero_page_y(uint8_t addr) { mem[zero_page_y(addr)] = reg_x; }
-void cpu_stx_absolute(uint16_t addr)   { mem[addr] = reg_x; }
+void cpu_stx_absolute(uint16_t addr)   { cpu_write(addr, reg_x); }
 
 
 /************************** STY **************************/
 void cpu_sty_zero_page(uint8_t addr)   { mem[addr] = reg_y; }
 void cpu_sty_zero_page_x(uint8_t addr) { mem[zero_page_x(addr)] = reg_y; }
-void cpu_sty_absolute(uint16_t addr)   { mem[addr] = reg_y; }
+void cpu_sty_absolute(uint16_t addr)   { cpu_write(addr, reg_y); }
 
 
 /************************** ADC **************************/
@@ -287,11 +380,11 @@ void cpu_adc_immediate(uint8_t operand) {
 }
 void cpu_adc_zero_page(uint8_t addr)   { cpu_adc_immediate(mem[addr]); }
 void cpu_adc_zero_page_x(uint8_t addr) { cpu_adc_immediate(mem[zero_page_x(addr)]); }
-void cpu_adc_absolute(uint16_t addr)   { cpu_adc_immediate(mem[addr]); }
-void cpu_adc_absolute_x(uint16_t addr) { cpu_adc_immediate(mem[(addr + reg_x) & 0xFFFF]); }
-void cpu_adc_absolute_y(uint16_t addr) { cpu_adc_immediate(mem[(addr + reg_y) & 0xFFFF]); }
-void cpu_adc_indirect_x(uint8_t addr)  { cpu_adc_immediate(mem[indirect_x(addr)]); }
-void cpu_adc_indirect_y(uint8_t addr)  { cpu_adc_immediate(mem[indirect_y(addr)]); }
+void cpu_adc_absolute(uint16_t addr)   { cpu_adc_immediate(cpu_read(addr)); }
+void cpu_adc_absolute_x(uint16_t addr) { cpu_adc_immediate(cpu_read(addr + reg_x)); }
+void cpu_adc_absolute_y(uint16_t addr) { cpu_adc_immediate(cpu_read(addr + reg_y)); }
+void cpu_adc_indirect_x(uint8_t addr)  { cpu_adc_immediate(cpu_read(indirect_x(addr))); }
+void cpu_adc_indirect_y(uint8_t addr)  { cpu_adc_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** SBC **************************/
@@ -304,25 +397,25 @@ void cpu_sbc_immediate(uint8_t operand) {
 }
 void cpu_sbc_zero_page(uint8_t addr)   { cpu_sbc_immediate(mem[addr]); }
 void cpu_sbc_zero_page_x(uint8_t addr) { cpu_sbc_immediate(mem[zero_page_x(addr)]); }
-void cpu_sbc_absolute(uint16_t addr)   { cpu_sbc_immediate(mem[addr]); }
-void cpu_sbc_absolute_x(uint16_t addr) { cpu_sbc_immediate(mem[addr + reg_x]); }
-void cpu_sbc_absolute_y(uint16_t addr) { cpu_sbc_immediate(mem[addr + reg_y]); }
-void cpu_sbc_indirect_x(uint8_t addr)  { cpu_sbc_immediate(mem[indirect_x(addr)]); }
-void cpu_sbc_indirect_y(uint8_t addr)  { cpu_sbc_immediate(mem[indirect_y(addr)]); }
+void cpu_sbc_absolute(uint16_t addr)   { cpu_sbc_immediate(cpu_read(addr)); }
+void cpu_sbc_absolute_x(uint16_t addr) { cpu_sbc_immediate(cpu_read(addr + reg_x)); }
+void cpu_sbc_absolute_y(uint16_t addr) { cpu_sbc_immediate(cpu_read(addr + reg_y)); }
+void cpu_sbc_indirect_x(uint8_t addr)  { cpu_sbc_immediate(cpu_read(indirect_x(addr))); }
+void cpu_sbc_indirect_y(uint8_t addr)  { cpu_sbc_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** INC **************************/
 void cpu_inc_zero_page(uint8_t addr)   { set_flags_n_z(++mem[addr]); }
 void cpu_inc_zero_page_x(uint8_t addr) { set_flags_n_z(++mem[zero_page_x(addr)]); }
-void cpu_inc_absolute(uint16_t addr)   { set_flags_n_z(++mem[addr]); }
-void cpu_inc_absolute_x(uint16_t addr) { set_flags_n_z(++mem[addr + reg_x]); }
+void cpu_inc_absolute(uint16_t addr)   { set_flags_n_z(cpu_write_back(addr, cpu_read(addr) + 1)); }
+void cpu_inc_absolute_x(uint16_t addr) { set_flags_n_z(cpu_write_back(addr + reg_x, cpu_read(addr + reg_x) + 1)); }
 
 
 /************************** DEC **************************/
 void cpu_dec_zero_page(uint8_t addr)   { set_flags_n_z(--mem[addr]); }
 void cpu_dec_zero_page_x(uint8_t addr) { set_flags_n_z(--mem[zero_page_x(addr)]); }
-void cpu_dec_absolute(uint16_t addr)   { set_flags_n_z(--mem[addr]); }
-void cpu_dec_absolute_x(uint16_t addr) { set_flags_n_z(--mem[addr + reg_x]); }
+void cpu_dec_absolute(uint16_t addr)   { set_flags_n_z(cpu_write_back(addr, cpu_read(addr) - 1)); }
+void cpu_dec_absolute_x(uint16_t addr) { set_flags_n_z(cpu_write_back(addr + reg_x, cpu_read(addr + reg_x) - 1)); }
 
 
 /******************* INX, INY, DEX, DEY ******************/
@@ -343,33 +436,33 @@ void cpu_tya() { set_flags_n_z(reg_a = reg_y); }
 void cpu_and_immediate(uint8_t operand) { set_flags_n_z(reg_a &= operand); }
 void cpu_and_zero_page(uint8_t addr)   { cpu_and_immediate(mem[addr]); }
 void cpu_and_zero_page_x(uint8_t addr) { cpu_and_immediate(mem[zero_page_x(addr)]); }
-void cpu_and_absolute(uint16_t addr)   { cpu_and_immediate(mem[addr]); }
-void cpu_and_absolute_x(uint16_t addr) { cpu_and_immediate(mem[addr + reg_x]); }
-void cpu_and_absolute_y(uint16_t addr) { cpu_and_immediate(mem[addr + reg_y]); }
-void cpu_and_indirect_x(uint8_t addr)  { cpu_and_immediate(mem[indirect_x(addr)]); }
-void cpu_and_indirect_y(uint8_t addr)  { cpu_and_immediate(mem[indirect_y(addr)]); }
+void cpu_and_absolute(uint16_t addr)   { cpu_and_immediate(cpu_read(addr)); }
+void cpu_and_absolute_x(uint16_t addr) { cpu_and_immediate(cpu_read(addr + reg_x)); }
+void cpu_and_absolute_y(uint16_t addr) { cpu_and_immediate(cpu_read(addr + reg_y)); }
+void cpu_and_indirect_x(uint8_t addr)  { cpu_and_immediate(cpu_read(indirect_x(addr))); }
+void cpu_and_indirect_y(uint8_t addr)  { cpu_and_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** EOR **************************/
 void cpu_eor_immediate(uint8_t operand) { set_flags_n_z(reg_a ^= operand); }
 void cpu_eor_zero_page(uint8_t addr)   { cpu_eor_immediate(mem[addr]); }
 void cpu_eor_zero_page_x(uint8_t addr) { cpu_eor_immediate(mem[zero_page_x(addr)]); }
-void cpu_eor_absolute(uint16_t addr)   { cpu_eor_immediate(mem[addr]); }
-void cpu_eor_absolute_x(uint16_t addr) { cpu_eor_immediate(mem[addr + reg_x]); }
-void cpu_eor_absolute_y(uint16_t addr) { cpu_eor_immediate(mem[addr + reg_y]); }
-void cpu_eor_indirect_x(uint8_t addr)  { cpu_eor_immediate(mem[indirect_x(addr)]); }
-void cpu_eor_indirect_y(uint8_t addr)  { cpu_eor_immediate(mem[indirect_y(addr)]); }
+void cpu_eor_absolute(uint16_t addr)   { cpu_eor_immediate(cpu_read(addr)); }
+void cpu_eor_absolute_x(uint16_t addr) { cpu_eor_immediate(cpu_read(addr + reg_x)); }
+void cpu_eor_absolute_y(uint16_t addr) { cpu_eor_immediate(cpu_read(addr + reg_y)); }
+void cpu_eor_indirect_x(uint8_t addr)  { cpu_eor_immediate(cpu_read(indirect_x(addr))); }
+void cpu_eor_indirect_y(uint8_t addr)  { cpu_eor_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** ORA **************************/
 void cpu_ora_immediate(uint8_t operand) { set_flags_n_z(reg_a |= operand); }
 void cpu_ora_zero_page(uint8_t addr)   { cpu_ora_immediate(mem[addr]); }
 void cpu_ora_zero_page_x(uint8_t addr) { cpu_ora_immediate(mem[zero_page_x(addr)]); }
-void cpu_ora_absolute(uint16_t addr)   { cpu_ora_immediate(mem[addr]); }
-void cpu_ora_absolute_x(uint16_t addr) { cpu_ora_immediate(mem[addr + reg_x]); }
-void cpu_ora_absolute_y(uint16_t addr) { cpu_ora_immediate(mem[addr + reg_y]); }
-void cpu_ora_indirect_x(uint8_t addr)  { cpu_ora_immediate(mem[indirect_x(addr)]); }
-void cpu_ora_indirect_y(uint8_t addr)  { cpu_ora_immediate(mem[indirect_y(addr)]); }
+void cpu_ora_absolute(uint16_t addr)   { cpu_ora_immediate(cpu_read(addr)); }
+void cpu_ora_absolute_x(uint16_t addr) { cpu_ora_immediate(cpu_read(addr + reg_x)); }
+void cpu_ora_absolute_y(uint16_t addr) { cpu_ora_immediate(cpu_read(addr + reg_y)); }
+void cpu_ora_indirect_x(uint8_t addr)  { cpu_ora_immediate(cpu_read(indirect_x(addr))); }
+void cpu_ora_indirect_y(uint8_t addr)  { cpu_ora_immediate(cpu_read(indirect_y(addr))); }
 
 
 /************************** CMP **************************/
@@ -379,11 +472,11 @@ void cpu_cmp_immediate(uint8_t operand) {
 }
 void cpu_cmp_zero_page(uint8_t addr)   { cpu_cmp_immediate(mem[addr]); }
 void cpu_cmp_zero_page_x(uint8_t addr) { cpu_cmp_immediate(mem[zero_page_x(addr)]); }
-void cpu_cmp_absolute(uint16_t addr)   { cpu_cmp_immediate(mem[addr]); }
-void cpu_cmp_absolute_x(uint16_t addr) { cpu_cmp_immediate(mem[addr + reg_x]); }
-void cpu_cmp_absolute_y(uint16_t addr) { cpu_cmp_immediate(mem[addr + reg_y]); }
-void cpu_cmp_indirect_x(uint8_t addr)  { cpu_cmp_immediate(mem[indirect_x(addr)]); }
-void cpu_cmp_indirect_y(uint8_t addr)  { cpu_cmp_immediate(mem[indirect_y(addr)]); }
+void cpu_cmp_absolute(uint16_t addr)   { cpu_cmp_immediate(cpu_read(addr)); }
+void cpu_cmp_absolute_x(uint16_t addr) { cpu_cmp_immediate(cpu_read(addr + reg_x)); }
+void cpu_cmp_absolute_y(uint16_t addr) { cpu_cmp_immediate(cpu_read(addr + reg_y)); }
+void cpu_cmp_indirect_x(uint8_t addr)  { cpu_cmp_immediate(cpu_read(indirect_x(addr))); }
+void cpu_cmp_indirect_y(uint8_t addr)  { cpu_cmp_immediate(cpu_read(indirect_y(addr))); }
 
 
 /******************************* CPX *******************************/
@@ -392,7 +485,7 @@ void cpu_cpx_immediate(uint8_t operand) {
     set_flag(CPU_FLAG_CARRY, reg_x >= operand);
 }
 void cpu_cpx_zero_page(uint8_t addr) { cpu_cpx_immediate(mem[addr]); }
-void cpu_cpx_absolute(uint16_t addr) { cpu_cpx_immediate(mem[addr]); }
+void cpu_cpx_absolute(uint16_t addr) { cpu_cpx_immediate(cpu_read(addr)); }
 
 
 /******************************* CPY *******************************/
@@ -401,14 +494,15 @@ void cpu_cpy_immediate(uint8_t operand) {
     set_flag(CPU_FLAG_CARRY, reg_y >= operand);
 }
 void cpu_cpy_zero_page(uint8_t addr) { cpu_cpy_immediate(mem[addr]); }
-void cpu_cpy_absolute(uint16_t addr) { cpu_cpy_immediate(mem[addr]); }
+void cpu_cpy_absolute(uint16_t addr) { cpu_cpy_immediate(cpu_read(addr)); }
 
 
 /******************************* BIT *******************************/
 void cpu_bit_absolute(uint16_t addr) {
-    set_flag(CPU_FLAG_ZERO, (reg_a & mem[addr]) == 0);
-    set_flag(CPU_FLAG_OVERFLOW, mem[addr] & CPU_FLAG_OVERFLOW);
-    set_flag(CPU_FLAG_NEGATIVE, mem[addr] & CPU_FLAG_NEGATIVE);
+    uint8_t value = cpu_read(addr);
+    set_flag(CPU_FLAG_ZERO, (reg_a & value) == 0);
+    set_flag(CPU_FLAG_OVERFLOW, value & CPU_FLAG_OVERFLOW);
+    set_flag(CPU_FLAG_NEGATIVE, value & CPU_FLAG_NEGATIVE);
 }
 void cpu_bit_zero_page(uint8_t addr) { cpu_bit_absolute(addr); }
 
@@ -419,8 +513,9 @@ void cpu_asl_accumulator() {
     set_flags_n_z(reg_a <<= 1);
 }
 void cpu_asl_absolute(uint16_t addr) {
-    set_flag(CPU_FLAG_CARRY, mem[addr] & BIT_7);
-    set_flags_n_z(mem[addr] <<= 1);
+    uint8_t value = cpu_read(addr);
+    set_flag(CPU_FLAG_CARRY, value & BIT_7);
+    set_flags_n_z(cpu_write_back(addr, value << 1));
 }
 void cpu_asl_absolute_x(uint16_t addr) { cpu_asl_absolute((addr + reg_x) & 0xFFFF); }
 void cpu_asl_zero_page(uint8_t addr)   { cpu_asl_absolute(addr); }
@@ -433,8 +528,9 @@ void cpu_lsr_accumulator() {
     set_flags_n_z(reg_a >>= 1);
 }
 void cpu_lsr_absolute(uint16_t addr) {
-    set_flag(CPU_FLAG_CARRY, mem[addr] & BIT_0);
-    set_flags_n_z(mem[addr] >>= 1);
+    uint8_t value = cpu_read(addr);
+    set_flag(CPU_FLAG_CARRY, value & BIT_0);
+    set_flags_n_z(cpu_write_back(addr, value >> 1));
 }
 void cpu_lsr_absolute_x(uint16_t addr) { cpu_lsr_absolute((addr + reg_x) & 0xFFFF); }
 void cpu_lsr_zero_page(uint8_t addr)   { cpu_lsr_absolute(addr); }
@@ -457,9 +553,9 @@ void cpu_rol_accumulator() {
 }
 void cpu_rol_absolute(uint16_t addr) {
     bool carry = get_flag(CPU_FLAG_CARRY);
-    set_flag(CPU_FLAG_CARRY, (mem[addr] >> 8) & 0x01);
-    mem[addr] = (mem[addr] << 1) | carry;
-    set_flags_n_z(mem[addr]);
+    uint8_t value = cpu_read(addr);
+    set_flag(CPU_FLAG_CARRY, (value >> 7) & 0x01);
+    set_flags_n_z(cpu_write_back(addr, (value << 1) | carry));
 }
 void cpu_rol_absolute_x(uint16_t addr) { cpu_rol_absolute((addr + reg_x) & 0xFFFF); }
 void cpu_rol_zero_page(uint8_t addr)   { cpu_rol_absolute(addr); }
@@ -482,9 +578,9 @@ void cpu_ror_accumulator() {
 }
 void cpu_ror_absolute(uint16_t addr) {
     bool carry = get_flag(CPU_FLAG_CARRY);
-    set_flag(CPU_FLAG_CARRY, mem[addr] & 0x01);
-    mem[addr] = (mem[addr] >> 1) | (carry << 7);
-    set_flags_n_z(mem[addr]);
+    uint8_t value = cpu_read(addr);
+    set_flag(CPU_FLAG_CARRY, value & 0x01);
+    set_flags_n_z(cpu_write_back(addr, (value >> 1) | (carry << 7)));
 }
 void cpu_ror_absolute_x(uint16_t addr) { cpu_ror_absolute((addr + reg_x) & 0xFFFF); }
 void cpu_ror_zero_page(uint8_t addr)   { cpu_ror_absolute(addr); }
@@ -509,3 +605,288 @@ void cpu_php() { stack_push(flags); }
 void cpu_pla() { set_flags_n_z(reg_a = stack_pull()); }
 void cpu_plp() { flags = stack_pull(); }
 
+
+/******************** JMP, JSR, RTS, RTI, BRK **********************/
+static void stack_push_16(uint16_t value) {
+    stack_push(value >> 8);
+    stack_push(value & 0xFF);
+}
+
+static uint16_t stack_pull_16() {
+    uint8_t low = stack_pull();
+    return stack_pull() << 8 | low;
+}
+
+// the vector of an interrupt, read like any other PRG ROM data
+static uint16_t read_vector(uint16_t addr) {
+    return cpu_read(addr) | cpu_read(addr + 1) << 8;
+}
+
+void cpu_jmp_absolute(uint16_t addr) { reg_pc = addr; }
+void cpu_jmp_indirect(uint16_t addr) {
+    // the high byte of the pointer is read from the same page
+    reg_pc = cpu_read(addr) | cpu_read((addr & 0xFF00) | ((addr + 1) & 0xFF)) << 8;
+}
+void cpu_jsr(uint16_t addr) {
+    stack_push_16(reg_pc - 1);
+    reg_pc = addr;
+}
+void cpu_rts() { reg_pc = stack_pull_16() + 1; }
+void cpu_rti() {
+    flags = stack_pull() & ~CPU_FLAG_BREAK;
+    reg_pc = stack_pull_16();
+}
+void cpu_brk() {
+    stack_push_16(reg_pc + 1);
+    stack_push(flags | CPU_FLAG_BREAK | CPU_FLAG_UNUSED);
+    set_flag(CPU_FLAG_INTERRUPT, true);
+    reg_pc = read_vector(CPU_VECTOR_IRQ);
+}
+
+// NMI and IRQ: like BRK, without the B flag, in 7 cycles between two instructions
+static void interrupt(uint16_t vector) {
+    stack_push_16(reg_pc);
+    stack_push((flags & ~CPU_FLAG_BREAK) | CPU_FLAG_UNUSED);
+    set_flag(CPU_FLAG_INTERRUPT, true);
+    reg_pc = read_vector(vector);
+    cpu_clock += 7 * CPU_DOTS_PER_CYCLE;
+}
+
+
+/**************************** BRANCHES *****************************/
+// one more cycle when taken, and another when the target is in another page
+static void branch(bool taken, uint8_t offset) {
+    uint16_t target = reg_pc + (int8_t)offset;
+    if (!taken) {
+        return;
+    }
+    cpu_clock += CPU_DOTS_PER_CYCLE * (((target ^ reg_pc) & 0xFF00) ? 2 : 1);
+    reg_pc = target;
+}
+void cpu_bpl(uint8_t offset) { branch(!get_flag(CPU_FLAG_NEGATIVE), offset); }
+void cpu_bmi(uint8_t offset) { branch(get_flag(CPU_FLAG_NEGATIVE), offset); }
+void cpu_bvc(uint8_t offset) { branch(!get_flag(CPU_FLAG_OVERFLOW), offset); }
+void cpu_bvs(uint8_t offset) { branch(get_flag(CPU_FLAG_OVERFLOW), offset); }
+void cpu_bcc(uint8_t offset) { branch(!get_flag(CPU_FLAG_CARRY), offset); }
+void cpu_bcs(uint8_t offset) { branch(get_flag(CPU_FLAG_CARRY), offset); }
+void cpu_bne(uint8_t offset) { branch(!get_flag(CPU_FLAG_ZERO), offset); }
+void cpu_beq(uint8_t offset) { branch(get_flag(CPU_FLAG_ZERO), offset); }
+
+
+/******************************* NOP *******************************/
+void cpu_nop() {}
+
+
+/***************************** CPU LOOP ****************************/
+
+void cpu_reset() {
+    memset(mem, 0, sizeof(mem));
+    reg_a = reg_x = reg_y = 0;
+    reg_sp = 0xFD;
+    flags = CPU_FLAG_INTERRUPT;
+    cpu_nmi = false;
+    reg_pc = read_vector(CPU_VECTOR_RESET);
+}
+
+void cpu_step() {
+    uint8_t opcode = cpu_fetch(reg_pc, true);
+    const CPUInstruction *inst = &cpu_instruction_table[opcode];
+    uint8_t op8 = 0;
+    uint16_t op16 = 0;
+
+    // undefined opcodes run as one byte NOPs
+    if (!inst->numBytes) {
+        reg_pc++;
+        cpu_clock += 2 * CPU_DOTS_PER_CYCLE;
+        return;
+    }
+    if (inst->numBytes > 1) {
+        op8 = op16 = cpu_fetch(reg_pc + 1, false);
+    }
+    if (inst->numBytes > 2) {
+        op16 |= cpu_fetch(reg_pc + 2, false) << 8;
+    }
+    reg_pc += inst->numBytes;
+
+    // memory is accessed on the last cycle of the instruction
+    cpu_clock += (inst->numCycles - 1) * CPU_DOTS_PER_CYCLE;
+    switch (opcode) {
+        case 0x00: cpu_brk(); break;
+        case 0x01: cpu_ora_indirect_x(op8); break;
+        case 0x05: cpu_ora_zero_page(op8); break;
+        case 0x06: cpu_asl_zero_page(op8); break;
+        case 0x08: cpu_php(); break;
+        case 0x09: cpu_ora_immediate(op8); break;
+        case 0x0A: cpu_asl_accumulator(); break;
+        case 0x0D: cpu_ora_absolute(op16); break;
+        case 0x0E: cpu_asl_absolute(op16); break;
+        case 0x10: cpu_bpl(op8); break;
+        case 0x11: cpu_ora_indirect_y(op8); break;
+        case 0x15: cpu_ora_zero_page_x(op8); break;
+        case 0x16: cpu_asl_zero_page_x(op8); break;
+        case 0x18: cpu_clc(); break;
+        case 0x19: cpu_ora_absolute_y(op16); break;
+        case 0x1D: cpu_ora_absolute_x(op16); break;
+        case 0x1E: cpu_asl_absolute_x(op16); break;
+        case 0x20: cpu_jsr(op16); break;
+        case 0x21: cpu_and_indirect_x(op8); break;
+        case 0x24: cpu_bit_zero_page(op8); break;
+        case 0x25: cpu_and_zero_page(op8); break;
+        case 0x26: cpu_rol_zero_page(op8); break;
+        case 0x28: cpu_plp(); break;
+        case 0x29: cpu_and_immediate(op8); break;
+        case 0x2A: cpu_rol_accumulator(); break;
+        case 0x2C: cpu_bit_absolute(op16); break;
+        case 0x2D: cpu_and_absolute(op16); break;
+        case 0x2E: cpu_rol_absolute(op16); break;
+        case 0x30: cpu_bmi(op8); break;
+        case 0x31: cpu_and_indirect_y(op8); break;
+        case 0x35: cpu_and_zero_page_x(op8); break;
+        case 0x36: cpu_rol_zero_page_x(op8); break;
+        case 0x38: cpu_sec(); break;
+        case 0x39: cpu_and_absolute_y(op16); break;
+        case 0x3D: cpu_and_absolute_x(op16); break;
+        case 0x3E: cpu_rol_absolute_x(op16); break;
+        case 0x40: cpu_rti(); break;
+        case 0x41: cpu_eor_indirect_x(op8); break;
+        case 0x45: cpu_eor_zero_page(op8); break;
+        case 0x46: cpu_lsr_zero_page(op8); break;
+        case 0x48: cpu_pha(); break;
+        case 0x49: cpu_eor_immediate(op8); break;
+        case 0x4A: cpu_lsr_accumulator(); break;
+        case 0x4C: cpu_jmp_absolute(op16); break;
+        case 0x4D: cpu_eor_absolute(op16); break;
+        case 0x4E: cpu_lsr_absolute(op16); break;
+        case 0x50: cpu_bvc(op8); break;
+        case 0x51: cpu_eor_indirect_y(op8); break;
+        case 0x55: cpu_eor_zero_page_x(op8); break;
+        case 0x56: cpu_lsr_zero_page_x(op8); break;
+        case 0x58: cpu_cli(); break;
+        case 0x59: cpu_eor_absolute_y(op16); break;
+        case 0x5D: cpu_eor_absolute_x(op16); break;
+        case 0x5E: cpu_lsr_absolute_x(op16); break;
+        case 0x60: cpu_rts(); break;
+        case 0x61: cpu_adc_indirect_x(op8); break;
+        case 0x65: cpu_adc_zero_page(op8); break;
+        case 0x66: cpu_ror_zero_page(op8); break;
+        case 0x68: cpu_pla(); break;
+        case 0x69: cpu_adc_immediate(op8); break;
+        case 0x6A: cpu_ror_accumulator(); break;
+        case 0x6C: cpu_jmp_indirect(op16); break;
+        case 0x6D: cpu_adc_absolute(op16); break;
+        case 0x6E: cpu_ror_absolute(op16); break;
+        case 0x70: cpu_bvs(op8); break;
+        case 0x71: cpu_adc_indirect_y(op8); break;
+        case 0x75: cpu_adc_zero_page_x(op8); break;
+        case 0x76: cpu_ror_zero_page_x(op8); break;
+        case 0x78: cpu_sei(); break;
+        case 0x79: cpu_adc_absolute_y(op16); break;
+        case 0x7D: cpu_adc_absolute_x(op16); break;
+        case 0x7E: cpu_ror_absolute_x(op16); break;
+        case 0x81: cpu_sta_indirect_x(op8); break;
+        case 0x84: cpu_sty_zero_page(op8); break;
+        case 0x85: cpu_sta_zero_page(op8); break;
+        case 0x86: cpu_stx_zero_page(op8); break;
+        case 0x88: cpu_dey(); break;
+        case 0x8A: cpu_txa(); break;
+        case 0x8C: cpu_sty_absolute(op16); break;
+        case 0x8D: cpu_sta_absolute(op16); break;
+        case 0x8E: cpu_stx_absolute(op16); break;
+        case 0x90: cpu_bcc(op8); break;
+        case 0x91: cpu_sta_indirect_y(op8); break;
+        case 0x94: cpu_sty_zero_page_x(op8); break;
+        case 0x95: cpu_sta_zero_page_x(op8); break;
+        case 0x96: cpu_stx_zero_page_y(op8); break;
+        case 0x98: cpu_tya(); break;
+        case 0x99: cpu_sta_absolute_y(op16); break;
+        case 0x9A: cpu_txs(); break;
+        case 0x9D: cpu_sta_absolute_x(op16); break;
+        case 0xA0: cpu_ldy_immediate(op8); break;
+        case 0xA1: cpu_lda_indirect_x(op8); break;
+        case 0xA2: cpu_ldx_immediate(op8); break;
+        case 0xA4: cpu_ldy_zero_page(op8); break;
+        case 0xA5: cpu_lda_zero_page(op8); break;
+        case 0xA6: cpu_ldx_zero_page(op8); break;
+        case 0xA8: cpu_tay(); break;
+        case 0xA9: cpu_lda_immediate(op8); break;
+        case 0xAA: cpu_tax(); break;
+        case 0xAC: cpu_ldy_absolute(op16); break;
+        case 0xAD: cpu_lda_absolute(op16); break;
+        case 0xAE: cpu_ldx_absolute(op16); break;
+        case 0xB0: cpu_bcs(op8); break;
+        case 0xB1: cpu_lda_indirect_y(op8); break;
+        case 0xB4: cpu_ldy_zero_page_x(op8); break;
+        case 0xB5: cpu_lda_zero_page_x(op8); break;
+        case 0xB6: cpu_ldx_zero_page_y(op8); break;
+        case 0xB8: cpu_clv(); break;
+        case 0xB9: cpu_lda_absolute_y(op16); break;
+        case 0xBA: cpu_tsx(); break;
+        case 0xBC: cpu_ldy_absolute_x(op16); break;
+        case 0xBD: cpu_lda_absolute_x(op16); break;
+        case 0xBE: cpu_ldx_absolute_y(op16); break;
+        case 0xC0: cpu_cpy_immediate(op8); break;
+        case 0xC1: cpu_cmp_indirect_x(op8); break;
+        case 0xC4: cpu_cpy_zero_page(op8); break;
+        case 0xC5: cpu_cmp_zero_page(op8); break;
+        case 0xC6: cpu_dec_zero_page(op8); break;
+        case 0xC8: cpu_iny(); break;
+        case 0xC9: cpu_cmp_immediate(op8); break;
+        case 0xCA: cpu_dex(); break;
+        case 0xCC: cpu_cpy_absolute(op16); break;
+        case 0xCD: cpu_cmp_absolute(op16); break;
+        case 0xCE: cpu_dec_absolute(op16); break;
+        case 0xD0: cpu_bne(op8); break;
+        case 0xD1: cpu_cmp_indirect_y(op8); break;
+        case 0xD5: cpu_cmp_zero_page_x(op8); break;
+        case 0xD6: cpu_dec_zero_page_x(op8); break;
+        case 0xD8: cpu_cld(); break;
+        case 0xD9: cpu_cmp_absolute_y(op16); break;
+        case 0xDD: cpu_cmp_absolute_x(op16); break;
+        case 0xDE: cpu_dec_absolute_x(op16); break;
+        case 0xE0: cpu_cpx_immediate(op8); break;
+        case 0xE1: cpu_sbc_indirect_x(op8); break;
+        case 0xE4: cpu_cpx_zero_page(op8); break;
+        case 0xE5: cpu_sbc_zero_page(op8); break;
+        case 0xE6: cpu_inc_zero_page(op8); break;
+        case 0xE8: cpu_inx(); break;
+        case 0xE9: cpu_sbc_immediate(op8); break;
+        case 0xEA: cpu_nop(); break;
+        case 0xEC: cpu_cpx_absolute(op16); break;
+        case 0xED: cpu_sbc_absolute(op16); break;
+        case 0xEE: cpu_inc_absolute(op16); break;
+        case 0xF0: cpu_beq(op8); break;
+        case 0xF1: cpu_sbc_indirect_y(op8); break;
+        case 0xF5: cpu_sbc_zero_page_x(op8); break;
+        case 0xF6: cpu_inc_zero_page_x(op8); break;
+        case 0xF8: cpu_sed(); break;
+        case 0xF9: cpu_sbc_absolute_y(op16); break;
+        case 0xFD: cpu_sbc_absolute_x(op16); break;
+        case 0xFE: cpu_inc_absolute_x(op16); break;
+    }
+    cpu_clock += CPU_DOTS_PER_CYCLE;
+}
+
+void cpu_run(uint64_t until) {
+    while (cpu_clock < until) {
+        // events the program sees without touching a register
+        if (cpu_clock >= ppu_event_at) {
+            ppu_sync();
+        }
+        if (cpu_clock >= mapper_irq_at) {
+            mapper_sync(cpu_clock);
+        }
+        if (cpu_nmi) {
+            cpu_nmi = false;
+            interrupt(CPU_VECTOR_NMI);
+        } else if (cpu_irq && !(flags & CPU_FLAG_INTERRUPT)) {
+            interrupt(CPU_VECTOR_IRQ);
+        }
+        cpu_step();
+    }
+}
+
+void cpu_run_frame() {
+    // the PPU stopped on the last frame boundary, the CPU may be a few dots past it
+    cpu_run((ppu.clock / PPU_DOTS_PER_FRAME + 1) * PPU_DOTS_PER_FRAME);
+    ppu_run_frame();
+}
@@ -16,6 +16,14 @@
     $2008–$3FFF   PPU mirror        8184     Mirrors of $2000–$2007 (repeats every 8 bytes)
     $4000-$4017   I/O Registers     24       Handles input/output operations. Includes APU
     $4020-$FFFF   Cartridge ROM     Varies   PRG ROM, PRG RAM, and mapper registers
+
+    Instructions reach memory through cpu_read() and cpu_write(), except for the zero
+    page and the stack which are always internal RAM and use `mem` directly:
+      - $0000-$1FFF is internal RAM, mirrored every 2 KB
+      - $2000-$3FFF are the PPU registers, mirrored every 8 bytes (ppu.h)
+      - $6000-$7FFF is the cartridge PRG RAM (`prg_ram`); writes set `prg_ram_dirty`
+      - $8000-$FFFF is PRG ROM, read through four 8 KB pages in `cpu_prg_map`; writes
+        go to the mapper registers (mapper.h)
 */
 
 #include <stdbool.h>
@@ -45,7 +53,14 @@
 #define CPU_APU_SIZE                 24
 #define CPU_CARTRIDGE_ADDR_START 0x4020
 #define CPU_CARTRIDGE_SIZE        49120
-#define CPU_MEM_SIZE             0xFFFF // 64 KB
+#define CPU_PRG_RAM_ADDR_START   0x6000
+#define CPU_PRG_RAM_SIZE           8192
+#define CPU_PRG_ROM_ADDR_START   0x8000
+#define CPU_MEM_SIZE            0x10000 // 64 KB
+#define CPU_VECTOR_NMI           0xFFFA
+#define CPU_VECTOR_RESET         0xFFFC
+#define CPU_VECTOR_IRQ           0xFFFE
+#define CPU_DOTS_PER_CYCLE            3 // PPU dots
 
 
 /**************************** CPU STATE ****************************/
@@ -55,6 +70,44 @@ extern uint8_t reg_x;       // index register X
 extern uint8_t reg_y;       // index register Y
 extern uint8_t flags;       // each bit is a flag (see below)
 extern uint8_t reg_sp;      // stack pointer
+extern uint16_t reg_pc;     // program counter
+
+extern const uint8_t *cpu_prg_map[4]; // PRG ROM pages mapped at $8000, $A000, $C000 and $E000
+extern uint8_t cpu_irq;     // IRQ line, one bit per source (see CPUIrq), asserted while not 0
+extern bool cpu_nmi;        // NMI pending, raised by the PPU at the start of vblank
+extern uint64_t cpu_clock;  // time of the CPU, in PPU dots (3 per cycle) since power on
+
+typedef enum CPUIrq {
+    CPU_IRQ_MAPPER = 0b00000001, // cartridge mapper (e.g. MMC3 scanline counter)
+} CPUIrq;
+
+uint8_t cpu_read(uint16_t addr);
+void cpu_write(uint16_t addr, uint8_t value);
+// instruction fetch (opcode or operand byte), logged as code instead of data
+uint8_t cpu_fetch(uint16_t pc, bool opcode);
+
+
+/***************************** CPU LOOP *****************************
+    cpu_reset() powers the CPU on once the cartridge has mapped its banks: internal
+    RAM is cleared and the program starts at the RESET vector.
+
+    cpu_step() runs one instruction. The opcode and operands are fetched through
+    cpu_fetch(), so the code/data logger sees them as code, then the instruction
+    function below is called with the operand. `cpu_clock` advances by the cycles of
+    the instruction table, memory being accessed on the last one; a taken branch
+    costs one more cycle, and another across a page, other page crossings are not
+    counted. Undefined opcodes run as one byte NOPs.
+
+    cpu_run() steps until `cpu_clock` reaches `until`; cpu_run_frame() runs the
+    CPU to the end of the current PPU frame, then ends it (ppu_run_frame()). Before
+    each instruction it catches the PPU and the mapper up if `ppu_event_at` or
+    `mapper_irq_at` has passed, then takes a pending NMI, or the IRQ while the I
+    flag is clear (7 cycles each, through the vectors at $FFFA and $FFFE).
+*/
+void cpu_reset();
+void cpu_step();
+void cpu_run(uint64_t until);
+void cpu_run_frame();
 
 /*  7  bit  0
     ---- ----
@@ -74,6 +127,8 @@ typedef enum CPUFlags {
     CPU_FLAG_ZERO      = 0b00000010, // Z flag mask (Zerp)
     CPU_FLAG_INTERRUPT = 0b00000100, // I flag mask (Interrupt Disable)
     CPU_FLAG_DECIMAL   = 0b00001000, // D flag mask (Decimal)
+    CPU_FLAG_BREAK     = 0b00010000, // B flag mask, only in the copy pushed by BRK and PHP
+    CPU_FLAG_UNUSED    = 0b00100000, // U flag mask, always 1 when pushed
     CPU_FLAG_OVERFLOW  = 0b01000000, // V flag mask (Overflow)
     CPU_FLAG_NEGATIVE  = 0b10000000  // N flag mask (Negative)
 } CPUFlags;
@@ -81,13 +136,32 @@ typedef enum CPUFlags {
 
 /************************** LOOK UP TABLE **************************/
 
+typedef enum CPUAddrMode {
+    CPU_ADDR_IMPLIED = 0,  // no operand, or undefined opcode
+    CPU_ADDR_ACCUMULATOR,  // ASL A
+    CPU_ADDR_IMMEDIATE,    // LDA #$nn
+    CPU_ADDR_ZERO_PAGE,    // LDA $nn
+    CPU_ADDR_ZERO_PAGE_X,  // LDA $nn,X
+    CPU_ADDR_ZERO_PAGE_Y,  // LDX $nn,Y
+    CPU_ADDR_ABSOLUTE,     // LDA $nnnn
+    CPU_ADDR_ABSOLUTE_X,   // LDA $nnnn,X
+    CPU_ADDR_ABSOLUTE_Y,   // LDA $nnnn,Y
+    CPU_ADDR_INDIRECT,     // JMP ($nnnn)
+    CPU_ADDR_INDIRECT_X,   // LDA ($nn,X)
+    CPU_ADDR_INDIRECT_Y,   // LDA ($nn),Y
+    CPU_ADDR_RELATIVE,     // BNE $rr
+} CPUAddrMode;
+
 typedef struct {
     const char* mnemonic;
     uint8_t numBytes;
     uint8_t numCycles;
-    const char* addr_mode;
+    uint8_t addr_mode;     // CPUAddrMode
 } CPUInstruction;
 
+// readable name of each CPUAddrMode, "" for implied
+extern const char *cpu_addr_mode_names[];
+
 // lookup table (LUT) for the number of bytes and cycles each instruction takes
 // the index is the opcode
 extern CPUInstruction cpu_instruction_table[];
@@ -508,4 +582,51 @@ void cpu_pla();
 void cpu_plp();
 
 
+/************************ JMP, JSR, RTS, RTI, BRK *******************
+    Jumps and Subroutines (flags: none, except RTI: all, BRK: I)
+    JMP $aaaa       $4C     3   cpu_jmp_absolute
+    JMP ($aaaa)     $6C     3   cpu_jmp_indirect     the pointer wraps in its page
+    JSR $aaaa       $20     3   cpu_jsr              push the address of its last byte
+    RTS             $60     1   cpu_rts              pull it, return to the next byte
+    RTI             $40     1   cpu_rti              pull P then PC
+    BRK             $00     1   cpu_brk              push PC + 1 and P (B set), jump to the IRQ vector
+
+    The instruction was fetched and `reg_pc` points to the next one when they run.
+*/
+void cpu_jmp_absolute(uint16_t addr);
+void cpu_jmp_indirect(uint16_t addr);
+void cpu_jsr(uint16_t addr);
+void cpu_rts();
+void cpu_rti();
+void cpu_brk();
+
+
+/**************************** BRANCHES *****************************
+    Branch Group, relative to the next instruction (flags: none)
+    BPL $rr     $10     2   cpu_bpl      branch if N = 0
+    BMI $rr     $30     2   cpu_bmi      branch if N = 1
+    BVC $rr     $50     2   cpu_bvc      branch if V = 0
+    BVS $rr     $70     2   cpu_bvs      branch if V = 1
+    BCC $rr     $90     2   cpu_bcc      branch if C = 0
+    BCS $rr     $B0     2   cpu_bcs      branch if C = 1
+    BNE $rr     $D0     2   cpu_bne      branch if Z = 0
+    BEQ $rr     $F0     2   cpu_beq      branch if Z = 1
+*/
+void cpu_bpl(uint8_t offset);
+void cpu_bmi(uint8_t offset);
+void cpu_bvc(uint8_t offset);
+void cpu_bvs(uint8_t offset);
+void cpu_bcc(uint8_t offset);
+void cpu_bcs(uint8_t offset);
+void cpu_bne(uint8_t offset);
+void cpu_beq(uint8_t offset);
+
+
+/******************************* NOP *******************************
+    No Operation (flags: none)
+    NOP         $EA     1   cpu_nop
+*/
+void cpu_nop();
+
+
 #endif /* CPU_H */
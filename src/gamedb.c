@@ -0,0 +1,59 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gamedb.h"
+
+
+/*
+    The table MUST stay sorted by crc32 (ascending), gamedb_lookup() bisects it.
+
+    Only dumps whose header is wrong, or that need a hint, belong here: a correct
+    header already gives the core everything it needs. Example entry:
+
+    { 0x12345678, GAMEDB_OVERRIDE_MAPPER | GAMEDB_OVERRIDE_MIRRORING, GAMEDB_HINT_IDLE_LOOP,
+      .mapper = 4, .mirroring = 1, .idle_loop = 0xC0DE },
+
+    The last element is a terminator that keeps the array non-empty; it is not searched.
+
+    The table ships empty: no entry has been verified against a dump yet, so header
+    overrides and hints (GAMEDB_HINT_ACCURATE_PPU for the "auto" renderer,
+    GAMEDB_HINT_MMC3_REV_A) do nothing until entries are added.
+*/
+static const GameDBEntry gamedb_entries[] = {
+    { 0 } // terminator
+};
+
+#define GAMEDB_COUNT (sizeof(gamedb_entries) / sizeof(gamedb_entries[0]) - 1)
+
+
+bool gamedb_sorted() {
+    // by pointer: with the table empty an index bound would compare against 0
+    for (const GameDBEntry *e = gamedb_entries; e + 1 < gamedb_entries + GAMEDB_COUNT; e++) {
+        if (e[0].crc32 >= e[1].crc32) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const GameDBEntry *gamedb_lookup(uint32_t crc32) {
+    size_t lo = 0, hi = GAMEDB_COUNT;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint32_t key = gamedb_entries[mid].crc32;
+        if (key == crc32) {
+            return &gamedb_entries[mid];
+        }
+        if (key < crc32) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+unsigned gamedb_size() {
+    return GAMEDB_COUNT;
+}
@@ -0,0 +1,56 @@
+#ifndef GAMEDB_H
+#define GAMEDB_H
+
+/*
+    Embedded game database.
+
+    Entries are keyed by the CRC-32 of PRG ROM + CHR ROM (iNES header and trainer
+    excluded), which is the hash used by No-Intro and NesCartDB. They override header
+    fields known to be wrong in common bad dumps and attach per-game hints.
+
+    The table is a static array sorted by crc32 and searched with a binary search,
+    so it costs nothing at startup and lives in read-only memory.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// which fields of a GameDBEntry replace the values parsed from the header
+typedef enum GameDBOverride {
+    GAMEDB_OVERRIDE_MAPPER    = 0b00000001, // mapper and submapper
+    GAMEDB_OVERRIDE_MIRRORING = 0b00000010, // hard-wired nametable mirroring
+    GAMEDB_OVERRIDE_TIMING    = 0b00000100, // CPU/PPU timing (region)
+    GAMEDB_OVERRIDE_BATTERY   = 0b00001000, // battery-backed PRG RAM
+} GameDBOverride;
+
+// per-game hints for the emulator core
+typedef enum GameDBHint {
+    GAMEDB_HINT_ACCURATE_PPU  = 0b00000001, // relies on mid-scanline PPU tricks, use the dot renderer
+    GAMEDB_HINT_IDLE_LOOP     = 0b00000010, // `idle_loop` is the PC of the frame wait loop
+    GAMEDB_HINT_MMC3_REV_A    = 0b00000100, // MMC3 IRQ does not fire when reloaded with 0 (MMC3A, NEC)
+    GAMEDB_HINT_BUS_CONFLICTS = 0b00001000, // mapper register writes are ANDed with ROM contents
+} GameDBHint;
+
+typedef struct {
+    uint32_t crc32;          // CRC-32 of PRG ROM + CHR ROM
+    uint8_t  overrides;      // GameDBOverride mask
+    uint8_t  hints;          // GameDBHint mask
+    uint16_t mapper;
+    uint8_t  submapper;
+    uint8_t  mirroring;      // 0 horizontal, 1 vertical
+    uint8_t  timing;         // 0 NTSC, 1 PAL, 2 multi, 3 Dendy
+    uint8_t  battery;        // 1 if PRG RAM is battery backed
+    uint16_t idle_loop;      // CPU address, valid with GAMEDB_HINT_IDLE_LOOP
+} GameDBEntry;
+
+// return the entry for a PRG+CHR CRC-32, or NULL if the game is unknown
+const GameDBEntry *gamedb_lookup(uint32_t crc32);
+
+// number of entries in the embedded table
+unsigned gamedb_size();
+
+// true if the table is sorted by crc32 without duplicates, as the lookup requires;
+// checked by aioNES_check rather than on every lookup
+bool gamedb_sorted();
+
+#endif /* GAMEDB_H */
@@ -0,0 +1,29 @@
+#ifndef HASH_H
+#define HASH_H
+
+/*
+    CRC-32 (ISO-HDLC, the zlib/No-Intro/NesCartDB polynomial 0xEDB88320).
+
+    Two implementations are selected at runtime:
+      - PCLMULQDQ folding (x86 with CLMUL + SSE4.1), used for buffers of 64 bytes or more
+      - slice-by-8 table lookup, used everywhere else and as the portable fallback
+
+    The SSE4.2 `crc32` instruction is not used: it implements CRC-32C (Castagnoli),
+    whose values do not match the hashes published by ROM databases.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+// build the lookup tables and probe the CPU features.
+// called implicitly by hash_crc32(), but must be called once before
+// hashing from several threads at the same time
+void hash_init();
+
+// continue a CRC-32 over `len` bytes of `data`; start with crc = 0
+uint32_t hash_crc32(uint32_t crc, const void *data, size_t len);
+
+// same as hash_crc32(), forcing the portable slice-by-8 implementation
+uint32_t hash_crc32_slice8(uint32_t crc, const void *data, size_t len);
+
+#endif /* HASH_H */
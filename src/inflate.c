@@ -0,0 +1,331 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "inflate.h"
+
+#define INFLATE_MAX_BITS  15
+#define INFLATE_FAST_MASK ((1 << INFLATE_FAST_BITS) - 1)
+
+
+/**************************** CONSTANTS ****************************/
+
+// base lengths and extra bits for length symbols 257..285
+static const uint16_t length_base[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t length_extra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+// base distances and extra bits for distance symbols 0..29
+static const uint16_t dist_base[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t dist_extra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// order of the code length code lengths in a dynamic block header
+static const uint8_t clen_order[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+
+/***************************** STATE *****************************/
+
+typedef struct {
+    uint16_t fast[1 << INFLATE_FAST_BITS]; // (length << 9) | symbol, 0 for longer codes
+    uint16_t count[INFLATE_MAX_BITS + 1];  // number of codes of each length
+    uint16_t symbol[288];                  // symbols ordered by canonical code
+} Huffman;
+
+typedef struct {
+    const uint8_t *in, *in_end;
+    uint64_t bitbuf;
+    int bitcnt;                            // negative once the input is overrun
+    uint8_t *out, *out_start, *out_end;
+} Inflate;
+
+
+/*************************** BIT READER **************************/
+
+// top the buffer up to 57+ bits while there is input left
+static inline void refill(Inflate *s) {
+    while (s->bitcnt <= 56 && s->in < s->in_end) {
+        s->bitbuf |= (uint64_t)*s->in++ << s->bitcnt;
+        s->bitcnt += 8;
+    }
+}
+
+static inline void consume(Inflate *s, int n) {
+    s->bitbuf >>= n;
+    s->bitcnt -= n;
+}
+
+static inline uint32_t bits(Inflate *s, int n) {
+    uint32_t v;
+    if (s->bitcnt < n) {
+        refill(s);
+    }
+    v = s->bitbuf & ((1u << n) - 1);
+    consume(s, n);
+    return v;
+}
+
+
+/***************************** HUFFMAN ****************************/
+
+// build a decoding table; incomplete codes are allowed (single distance code),
+// over-subscribed ones are rejected
+static bool huffman_build(Huffman *h, const uint8_t *lengths, int n) {
+    uint16_t offs[INFLATE_MAX_BITS + 2];
+    uint16_t next_code[INFLATE_MAX_BITS + 1];
+    int left = 1, code = 0;
+
+    memset(h->count, 0, sizeof(h->count));
+    memset(h->fast, 0, sizeof(h->fast));
+    for (int i = 0; i < n; i++) {
+        h->count[lengths[i]]++;
+    }
+    h->count[0] = 0;
+
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+
+    offs[1] = 0;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        offs[len + 1] = offs[len] + h->count[len];
+        next_code[len] = code;
+        code = (code + h->count[len]) << 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int len = lengths[i];
+        if (!len) {
+            continue;
+        }
+        h->symbol[offs[len]++] = i;
+        if (len <= INFLATE_FAST_BITS) {
+            // codes are stored MSB first but read LSB first: index by the reversed code
+            uint32_t rev = 0, c = next_code[len];
+            for (int b = 0; b < len; b++) {
+                rev = (rev << 1) | ((c >> b) & 1);
+            }
+            for (uint32_t j = rev; j < (1u << INFLATE_FAST_BITS); j += 1u << len) {
+                h->fast[j] = (len << 9) | i;
+            }
+        }
+        next_code[len]++;
+    }
+    return true;
+}
+
+// canonical decode one bit at a time, for codes longer than INFLATE_FAST_BITS
+static int huffman_decode_slow(Inflate *s, const Huffman *h) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        code |= s->bitbuf & 1;
+        consume(s, 1);
+        int count = h->count[len];
+        if (code - count < first) {
+            return h->symbol[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static inline int huffman_decode(Inflate *s, const Huffman *h) {
+    if (s->bitcnt < INFLATE_MAX_BITS) {
+        refill(s);
+    }
+    uint16_t e = h->fast[s->bitbuf & INFLATE_FAST_MASK];
+    if (e) {
+        consume(s, e >> 9);
+        return e & 0x1FF;
+    }
+    return huffman_decode_slow(s, h);
+}
+
+
+/***************************** BLOCKS *****************************/
+
+static bool inflate_stored(Inflate *s) {
+    uint32_t len, nlen;
+
+    // skip to the byte boundary, then give back the whole bytes still buffered
+    consume(s, s->bitcnt & 7);
+    len = bits(s, 16);
+    nlen = bits(s, 16);
+    if (s->bitcnt < 0 || len != (~nlen & 0xFFFF)) {
+        return false;
+    }
+    s->in -= s->bitcnt >> 3;
+    s->bitbuf = 0;
+    s->bitcnt = 0;
+
+    if (len > (size_t)(s->in_end - s->in) || len > (size_t)(s->out_end - s->out)) {
+        return false;
+    }
+    memcpy(s->out, s->in, len);
+    s->out += len;
+    s->in += len;
+    return true;
+}
+
+static bool inflate_codes(Inflate *s, const Huffman *lit, const Huffman *dist) {
+    for (;;) {
+        int sym = huffman_decode(s, lit);
+        if (sym < 256) {
+            if (sym < 0 || s->out == s->out_end) {
+                return false;
+            }
+            *s->out++ = sym;
+            continue;
+        }
+        if (sym == 256) {
+            return s->bitcnt >= 0;
+        }
+
+        sym -= 257;
+        if (sym >= 29) {
+            return false;
+        }
+        size_t len = length_base[sym] + bits(s, length_extra[sym]);
+
+        sym = huffman_decode(s, dist);
+        if (sym < 0 || sym >= 30) {
+            return false;
+        }
+        size_t d = dist_base[sym] + bits(s, dist_extra[sym]);
+
+        if (s->bitcnt < 0 || d > (size_t)(s->out - s->out_start) || len > (size_t)(s->out_end - s->out)) {
+            return false;
+        }
+
+        const uint8_t *from = s->out - d;
+        if (d >= 8 && s->out + len + 8 <= s->out_end) {
+            // non-overlapping 8-byte chunks, may write up to 7 bytes past the match
+            uint8_t *to = s->out;
+            for (size_t i = 0; i < len; i += 8) {
+                memcpy(to + i, from + i, 8);
+            }
+            s->out += len;
+        } else {
+            while (len--) {
+                *s->out++ = *from++;
+            }
+        }
+    }
+}
+
+// the fixed tables are cheap to build and keeping them on the stack
+// lets several threads decode at once
+static bool inflate_fixed(Inflate *s) {
+    Huffman lit, dist;
+    uint8_t lengths[288];
+    int i = 0;
+
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < 288; i++) lengths[i] = 8;
+    huffman_build(&lit, lengths, 288);
+    for (i = 0; i < 30; i++) lengths[i] = 5;
+    huffman_build(&dist, lengths, 30);
+
+    return inflate_codes(s, &lit, &dist);
+}
+
+static bool inflate_dynamic(Inflate *s) {
+    Huffman lit, dist;
+    uint8_t lengths[288 + 32];
+    int nlen = bits(s, 5) + 257;
+    int ndist = bits(s, 5) + 1;
+    int ncode = bits(s, 4) + 4;
+
+    if (nlen > 286 || ndist > 30) {
+        return false;
+    }
+
+    // code length code
+    memset(lengths, 0, 19);
+    for (int i = 0; i < ncode; i++) {
+        lengths[clen_order[i]] = bits(s, 3);
+    }
+    if (!huffman_build(&lit, lengths, 19)) {
+        return false;
+    }
+
+    // literal/length and distance code lengths, as one sequence
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = huffman_decode(s, &lit);
+        int len = 0, rep;
+        if (sym < 0) {
+            return false;
+        }
+        if (sym < 16) {
+            lengths[i++] = sym;
+            continue;
+        }
+        if (sym == 16) {
+            if (i == 0) {
+                return false;
+            }
+            len = lengths[i - 1];
+            rep = 3 + bits(s, 2);
+        } else if (sym == 17) {
+            rep = 3 + bits(s, 3);
+        } else {
+            rep = 11 + bits(s, 7);
+        }
+        if (i + rep > nlen + ndist) {
+            return false;
+        }
+        while (rep--) {
+            lengths[i++] = len;
+        }
+    }
+    if (s->bitcnt < 0 || lengths[256] == 0) {
+        return false;
+    }
+
+    if (!huffman_build(&lit, lengths, nlen) || !huffman_build(&dist, lengths + nlen, ndist)) {
+        return false;
+    }
+    return inflate_codes(s, &lit, &dist);
+}
+
+
+/***************************** PUBLIC *****************************/
+
+bool inflate_raw(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len, size_t *produced) {
+    Inflate s = { in, in + in_len, 0, 0, out, out, out + out_len };
+    bool last, ok;
+
+    do {
+        last = bits(&s, 1);
+        switch (bits(&s, 2)) {
+            case 0:  ok = inflate_stored(&s);  break;
+            case 1:  ok = inflate_fixed(&s);   break;
+            case 2:  ok = inflate_dynamic(&s); break;
+            default: ok = false;               break;
+        }
+    } while (ok && !last);
+
+    if (produced) {
+        *produced = s.out - out;
+    }
+    return ok && s.bitcnt >= 0;
+}
@@ -0,0 +1,26 @@
+#ifndef INFLATE_H
+#define INFLATE_H
+
+/*
+    DEFLATE decoder (RFC 1951), without any external dependency.
+
+    The whole output buffer is the sliding window, so the data is decoded straight
+    into its final place (e.g. the rom buffer) with no intermediate copy. The caller
+    must know the decoded size, which both zip and gzip store next to the stream.
+
+    Huffman codes up to INFLATE_FAST_BITS long are resolved with one table lookup,
+    longer (rare) codes fall back to a canonical bit-by-bit decode.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define INFLATE_FAST_BITS 10
+
+// decode the raw DEFLATE stream `in` into `out`.
+// returns false on corrupted data or if the output does not fit in `out_len`;
+// `*produced` receives the number of bytes written (may be NULL)
+bool inflate_raw(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len, size_t *produced);
+
+#endif /* INFLATE_H */
@@ -2,17 +2,27 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "libretro.h"
 #include "../cartridge.h"
+#include "../cdl.h"
 #include "../cpu.h"
+#include "../hash.h"
+#include "../ppu.h"
 #include "../test/disassembler.h"
 
+#define CORE_VERSION "0.1.0"
+
 #define VIDEO_WIDTH 256
 #define VIDEO_HEIGHT 240
 #define VIDEO_PIXELS VIDEO_WIDTH * VIDEO_HEIGHT
 
-static uint32_t *frame_buf;
+// large enough for either format; with the PPU thread, frames alternate with back_buf
+static uint32_t *frame_buf, *back_buf;
+static enum retro_pixel_format pixel_format = RETRO_PIXEL_FORMAT_XRGB8888;
+static PPUFormat ppu_format = PPU_FORMAT_XRGB8888;
+static size_t pixel_size = sizeof(uint32_t);
 static struct retro_log_callback logging;
 retro_log_printf_t log_cb;
 static retro_environment_t environ_cb;
@@ -28,13 +38,19 @@ static void fallback_log(enum retro_log_level level, const char *fmt, ...)
 
 void retro_init(void)
 {
+   hash_init();
    frame_buf = calloc(VIDEO_PIXELS, sizeof(uint32_t));
+   back_buf = calloc(VIDEO_PIXELS, sizeof(uint32_t));
+   ppu_set_output(frame_buf, VIDEO_WIDTH, ppu_format);
 }
 
 void retro_deinit(void)
 {
+   ppu_set_threaded(false);
+   ppu_set_output(NULL, 0, ppu_format);
    free(frame_buf);
-   frame_buf = NULL;
+   free(back_buf);
+   frame_buf = back_buf = NULL;
 }
 
 unsigned retro_api_version(void)
@@ -51,9 +67,10 @@ void retro_get_system_info(struct retro_system_info *info)
 {
    memset(info, 0, sizeof(*info));
    info->library_name     = "aioNES";
-   info->library_version  = "0.1.0";
+   info->library_version  = CORE_VERSION;
    info->need_fullpath    = true;
-   info->valid_extensions = "nes";
+   info->valid_extensions = "nes|zip|gz";
+   info->block_extract    = true;   // archives are decoded by the core, no temporary file
 }
 
 static retro_video_refresh_t video_cb;
@@ -89,6 +106,20 @@ void retro_set_environment(retro_environment_t cb)
    bool no_content = true;
    cb(RETRO_ENVIRONMENT_SET_SUPPORT_NO_GAME, &no_content);
 
+   static const struct retro_variable vars[] = {
+      { "aiones_save_ram", "Battery save; frontend|mmap" },
+      { "aiones_softpatch", "Soft-patching (.ips/.ups/.bps next to the rom); enabled|disabled" },
+      { "aiones_cdl", "Code/Data Logger (.cdl in the save directory); disabled|enabled" },
+      { "aiones_disasm", "Disassembly (.asm in the save directory); disabled|enabled" },
+      { "aiones_ppu", "PPU renderer (dot is slower, for mid-scanline effects); auto|scanline|dot" },
+      { "aiones_sprite_limit", "Sprite limit (8 per line, disabling reduces flicker); enabled|disabled" },
+      { "aiones_pixel_format", "Pixel format (RGB565 halves the video memory traffic, restart to apply); XRGB8888|RGB565" },
+      { "aiones_headless", "Headless (draw 1 frame in N, or none, for automation); disabled|2|4|8|16|60|enabled" },
+      { "aiones_ppu_thread", "PPU render thread (draws on another core, one frame late); disabled|enabled" },
+      { NULL, NULL },
+   };
+   cb(RETRO_ENVIRONMENT_SET_VARIABLES, (void*)vars);
+
    if (cb(RETRO_ENVIRONMENT_GET_LOG_INTERFACE, &logging))
       log_cb = logging.log;
    else
@@ -125,30 +156,266 @@ void retro_reset(void)
    // Nothing needs to happen when the game is reset.
 }
 
+// headless: 1 frame in `draw_every` is drawn, none if 0
+static unsigned draw_every = 1;
+static unsigned frame_count;
+
+// PPU thread: the last frame handed to it, shown at the next retro_run, and
+// whether it is unlike the one shown before
+static bool threaded;
+static const void *late_buf;
+static bool late_changed;
+
+// the frame runs while the one before is drawn on the PPU thread, then that one is shown
+static void run_threaded(bool dupe)
+{
+   void *pixels = late_buf == frame_buf ? back_buf : frame_buf;
+   const void *show = late_buf;
+   bool changed = late_changed;
+
+   ppu_set_output(pixels, VIDEO_WIDTH, ppu_format);
+   cpu_run_frame();
+
+   late_changed = false;
+   if (ppu_frame_pending)
+   {
+      late_buf = pixels;
+      late_changed = ppu_frame_changed;
+   }
+   else if (!ppu_headless)
+   {
+      // drawn as it ran (dot renderer, code/data logger)
+      show = late_buf = pixels;
+      changed = ppu_frame_changed;
+   }
+   video_cb(!changed && dupe ? NULL : show, VIDEO_WIDTH, VIDEO_HEIGHT, VIDEO_WIDTH * pixel_size);
+}
+
+static void set_ppu_options(void);
+
 /**
  * libretro callback; Called every game tick.
  */
 void retro_run(void)
 {
-   // Clear the display.
-   unsigned stride = VIDEO_WIDTH;
-   video_cb(frame_buf, VIDEO_WIDTH, VIDEO_HEIGHT, stride << 2);
+   bool updated = false;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE_UPDATE, &updated) && updated)
+      set_ppu_options();
+
+   // a frontend that cannot dupe gets the last frame drawn again, from frame_buf
+   bool dupe = false;
+   environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &dupe);
+   ppu_headless = !draw_every || frame_count++ % draw_every;
+
+   if (threaded)
+   {
+      run_threaded(dupe);
+      cartridge_flush_save();
+      return;
+   }
+
+   // draw into the frontend's framebuffer when it offers one in our format,
+   // it is only valid until retro_run returns; after a frame like the one before,
+   // the next is likely the same too and skips drawing what frame_buf already holds
+   void *pixels = frame_buf;
+   size_t pitch = VIDEO_WIDTH * pixel_size;
+   struct retro_framebuffer fb = {
+      .width        = VIDEO_WIDTH,
+      .height       = VIDEO_HEIGHT,
+      .access_flags = RETRO_MEMORY_ACCESS_WRITE,
+   };
+   if (!ppu_headless && (dupe ? ppu_frame_changed : draw_every == 1) &&
+       environ_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &fb) && fb.data &&
+       fb.format == pixel_format && fb.pitch % pixel_size == 0)
+   {
+      pixels = fb.data;
+      pitch  = fb.pitch;
+   }
+   ppu_set_output(pixels, pitch / pixel_size, ppu_format);
+
+   cpu_run_frame();
+
+   video_cb((ppu_headless || !ppu_frame_changed) && dupe ? NULL : pixels, VIDEO_WIDTH, VIDEO_HEIGHT, pitch);
+   ppu_set_output(frame_buf, VIDEO_WIDTH, ppu_format);
+
+   // no-op unless PRG RAM is mapped to a save file and was written this frame
+   cartridge_flush_save();
+}
+
+// <save directory>/<rom name>.<ext>, or next to the rom without a save directory
+static void save_path(const char *rom_path, const char *ext_new, char *path, size_t size)
+{
+   const char *dir = NULL;
+   const char *name, *ext;
+
+   name = strrchr(rom_path, '/');
+   name = name ? name + 1 : rom_path;
+   ext = strrchr(name, '.');
+   if (!ext)
+      ext = name + strlen(name);
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) && dir && *dir)
+      snprintf(path, size, "%s/%.*s.%s", dir, (int)(ext - name), name, ext_new);
+   else
+      snprintf(path, size, "%.*s.%s", (int)(ext - rom_path), rom_path, ext_new);
+}
+
+static bool option_is(const char *key, const char *value)
+{
+   struct retro_variable var = { key, NULL };
+   return environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && !strcmp(var.value, value);
+}
+
+// "auto" takes the dot renderer for games flagged in the game database
+static void set_ppu_options(void)
+{
+   bool dot = option_is("aiones_ppu", "dot");
+
+   if (!dot && !option_is("aiones_ppu", "scanline"))
+      dot = rom_gamedb && (rom_gamedb->hints & GAMEDB_HINT_ACCURATE_PPU);
+   ppu_set_renderer(dot ? PPU_RENDERER_DOT : PPU_RENDERER_SCANLINE);
+   ppu_sprite_limit = !option_is("aiones_sprite_limit", "disabled");
+
+   struct retro_variable var = { "aiones_headless", NULL };
+   draw_every = 1;
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value) {
+      if (!strcmp(var.value, "enabled"))
+         draw_every = 0;
+      else if (strcmp(var.value, "disabled"))
+         draw_every = atoi(var.value);
+   }
+
+   bool thread = option_is("aiones_ppu_thread", "enabled");
+   if (thread && !threaded)
+   {
+      late_buf = back_buf;
+      late_changed = false;
+   }
+   threaded = ppu_set_threaded(thread) && thread;
+   if (thread && !threaded)
+      log_cb(RETRO_LOG_WARN, "Could not start the PPU thread, drawing on the emulation thread.\n");
+}
+
+// the format of the option, or XRGB8888 if the frontend does not take it
+static void set_pixel_format(void)
+{
+   pixel_format = option_is("aiones_pixel_format", "RGB565") ? RETRO_PIXEL_FORMAT_RGB565 : RETRO_PIXEL_FORMAT_XRGB8888;
+   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixel_format) && pixel_format == RETRO_PIXEL_FORMAT_RGB565)
+   {
+      log_cb(RETRO_LOG_WARN, "RGB565 is not supported by the frontend, using XRGB8888.\n");
+      pixel_format = RETRO_PIXEL_FORMAT_XRGB8888;
+      environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pixel_format);
+   }
+   ppu_format = pixel_format == RETRO_PIXEL_FORMAT_RGB565 ? PPU_FORMAT_RGB565 : PPU_FORMAT_XRGB8888;
+   pixel_size = pixel_format == RETRO_PIXEL_FORMAT_RGB565 ? sizeof(uint16_t) : sizeof(uint32_t);
+   ppu_set_output(frame_buf, VIDEO_WIDTH, ppu_format);
 }
 
+/**
+ * With the "mmap" battery save option, PRG RAM is a shared mapping of
+ * <save directory>/<rom name>.sav and the frontend does not see it.
+ */
+static void map_save_file(const char *rom_path)
+{
+   char path[4096];
+
+   if (!battery || !option_is("aiones_save_ram", "mmap"))
+      return;
+   save_path(rom_path, "sav", path, sizeof(path));
+   cartridge_map_save_file(path);
+}
+
+// the code/data log accumulates over sessions in <rom name>.cdl
+static char cdl_path[4096];
+
+static void start_cdl(const char *rom_path)
+{
+   if (!option_is("aiones_cdl", "enabled") || !cdl_enable())
+      return;
+   save_path(rom_path, "cdl", cdl_path, sizeof(cdl_path));
+   cdl_load(cdl_path);
+}
+
+static void stop_cdl(void)
+{
+   if (!cdl_enabled)
+      return;
+   if (!cdl_save(cdl_path))
+      log_cb(RETRO_LOG_ERROR, "Could not write %s\n", cdl_path);
+   cdl_disable();
+}
+
+// off the load path: AIONES_DISASM=<file> or the core option, written in the background;
+// the analysis is cached by rom in <save directory>/<crc32>.dcfg
+static void start_disasm(const char *rom_path)
+{
+   const char *env = getenv("AIONES_DISASM");
+   const char *dir = NULL;
+   char path[4096], cache[4096];
+
+   if (env && *env)
+      snprintf(path, sizeof(path), "%s", env);
+   else if (option_is("aiones_disasm", "enabled"))
+      save_path(rom_path, "asm", path, sizeof(path));
+   else
+      return;
+   cache[0] = '\0';
+   if (environ_cb(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &dir) && dir && *dir)
+      snprintf(cache, sizeof(cache), "%s/%08X.dcfg", dir, rom_crc32);
+   if (!disasm_start(path, *cache ? cache : NULL, CORE_VERSION))
+      log_cb(RETRO_LOG_ERROR, "Could not start disassembling to %s\n", path);
+}
+
+// look for <rom name>.ips/.ups/.bps beside the rom, the frontend cannot
+// soft-patch roms it does not load itself (need_fullpath)
+static const char *find_patch(const char *rom_path, char *path, size_t size)
+{
+   static const char *const exts[] = { "ips", "ups", "bps" };
+   const char *name, *ext;
+
+   if (option_is("aiones_softpatch", "disabled"))
+      return NULL;
+
+   name = strrchr(rom_path, '/');
+   name = name ? name + 1 : rom_path;
+   ext = strrchr(name, '.');
+   if (!ext)
+      ext = name + strlen(name);
+
+   for (unsigned i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+      snprintf(path, size, "%.*s.%s", (int)(ext - rom_path), rom_path, exts[i]);
+      if (access(path, R_OK) == 0)
+         return path;
+   }
+   return NULL;
+}
 
 /**
  * libretro callback; Called when a game is to be loaded.
  */
 bool retro_load_game(const struct retro_game_info *info)
 {
-   cartridge_parse_header(info);
-   disassemble();
+   char patch[4096];
+
+   ppu_reset();
+   if (!cartridge_parse_header(info, find_patch(info->path, patch, sizeof(patch))))
+      return false;
+   cpu_reset();
+   set_pixel_format();
+   set_ppu_options();
+   map_save_file(info->path);
+   start_cdl(info->path);
+   start_disasm(info->path);
    return true;
 }
 
 void retro_unload_game(void)
 {
-   // Nothing needs to happen when the game unloads.
+   ppu_thread_wait();
+   disasm_wait();
+   stop_cdl();
+   cartridge_unload();
 }
 
 unsigned retro_get_region(void)
@@ -161,30 +428,60 @@ bool retro_load_game_special(unsigned game_type, const struct retro_game_info *i
    return retro_load_game(info);
 }
 
+// save states hold the PPU only (see ppu_save_state()), after a header of their own;
+// the CPU and the mapper go on from where they are when a state is loaded
+#define STATE_VERSION 1
+
+typedef struct
+{
+   uint32_t version;
+   uint32_t ppu_size;
+} StateHeader;
+
 size_t retro_serialize_size(void)
 {
-   return 0;
+   return sizeof(StateHeader) + ppu_state_size();
 }
 
 bool retro_serialize(void *data_, size_t size)
 {
+   StateHeader *header = data_;
+
+   if (size < retro_serialize_size())
+      return false;
+   header->version = STATE_VERSION;
+   header->ppu_size = ppu_state_size();
+   ppu_save_state(header + 1);
    return true;
 }
 
 bool retro_unserialize(const void *data_, size_t size)
 {
+   const StateHeader *header = data_;
+
+   if (size < sizeof(*header) || header->version != STATE_VERSION ||
+       header->ppu_size > size - sizeof(*header))
+      return false;
+   ppu_thread_wait();
+   if (!ppu_load_state(header + 1, header->ppu_size))
+      return false;
+   // states are taken between frames, the CPU starts the next one with the PPU
+   cpu_clock = ppu.clock;
    return true;
 }
 
 void *retro_get_memory_data(unsigned id)
 {
-   (void)id;
+   // PRG RAM is handed out directly, the frontend reads and writes it in place
+   if (id == RETRO_MEMORY_SAVE_RAM && battery && !cartridge_save_file_mapped())
+      return prg_ram;
    return NULL;
 }
 
 size_t retro_get_memory_size(unsigned id)
 {
-   (void)id;
+   if (id == RETRO_MEMORY_SAVE_RAM && battery && !cartridge_save_file_mapped())
+      return prg_ram_size;
    return 0;
 }
 
@@ -0,0 +1,386 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cartridge.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "ppu.h"
+
+typedef struct {
+    void (*init)();
+    void (*write)(uint16_t addr, uint8_t value);
+    void (*sync)(uint64_t now);   // NULL for mappers without time-driven state
+    void (*schedule)();
+} MapperOps;
+
+uint64_t mapper_irq_at = PPU_NEVER;
+static const MapperOps *mapper_ops;
+
+
+/***************************** BANKING *****************************/
+
+// 8 KB PRG ROM bank, negative numbers count from the last bank
+static void map_prg_8k(int slot, int bank) {
+    uint32_t banks = pgr_rom_size / 0x2000;
+    if (!banks) {
+        return;
+    }
+    bank %= (int)banks;
+    if (bank < 0) {
+        bank += banks;
+    }
+    cpu_prg_map[slot] = prg_rom + bank * 0x2000;
+}
+
+// 1 KB CHR bank, from CHR ROM or the 8 KB of CHR RAM, with its decoded rows
+// the PPU catches up before a page it reads changes
+static void map_chr_1k(int slot, int bank) {
+    uint8_t *page;
+    uint64_t *rows;
+    uint32_t offset;
+
+    if (chr_rom_size >= 0x400) {
+        offset = (bank * 0x400) % (chr_rom_size & ~0x3FF);
+        page = chr_rom + offset;
+        rows = chr_rom_rows + offset / 2;
+    } else {
+        offset = (bank & 7) * 0x400;
+        page = chr_ram + offset;
+        rows = chr_ram_rows + offset / 2;
+    }
+    if (ppu_chr_map[slot] != page) {
+        ppu_sync();
+        ppu_chr_map[slot] = page;
+        ppu_chr_rows[slot] = rows;
+        ppu_chr_switched(slot);
+    }
+}
+
+
+/****************************** NROM *******************************/
+
+// 16 KB of PRG ROM are mirrored at $8000 and $C000, 32 KB fill the window
+static void nrom_init() {
+    for (int i = 0; i < 4; i++) {
+        map_prg_8k(i, i);
+    }
+    for (int i = 0; i < 8; i++) {
+        map_chr_1k(i, i);
+    }
+}
+
+static void nrom_write(uint16_t addr, uint8_t value) {
+    (void)addr;
+    (void)value;
+}
+
+static const MapperOps mapper_nrom = { nrom_init, nrom_write, NULL, NULL };
+
+
+/****************************** MMC1 *******************************
+    Registers are loaded serially: five writes to $8000-$FFFF shift bit 0 in, the
+    fifth one copies the value to the register selected by its address. A write
+    with bit 7 set resets the shift register and selects PRG mode 3.
+    $8000-$9FFF  control      CPPMM  C: CHR mode, P: PRG mode, M: mirroring
+    $A000-$BFFF  CHR bank 0   4 KB at $0000, or 8 KB with the low bit ignored
+    $C000-$DFFF  CHR bank 1   4 KB at $1000, ignored in 8 KB mode
+    $E000-$FFFF  PRG bank     PRG modes 0, 1: 32 KB with the low bit ignored
+                              2: $8000 fixed to the first bank, 16 KB at $C000
+                              3: 16 KB at $8000, $C000 fixed to the last bank
+*/
+
+static struct {
+    uint8_t shift;
+    uint8_t count;
+    uint8_t control;
+    uint8_t chr[2];
+    uint8_t prg;
+} mmc1;
+
+static void map_prg_16k(int slot, int bank) {
+    map_prg_8k(slot * 2, bank * 2);
+    map_prg_8k(slot * 2 + 1, bank * 2 + 1);
+}
+
+static void map_chr_4k(int slot, int bank) {
+    for (int i = 0; i < 4; i++) {
+        map_chr_1k(slot * 4 + i, bank * 4 + i);
+    }
+}
+
+static void mmc1_map() {
+    static const PPUMirroring modes[4] = {
+        PPU_MIRROR_SINGLE_LOW, PPU_MIRROR_SINGLE_HIGH, PPU_MIRROR_VERTICAL, PPU_MIRROR_HORIZONTAL,
+    };
+    uint8_t prg = mmc1.prg & 0x0F;
+
+    if (!four_screen) {
+        ppu_set_mirroring(modes[mmc1.control & 3]);
+    }
+
+    switch ((mmc1.control >> 2) & 3) {
+        case 0:
+        case 1:
+            map_prg_16k(0, prg & 0x0E);
+            map_prg_16k(1, prg | 0x01);
+            break;
+        case 2:
+            map_prg_16k(0, 0);
+            map_prg_16k(1, prg);
+            break;
+        case 3:
+            map_prg_16k(0, prg);
+            map_prg_16k(1, -1);
+            break;
+    }
+
+    if (mmc1.control & BIT_4) {
+        map_chr_4k(0, mmc1.chr[0]);
+        map_chr_4k(1, mmc1.chr[1]);
+    } else {
+        map_chr_4k(0, mmc1.chr[0] & 0x1E);
+        map_chr_4k(1, mmc1.chr[0] | 0x01);
+    }
+}
+
+static void mmc1_init() {
+    memset(&mmc1, 0, sizeof(mmc1));
+    mmc1.control = 0x0C;
+    mmc1_map();
+}
+
+static void mmc1_write(uint16_t addr, uint8_t value) {
+    if (value & BIT_7) {
+        mmc1.shift = mmc1.count = 0;
+        mmc1.control |= 0x0C;
+        mmc1_map();
+        return;
+    }
+
+    mmc1.shift |= (value & 1) << mmc1.count;
+    if (++mmc1.count < 5) {
+        return;
+    }
+    switch (addr & 0xE000) {
+        case 0x8000: mmc1.control = mmc1.shift; break;
+        case 0xA000: mmc1.chr[0] = mmc1.shift; break;
+        case 0xC000: mmc1.chr[1] = mmc1.shift; break;
+        case 0xE000: mmc1.prg = mmc1.shift; break;
+    }
+    mmc1.shift = mmc1.count = 0;
+    mmc1_map();
+}
+
+static const MapperOps mapper_mmc1 = { mmc1_init, mmc1_write, NULL, NULL };
+
+
+/****************************** MMC3 *******************************
+    $8000 even  bank select  CPMx xRRR  C: CHR A12 inversion, P: PRG mode, R: register
+    $8001 odd   bank data    value of R0-R7
+    $A000 even  mirroring    0 vertical, 1 horizontal
+    $A001 odd   PRG RAM protect
+    $C000 even  IRQ latch    value reloaded into the counter
+    $C001 odd   IRQ reload   counter is reloaded at the next clock
+    $E000 even  IRQ disable  also acknowledges a pending IRQ
+    $E001 odd   IRQ enable
+
+    The IRQ counter is clocked by the PPU A12 rises: it is reloaded from the latch
+    when it is 0 (or a reload was requested), otherwise decremented; an IRQ fires
+    when it is 0 after the clock. Revision A chips only fire when it was decremented
+    to 0 or explicitly reloaded, so a latch of 0 fires once instead of every line.
+
+    Nothing runs per PPU dot: the counter value is kept for the time `irq_synced`,
+    rises since then are counted with ppu_a12_rises(), and the IRQ time is the n-th
+    rise after it, n being how many clocks the counter needs to reach 0.
+*/
+
+static struct {
+    uint8_t bank_select;
+    uint8_t regs[8];
+    uint8_t prg_ram_protect;
+    uint8_t irq_latch;
+    uint8_t irq_counter;
+    bool irq_reload;
+    bool irq_enabled;
+    bool rev_a;
+    uint64_t irq_synced;   // PPU clock irq_counter refers to
+} mmc3;
+
+static void mmc3_map() {
+    int prg_swap = (mmc3.bank_select & BIT_6) ? 2 : 0;
+    int chr_swap = (mmc3.bank_select & BIT_7) ? 4 : 0;
+
+    map_prg_8k(0 ^ prg_swap, mmc3.regs[6]);
+    map_prg_8k(1, mmc3.regs[7]);
+    map_prg_8k(2 ^ prg_swap, -2);
+    map_prg_8k(3, -1);
+
+    map_chr_1k(0 ^ chr_swap, mmc3.regs[0] & 0xFE);
+    map_chr_1k(1 ^ chr_swap, mmc3.regs[0] | 0x01);
+    map_chr_1k(2 ^ chr_swap, mmc3.regs[1] & 0xFE);
+    map_chr_1k(3 ^ chr_swap, mmc3.regs[1] | 0x01);
+    for (int i = 0; i < 4; i++) {
+        map_chr_1k((4 + i) ^ chr_swap, mmc3.regs[2 + i]);
+    }
+}
+
+static void mmc3_init() {
+    memset(&mmc3, 0, sizeof(mmc3));
+    mmc3.regs[7] = 1;
+    mmc3.rev_a = submapper == 4 || (rom_gamedb && (rom_gamedb->hints & GAMEDB_HINT_MMC3_REV_A));
+    mmc3.irq_synced = cpu_clock;
+    mmc3_map();
+}
+
+// apply `n` counter clocks at once
+static void mmc3_clock(uint64_t n) {
+    uint32_t c, period = mmc3.irq_latch + 1;
+
+    if (!n) {
+        return;
+    }
+    c = (mmc3.irq_counter == 0 || mmc3.irq_reload) ? mmc3.irq_latch : mmc3.irq_counter - 1;
+    mmc3.irq_reload = false;
+    n--;
+
+    // after reaching 0 the counter cycles through latch, latch - 1, ..., 0
+    if (n <= c) {
+        c -= n;
+    } else {
+        uint32_t r = (n - c) % period;
+        c = r ? period - r : 0;
+    }
+    mmc3.irq_counter = c;
+}
+
+// number of clocks until the counter fires, 0 if it never does
+static uint32_t mmc3_clocks_to_irq() {
+    if (mmc3.irq_counter && !mmc3.irq_reload) {
+        return mmc3.irq_counter;
+    }
+    if (mmc3.irq_latch) {
+        return mmc3.irq_latch + 1;
+    }
+    return (!mmc3.rev_a || mmc3.irq_reload) ? 1 : 0;
+}
+
+static void mmc3_schedule() {
+    uint32_t n = mmc3_clocks_to_irq();
+    mapper_irq_at = mmc3.irq_enabled && n ? ppu_a12_rise_after(mmc3.irq_synced, n) : PPU_NEVER;
+}
+
+static void mmc3_sync(uint64_t now) {
+    bool fired = mapper_irq_at <= now;
+
+    if (now <= mmc3.irq_synced) {
+        return;
+    }
+    mmc3_clock(ppu_a12_rises(mmc3.irq_synced, now));
+    mmc3.irq_synced = now;
+    if (fired) {
+        cpu_irq |= CPU_IRQ_MAPPER;
+        mmc3_schedule();
+    }
+}
+
+static void mmc3_write(uint16_t addr, uint8_t value) {
+    bool odd = addr & 1;
+
+    switch (addr & 0xE000) {
+        case 0x8000:
+            if (odd) {
+                mmc3.regs[mmc3.bank_select & 7] = value;
+            } else {
+                mmc3.bank_select = value;
+            }
+            mmc3_map();
+            return;
+        case 0xA000:
+            if (odd) {
+                mmc3.prg_ram_protect = value;
+            } else if (!four_screen) {
+                ppu_set_mirroring(value & BIT_0 ? PPU_MIRROR_HORIZONTAL : PPU_MIRROR_VERTICAL);
+            }
+            return;
+    }
+
+    // IRQ registers: catch the counter up to now before changing it
+    mmc3_sync(cpu_clock);
+    switch (addr & 0xE000) {
+        case 0xC000:
+            if (odd) {
+                mmc3.irq_counter = 0;
+                mmc3.irq_reload = true;
+            } else {
+                mmc3.irq_latch = value;
+            }
+            break;
+        case 0xE000:
+            mmc3.irq_enabled = odd;
+            if (!odd) {
+                cpu_irq &= ~CPU_IRQ_MAPPER;
+            }
+            break;
+    }
+    mmc3_schedule();
+}
+
+static const MapperOps mapper_mmc3 = { mmc3_init, mmc3_write, mmc3_sync, mmc3_schedule };
+
+
+/****************************** AxROM ******************************
+    $8000-$FFFF  ...M xPPP  M: single-screen nametable, P: 32 KB PRG bank
+    8 KB of CHR RAM.
+*/
+
+static void axrom_write(uint16_t addr, uint8_t value) {
+    (void)addr;
+    map_prg_16k(0, (value & 7) * 2);
+    map_prg_16k(1, (value & 7) * 2 + 1);
+    ppu_set_mirroring(value & BIT_4 ? PPU_MIRROR_SINGLE_HIGH : PPU_MIRROR_SINGLE_LOW);
+}
+
+static void axrom_init() {
+    nrom_init();
+    axrom_write(0x8000, 0);
+}
+
+static const MapperOps mapper_axrom = { axrom_init, axrom_write, NULL, NULL };
+
+
+/***************************** PUBLIC ******************************/
+
+bool mapper_init() {
+    bool supported = true;
+
+    switch (mapper) {
+        case 0:  mapper_ops = &mapper_nrom; break;
+        case 1:  mapper_ops = &mapper_mmc1; break;
+        case 4:  mapper_ops = &mapper_mmc3; break;
+        case 7:  mapper_ops = &mapper_axrom; break;
+        default: mapper_ops = &mapper_nrom; supported = false; break;
+    }
+    mapper_irq_at = PPU_NEVER;
+    cpu_irq &= ~CPU_IRQ_MAPPER;
+    ppu_chr_writable = chr_rom_size < 0x400;
+    ppu_set_mirroring(four_screen ? PPU_MIRROR_FOUR_SCREEN : (PPUMirroring)mirroring);
+    mapper_ops->init();
+    return supported;
+}
+
+void mapper_write(uint16_t addr, uint8_t value) {
+    mapper_ops->write(addr, value);
+}
+
+void mapper_sync(uint64_t now) {
+    if (mapper_ops && mapper_ops->sync) {
+        mapper_ops->sync(now);
+    }
+}
+
+void mapper_schedule() {
+    if (mapper_ops && mapper_ops->schedule) {
+        mapper_ops->schedule();
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+/*
+    Cartridge mappers: bank switching of PRG ROM ($8000-$FFFF, `cpu_prg_map`) and
+    pattern tables (PPU $0000-$1FFF, `ppu_chr_map`), plus the mapper IRQ.
+
+    Mapper   Name    PRG banks  CHR banks        IRQ
+    -----------------------------------------------------------------
+    0        NROM    fixed      fixed            -
+    1        MMC1    16/32 KB   4/8 KB           -
+    4        MMC3    8 KB       2 KB + 1 KB      scanline counter (PPU A12)
+    7        AxROM   32 KB      CHR RAM          -
+
+    Mappers that switch the nametable mirroring at runtime call ppu_set_mirroring(),
+    unless the cartridge is hard-wired for four-screen. A change of CHR page or
+    mirroring first catches the PPU up to the CPU (ppu_sync()).
+
+    mapper_init() sets the power-on banks for the loaded cartridge and
+    mapper_write() receives the CPU writes to $8000-$FFFF.
+
+    Mappers driven by PPU or CPU time don't run every cycle: they predict when their
+    next event happens (mapper_irq_at, in PPU dots) and catch up lazily, up to
+    `cpu_clock` rather than the PPU's own clock.
+    mapper_sync() brings the mapper up to `now`, raising the IRQ if its predicted time
+    has passed (the CPU loop calls it once `cpu_clock` reaches `mapper_irq_at`); it
+    must be called before a register the prediction depends on changes, and
+    mapper_schedule() right after, to predict again with the new values.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+extern uint64_t mapper_irq_at;  // PPU clock of the next mapper IRQ, PPU_NEVER if none
+
+// false if the mapper number is not implemented, NROM banking is used instead
+bool mapper_init();
+void mapper_write(uint16_t addr, uint8_t value);
+void mapper_sync(uint64_t now);
+void mapper_schedule();
+
+#endif /* MAPPER_H */
@@ -0,0 +1,329 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "patch.h"
+
+#define IPS_EOF    0x454F46 // "EOF" read as an offset
+#define PATCH_MAX  (64u << 20) // no NES rom comes close, rejects absurd sizes
+
+
+static inline uint16_t be16(const uint8_t *p) {
+    return p[0] << 8 | p[1];
+}
+
+static inline uint32_t be24(const uint8_t *p) {
+    return p[0] << 16 | p[1] << 8 | p[2];
+}
+
+static inline uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+PatchType patch_type(const uint8_t *patch, size_t patch_size) {
+    if (patch_size >= 8 && memcmp(patch, "PATCH", 5) == 0) {
+        return PATCH_IPS;
+    }
+    if (patch_size >= 18 && memcmp(patch, "UPS1", 4) == 0) {
+        return PATCH_UPS;
+    }
+    if (patch_size >= 19 && memcmp(patch, "BPS1", 4) == 0) {
+        return PATCH_BPS;
+    }
+    return PATCH_NONE;
+}
+
+// grow a buffer to `size` bytes, zero filling the new part
+static bool resize(uint8_t **data, uint32_t old_size, uint32_t size) {
+    uint8_t *p;
+    if (size <= old_size) {
+        return true;
+    }
+    p = realloc(*data, size);
+    if (!p) {
+        return false;
+    }
+    memset(p + old_size, 0, size - old_size);
+    *data = p;
+    return true;
+}
+
+
+/******************************* IPS ******************************/
+
+/*
+    "PATCH", then records until "EOF":
+        3 bytes offset, 2 bytes size, `size` bytes of data
+        3 bytes offset, 0, 2 bytes count, 1 byte value (run length encoded)
+    optionally followed by a 3 bytes size the file is truncated (or extended) to.
+    There is no checksum. The records are walked twice: first to validate them and
+    find the final size, so the image is resized once, then to write them.
+*/
+
+// `*target_size` is the final size, `*extent` the end of the last byte written
+static bool ips_walk(const uint8_t *patch, size_t patch_size, uint8_t *out,
+                     uint32_t *target_size, uint32_t *extent) {
+    const uint8_t *p = patch + 5, *end = patch + patch_size;
+
+    for (;;) {
+        if (p + 3 > end) {
+            return false;
+        }
+        uint32_t offset = be24(p);
+        p += 3;
+        if (offset == IPS_EOF) {
+            break;
+        }
+        if (p + 2 > end) {
+            return false;
+        }
+        uint32_t len = be16(p);
+        p += 2;
+        if (len) {
+            if (p + len > end) {
+                return false;
+            }
+            if (out) {
+                memcpy(out + offset, p, len);
+            }
+            p += len;
+        } else {
+            if (p + 3 > end) {
+                return false;
+            }
+            len = be16(p);
+            if (out) {
+                memset(out + offset, p[2], len);
+            }
+            p += 3;
+        }
+        if (offset + len > *extent) {
+            *extent = offset + len;
+        }
+    }
+
+    // the truncation size must be the only thing after EOF, other trailing bytes
+    // are ignored; it is also allowed to extend the image, zero-filled
+    *target_size = end - p == 3 ? be24(p) : *extent;
+    return true;
+}
+
+static bool ips_apply(const uint8_t *patch, size_t patch_size, uint8_t **data, uint32_t *size) {
+    uint32_t target_size, extent = *size;
+
+    if (!ips_walk(patch, patch_size, NULL, &target_size, &extent)
+        || !resize(data, *size, target_size > extent ? target_size : extent)) {
+        return false;
+    }
+    ips_walk(patch, patch_size, *data, &target_size, &extent);
+    *size = target_size;
+    return true;
+}
+
+
+/****************************** UPS/BPS ***************************/
+
+// variable length integer shared by UPS and BPS: 7 bits per byte, the last one
+// has bit 7 set, and each continuation adds one to avoid redundant encodings
+static bool varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    uint64_t v = 0, shift = 1;
+    while (*p < end) {
+        uint8_t x = *(*p)++;
+        v += (x & 0x7F) * shift;
+        if (x & 0x80) {
+            *value = v;
+            return true;
+        }
+        shift <<= 7;
+        v += shift;
+        if (shift > (1ull << 49)) {
+            break;
+        }
+    }
+    return false;
+}
+
+// the last 12 bytes hold the source, target and patch CRC-32s
+static bool footer_check(const uint8_t *patch, size_t patch_size, const uint8_t *source, uint32_t source_size) {
+    const uint8_t *footer = patch + patch_size - 12;
+    return le32(footer + 8) == hash_crc32(0, patch, patch_size - 4) &&
+           le32(footer) == hash_crc32(0, source, source_size);
+}
+
+
+/******************************* UPS ******************************/
+
+/*
+    "UPS1", source size, target size, then hunks until the footer:
+        skip count, bytes XORed with the source up to and including a 0 byte
+    The target is the source XORed in place, hunks are in increasing order so the
+    target CRC is accumulated up to the end of each hunk as it is written.
+*/
+
+static bool ups_apply(const uint8_t *patch, size_t patch_size, uint8_t **data, uint32_t *size) {
+    const uint8_t *p = patch + 4, *end = patch + patch_size - 12;
+    uint64_t source_size, target_size, skip;
+    uint32_t crc = 0, crc_pos = 0, cap;
+    size_t pos = 0;
+
+    if (!varint(&p, end, &source_size) || !varint(&p, end, &target_size) ||
+        source_size != *size || target_size > PATCH_MAX) {
+        return false;
+    }
+    if (!footer_check(patch, patch_size, *data, *size)) {
+        return false;
+    }
+
+    // bytes past the end of the source read as 0
+    cap = source_size > target_size ? source_size : target_size;
+    if (!resize(data, *size, cap)) {
+        return false;
+    }
+
+    uint8_t *out = *data;
+    while (p < end) {
+        if (!varint(&p, end, &skip)) {
+            return false;
+        }
+        pos += skip;
+        for (;;) {
+            if (p == end) {
+                return false;
+            }
+            uint8_t x = *p++;
+            if (pos < cap) {
+                out[pos] ^= x;
+            }
+            pos++;
+            if (!x) {
+                break;
+            }
+        }
+        uint32_t done = pos < target_size ? pos : target_size;
+        if (done > crc_pos) {
+            crc = hash_crc32(crc, out + crc_pos, done - crc_pos);
+            crc_pos = done;
+        }
+    }
+    crc = hash_crc32(crc, out + crc_pos, target_size - crc_pos);
+
+    *size = target_size;
+    return crc == le32(end + 4);
+}
+
+
+/******************************* BPS ******************************/
+
+/*
+    "BPS1", source size, target size, metadata size and metadata, then actions
+    until the footer, each one a varint of (length - 1) << 2 | command:
+        0 SourceRead: copy from the source at the current output offset
+        1 TargetRead: copy bytes from the patch
+        2 SourceCopy: copy from the source, at a signed delta from the last copy
+        3 TargetCopy: copy from the target already written, same delta encoding
+    The target is written sequentially into a new buffer, the CRC of every action
+    is accumulated right after it is written.
+*/
+
+static bool bps_delta(const uint8_t **p, const uint8_t *end, int64_t *offset) {
+    uint64_t d;
+    if (!varint(p, end, &d)) {
+        return false;
+    }
+    *offset += (d & 1) ? -(int64_t)(d >> 1) : (int64_t)(d >> 1);
+    return true;
+}
+
+static bool bps_apply(const uint8_t *patch, size_t patch_size, uint8_t **data, uint32_t *size) {
+    const uint8_t *p = patch + 4, *end = patch + patch_size - 12;
+    const uint8_t *source = *data;
+    uint64_t source_size, target_size, meta_size, action;
+    int64_t source_rel = 0, target_rel = 0;
+    uint32_t crc = 0;
+    size_t out_pos = 0;
+    uint8_t *out;
+
+    if (!varint(&p, end, &source_size) || !varint(&p, end, &target_size) ||
+        !varint(&p, end, &meta_size) || source_size != *size || target_size > PATCH_MAX ||
+        meta_size > (size_t)(end - p)) {
+        return false;
+    }
+    p += meta_size;
+    if (!footer_check(patch, patch_size, source, *size)) {
+        return false;
+    }
+
+    out = malloc(target_size ? target_size : 1);
+    if (!out) {
+        return false;
+    }
+
+    while (p < end) {
+        if (!varint(&p, end, &action)) {
+            goto fail;
+        }
+        uint64_t len = (action >> 2) + 1;
+        if (len > target_size - out_pos) {
+            goto fail;
+        }
+        switch (action & 3) {
+            case 0:
+                if (out_pos + len > source_size) {
+                    goto fail;
+                }
+                memcpy(out + out_pos, source + out_pos, len);
+                break;
+            case 1:
+                if (len > (size_t)(end - p)) {
+                    goto fail;
+                }
+                memcpy(out + out_pos, p, len);
+                p += len;
+                break;
+            case 2:
+                if (!bps_delta(&p, end, &source_rel) || source_rel < 0 || source_rel + len > source_size) {
+                    goto fail;
+                }
+                memcpy(out + out_pos, source + source_rel, len);
+                source_rel += len;
+                break;
+            case 3:
+                // may overlap the bytes being written, copy one at a time
+                if (!bps_delta(&p, end, &target_rel) || target_rel < 0 || (uint64_t)target_rel >= out_pos) {
+                    goto fail;
+                }
+                for (uint64_t i = 0; i < len; i++) {
+                    out[out_pos + i] = out[target_rel++];
+                }
+                break;
+        }
+        crc = hash_crc32(crc, out + out_pos, len);
+        out_pos += len;
+    }
+
+    if (out_pos != target_size || crc != le32(end + 4)) {
+        goto fail;
+    }
+    free(*data);
+    *data = out;
+    *size = target_size;
+    return true;
+
+fail:
+    free(out);
+    return false;
+}
+
+
+/***************************** PUBLIC *****************************/
+
+bool patch_apply(const uint8_t *patch, size_t patch_size, uint8_t **data, uint32_t *size) {
+    switch (patch_type(patch, patch_size)) {
+        case PATCH_IPS: return ips_apply(patch, patch_size, data, size);
+        case PATCH_UPS: return ups_apply(patch, patch_size, data, size);
+        case PATCH_BPS: return bps_apply(patch, patch_size, data, size);
+        default:        return false;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+/*
+    Soft-patching of rom images with IPS, UPS or BPS patches.
+
+    patch_apply() rewrites the image `*data` of `*size` bytes; the buffer is
+    reallocated when the patched rom is larger, and for BPS, which copies from
+    arbitrary places of the source, it is replaced by a new buffer (the source is
+    freed). The format, the sizes and the source checksum are validated before
+    anything is written; a UPS target checksum mismatch is only known once the image
+    was patched in place, the caller must then drop it.
+
+    UPS and BPS carry the CRC-32 of the source, the target and the patch itself.
+    All three are verified; the target CRC is accumulated while the target is
+    written, so the patched rom is not read a second time.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum PatchType {
+    PATCH_NONE = 0,
+    PATCH_IPS,
+    PATCH_UPS,
+    PATCH_BPS,
+} PatchType;
+
+// identify the patch format from its magic number
+PatchType patch_type(const uint8_t *patch, size_t patch_size);
+
+// apply `patch` to the malloc'd image in `*data`, false if the patch is malformed
+// or was made for another rom
+bool patch_apply(const uint8_t *patch, size_t patch_size, uint8_t **data, uint32_t *size);
+
+#endif /* PATCH_H */
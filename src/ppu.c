@@ -0,0 +1,1666 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdl.h"
+#include "cpu.h"
+#include "mapper.h"
+#include "ppu.h"
+
+#define PPU_A12_RISES_PER_FRAME (PPU_VISIBLE_LINES + 1)
+
+
+/**************************** PPU STATE ****************************/
+
+PPU ppu;
+
+// CHR pages until a cartridge maps its pattern tables
+static uint8_t ppu_unmapped[0x400];
+static uint64_t ppu_unmapped_rows[PPU_CHR_ROWS_PER_PAGE];
+uint8_t *ppu_chr_map[8] = {
+    ppu_unmapped, ppu_unmapped, ppu_unmapped, ppu_unmapped,
+    ppu_unmapped, ppu_unmapped, ppu_unmapped, ppu_unmapped,
+};
+uint64_t *ppu_chr_rows[8] = {
+    ppu_unmapped_rows, ppu_unmapped_rows, ppu_unmapped_rows, ppu_unmapped_rows,
+    ppu_unmapped_rows, ppu_unmapped_rows, ppu_unmapped_rows, ppu_unmapped_rows,
+};
+bool ppu_chr_writable;
+
+// 2 KB of console VRAM, followed by the 2 KB of four-screen carts
+static uint8_t ppu_vram[0x1000];
+uint8_t *ppu_nametables[4] = { ppu_vram, ppu_vram, ppu_vram + 0x400, ppu_vram + 0x400 };
+
+// output, and palette RAM translated to each format
+static void *ppu_output;
+static unsigned ppu_output_pitch;
+static PPUFormat ppu_output_format;
+static uint32_t ppu_rgb[32];
+static uint16_t ppu_rgb565[32];
+
+bool ppu_headless;
+
+/*
+    What the scanline renderer draws lines with: the PPU's own state, or the copy
+    the render thread keeps of it (see RENDER THREAD).
+*/
+typedef struct {
+    PPU *ppu;                         // registers and OAM, `fine` and `v` move as tiles pass
+    uint8_t **nametables;
+    uint64_t **chr_rows;
+    uint32_t *rgb;
+    uint16_t *rgb565;
+    const bool *sprite_limit;
+    uint16_t bg_v;                    // v of the tile being drawn, two tiles behind v as on hardware
+    bool lists_dirty;                 // the sprite lists of each line must be built again
+    uint8_t list_size[PPU_VISIBLE_LINES];
+    uint8_t lists[PPU_VISIBLE_LINES][64];
+    uint8_t bg_buf[8 + PPU_WIDTH + 8];    // palette indexes of the line, 0 where transparent
+    uint8_t spr_line[PPU_WIDTH];
+    int spr_zero_x;                   // of sprite 0 when it is on the line, else -1
+} PPURaster;
+
+static PPURaster ppu_raster = {
+    &ppu, ppu_nametables, ppu_chr_rows, ppu_rgb, ppu_rgb565, &ppu_sprite_limit, .lists_dirty = true,
+};
+
+// what changes the pixels of a frame (see FRAME CHANGES)
+enum {
+    PPU_CHANGE_FRAME = 1,     // state at the start of the frame
+    PPU_CHANGE_WRITE,         // register write
+    PPU_CHANGE_READ,          // register read moving the scroll
+    PPU_CHANGE_CHR,           // CHR page switched
+    PPU_CHANGE_NAMETABLE,     // nametable mirroring
+};
+#define PPU_CHANGE(kind, addr) ((uint64_t)(kind) << 16 | (addr))
+
+// what the render thread replays (see RENDER THREAD)
+enum {
+    PPU_LOG_DRAW = 0,         // pixels of a line
+    PPU_LOG_VRAM,             // nametable byte
+    PPU_LOG_PALETTE,          // palette RAM byte
+    PPU_LOG_OAM,              // OAM byte
+    PPU_LOG_CHR_ROW,          // CHR RAM row, decoded
+    PPU_LOG_CHR_PAGE,         // CHR page switched
+    PPU_LOG_NAMETABLE,        // VRAM page of a nametable
+};
+static bool ppu_logging;          // the frame is logged for the render thread instead of drawn
+
+bool ppu_frame_changed = true;
+static bool ppu_same;             // the frame is the same as the last one so far
+static bool ppu_output_valid;     // the output holds the last frame
+static bool ppu_output_whole;     // the output is the same since the frame started
+
+static void ppu_update_rgb(PPURaster *r);
+static void ppu_update_compose();
+static void ppu_change(uint64_t what, uint64_t value);
+static void ppu_changes_reset();
+static void ppu_content_changed();
+static void ppu_changes_pending(uint32_t at);
+static void ppu_end_frame();
+static void ppu_log_start();
+static void ppu_log(int kind, uint16_t addr, uint64_t value);
+static void ppu_log_end();
+static void ppu_log_chr_row(const uint64_t *rows, int n);
+static void ppu_draw_until(uint64_t now);
+static void ppu_schedule();
+
+void ppu_reset() {
+    memset(&ppu, 0, sizeof(ppu));
+    memset(ppu_vram, 0, sizeof(ppu_vram));
+    // power on: the CPU starts at the same time
+    cpu_clock = 0;
+    ppu_raster.lists_dirty = true;
+    ppu_update_rgb(&ppu_raster);
+    ppu_changes_reset();
+    ppu_schedule();
+}
+
+void ppu_set_output(void *pixels, unsigned pitch, PPUFormat format) {
+    if (pixels != ppu_output || pitch != ppu_output_pitch || format != ppu_output_format) {
+        ppu_output_valid = false;
+        ppu_output_whole &= ppu.clock % PPU_DOTS_PER_FRAME == 0;
+    }
+    ppu_output = pixels;
+    ppu_output_pitch = pitch;
+    if (format != ppu_output_format) {
+        ppu_output_format = format;
+        ppu_update_compose();
+    }
+}
+
+void ppu_set_mirroring(PPUMirroring mode) {
+    // VRAM page of each nametable, indexed by mode
+    static const uint8_t pages[5][4] = {
+        [PPU_MIRROR_HORIZONTAL]  = { 0, 0, 1, 1 },
+        [PPU_MIRROR_VERTICAL]    = { 0, 1, 0, 1 },
+        [PPU_MIRROR_SINGLE_LOW]  = { 0, 0, 0, 0 },
+        [PPU_MIRROR_SINGLE_HIGH] = { 1, 1, 1, 1 },
+        [PPU_MIRROR_FOUR_SCREEN] = { 0, 1, 2, 3 },
+    };
+    for (int i = 0; i < 4; i++) {
+        if (ppu_nametables[i] != ppu_vram + pages[mode][i] * 0x400) {
+            ppu_sync();
+            ppu_nametables[i] = ppu_vram + pages[mode][i] * 0x400;
+            ppu_change(PPU_CHANGE(PPU_CHANGE_NAMETABLE, i), pages[mode][i]);
+            ppu_log(PPU_LOG_NAMETABLE, i, pages[mode][i]);
+        }
+    }
+}
+
+
+/***************************** PALETTE *****************************/
+
+// 2C02 colors, as 0xRRGGBB
+#define PPU_COLORS(C) \
+    C(0x666666) C(0x002A88) C(0x1412A7) C(0x3B00A4) C(0x5C007E) C(0x6E0040) C(0x6C0600) C(0x561D00) \
+    C(0x333500) C(0x0B4800) C(0x005200) C(0x004F08) C(0x00404D) C(0x000000) C(0x000000) C(0x000000) \
+    C(0xADADAD) C(0x155FD9) C(0x4240FF) C(0x7527FE) C(0xA01ACC) C(0xB71E7B) C(0xB53120) C(0x994E00) \
+    C(0x6B6D00) C(0x388700) C(0x0C9300) C(0x008F32) C(0x007C8D) C(0x000000) C(0x000000) C(0x000000) \
+    C(0xFFFEFF) C(0x64B0FF) C(0x9290FF) C(0xC676FF) C(0xF36AFF) C(0xFE6ECC) C(0xFE8170) C(0xEA9E22) \
+    C(0xBCBE00) C(0x88D800) C(0x5CE430) C(0x45E082) C(0x48CDDE) C(0x4F4F4F) C(0x000000) C(0x000000) \
+    C(0xFFFEFF) C(0xC0DFFF) C(0xD3D2FF) C(0xE8C8FF) C(0xFBC2FF) C(0xFEC4EA) C(0xFECCC5) C(0xF7D8A5) \
+    C(0xE4E594) C(0xCFEF96) C(0xBDF4AB) C(0xB3F3CC) C(0xB5EBF2) C(0xB8B8B8) C(0x000000) C(0x000000)
+
+#define PPU_XRGB8888(rgb) rgb,
+#define PPU_RGB565(rgb) ((rgb) >> 8 & 0xF800) | ((rgb) >> 5 & 0x07E0) | ((rgb) >> 3 & 0x001F),
+
+static const uint32_t ppu_colors[64] = { PPU_COLORS(PPU_XRGB8888) };
+static const uint16_t ppu_colors565[64] = { PPU_COLORS(PPU_RGB565) };
+
+// $3F10/$3F14/$3F18/$3F1C are the same bytes as $3F00/$3F04/$3F08/$3F0C
+static inline uint8_t ppu_palette_index(uint16_t addr) {
+    return (addr & 0x13) == 0x10 ? addr & 0x0F : addr & 0x1F;
+}
+
+static void ppu_update_rgb(PPURaster *r) {
+    uint8_t gray = r->ppu->mask & PPU_MASK_GRAYSCALE ? 0x30 : 0x3F;
+    for (int i = 0; i < 32; i++) {
+        uint8_t color = r->ppu->palette[ppu_palette_index(i)] & gray;
+        r->rgb[i] = ppu_colors[color];
+        r->rgb565[i] = ppu_colors565[color];
+    }
+}
+
+// pixels are written, unless nobody looks, the render thread draws them later
+// or the output has them from the last frame
+static inline bool ppu_drawing() {
+    return ppu_output && !ppu_headless && !ppu_logging && !(ppu_same && ppu_output_valid);
+}
+
+// a pixel of the output, outside of line composition
+static inline void ppu_put(int line, int x, uint8_t color) {
+    if (ppu_output_format == PPU_FORMAT_RGB565) {
+        ((uint16_t *)ppu_output)[line * ppu_output_pitch + x] = ppu_rgb565[color];
+    } else {
+        ((uint32_t *)ppu_output)[line * ppu_output_pitch + x] = ppu_rgb[color];
+    }
+}
+
+
+/****************************** PPU CHR ****************************/
+
+// each bit of a byte spread to the lowest bit of a byte, bit 7 (leftmost pixel) first
+static uint64_t ppu_chr_spread[256];
+
+static void ppu_chr_init() {
+    for (int i = 0; i < 256; i++) {
+        uint64_t row = 0;
+        for (int b = 0; b < 8; b++) {
+            row |= (uint64_t)((i >> (7 - b)) & 1) << (b * 8);
+        }
+        ppu_chr_spread[i] = row;
+    }
+}
+
+static inline uint64_t ppu_chr_decode_row(uint8_t lo, uint8_t hi) {
+    return ppu_chr_spread[lo] | ppu_chr_spread[hi] << 1;
+}
+
+void ppu_decode_chr(const uint8_t *chr, uint64_t *rows, uint32_t size) {
+    if (!ppu_chr_spread[1]) {
+        ppu_chr_init();
+    }
+    for (uint32_t tile = 0; tile + 16 <= size; tile += 16) {
+        for (int y = 0; y < 8; y++) {
+            *rows++ = ppu_chr_decode_row(chr[tile + y], chr[tile + y + 8]);
+        }
+    }
+}
+
+// store a CHR RAM byte and decode again the row it belongs to
+static void ppu_chr_write(uint16_t addr, uint8_t value) {
+    uint8_t *page = ppu_chr_map[addr >> 10];
+    uint64_t *rows = ppu_chr_rows[addr >> 10];
+    uint16_t row = addr & 0x3F7;              // low bitplane byte of the row
+    int n = (row >> 4) * 8 + (row & 7);
+
+    if (page[addr & 0x3FF] == value) {
+        return;
+    }
+    ppu_content_changed();
+    page[addr & 0x3FF] = value;
+    rows[n] = ppu_chr_decode_row(page[row], page[row + 8]);
+    ppu_log_chr_row(rows, n);
+}
+
+
+/***************************** REGISTERS ***************************/
+
+// $3000-$3EFF mirrors the nametables
+static uint8_t ppu_vram_read(uint16_t addr) {
+    if (addr < 0x2000) {
+        if (cdl_enabled) {
+            cdl_log_chr(addr, CDL_CHR_READ);
+        }
+        return ppu_chr_map[addr >> 10][addr & 0x3FF];
+    }
+    if (addr < 0x3F00) {
+        return ppu_nametables[(addr >> 10) & 3][addr & 0x3FF];
+    }
+    return ppu.palette[ppu_palette_index(addr)];
+}
+
+static void ppu_vram_write(uint16_t addr, uint8_t value) {
+    if (addr < 0x2000) {
+        if (ppu_chr_writable) {
+            ppu_chr_write(addr, value);
+        }
+    } else if (addr < 0x3F00) {
+        uint8_t *byte = &ppu_nametables[(addr >> 10) & 3][addr & 0x3FF];
+        if (*byte != value) {
+            ppu_content_changed();
+            *byte = value;
+            ppu_log(PPU_LOG_VRAM, byte - ppu_vram, value);
+        }
+    } else {
+        uint8_t *color = &ppu.palette[ppu_palette_index(addr)];
+        if (*color != (value & 0x3F)) {
+            ppu_content_changed();
+            *color = value & 0x3F;
+            ppu_update_rgb(&ppu_raster);
+            ppu_log(PPU_LOG_PALETTE, ppu_palette_index(addr), value & 0x3F);
+        }
+    }
+}
+
+uint8_t ppu_read_register(uint16_t addr) {
+    uint8_t value;
+
+    switch (addr & 7) {
+        case 2:
+            // sprite 0 hit is found while drawing
+            ppu_draw_until(ppu.clock);
+            value = ppu.status;
+            ppu.status &= ~PPU_STATUS_VBLANK;
+            if (ppu.w) {
+                ppu_change(PPU_CHANGE(PPU_CHANGE_READ, 2), 0);
+            }
+            ppu.w = false;
+            return value;
+        case 4:
+            // unused attribute bits read back as 0
+            return (ppu.oam_addr & 3) == 2 ? ppu.oam[ppu.oam_addr] & 0xE3 : ppu.oam[ppu.oam_addr];
+        case 7:
+            // palette reads are not delayed, the buffer gets the nametable below
+            if ((ppu.v & 0x3FFF) >= 0x3F00) {
+                value = ppu_vram_read(ppu.v & 0x3FFF);
+                ppu.read_buffer = ppu_vram_read(ppu.v & 0x2FFF);
+            } else {
+                value = ppu.read_buffer;
+                ppu.read_buffer = ppu_vram_read(ppu.v & 0x3FFF);
+            }
+            ppu_change(PPU_CHANGE(PPU_CHANGE_READ, 7), 0);
+            ppu.v = (ppu.v + ((ppu.ctrl & PPU_CTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+            return value;
+        default:
+            return 0;
+    }
+}
+
+void ppu_write_register(uint16_t addr, uint8_t value) {
+    // OAM bytes count when they change (see ppu_content_changed())
+    if ((addr & 7) != 3 && (addr & 7) != 4) {
+        ppu_change(PPU_CHANGE(PPU_CHANGE_WRITE, addr & 7), value);
+    }
+    switch (addr & 7) {
+        case 0:
+        case 1:
+            ppu_draw_until(ppu.clock);
+            // the A12 pattern depends on both registers, mappers counting it
+            // catch up with the old values and predict again with the new ones
+            mapper_sync(ppu.clock);
+            if (addr & 1) {
+                bool gray = (ppu.mask ^ value) & PPU_MASK_GRAYSCALE;
+                ppu.mask = value;
+                if (gray) {
+                    ppu_update_rgb(&ppu_raster);
+                }
+            } else {
+                // enabling NMI during vblank raises it right away
+                if (!(ppu.ctrl & PPU_CTRL_NMI) && (value & PPU_CTRL_NMI) && (ppu.status & PPU_STATUS_VBLANK)) {
+                    cpu_nmi = true;
+                }
+                if ((ppu.ctrl ^ value) & PPU_CTRL_SPRITE_16) {
+                    ppu_raster.lists_dirty = true;
+                }
+                ppu.ctrl = value;
+                ppu.t = (ppu.t & ~0x0C00) | (value & PPU_CTRL_NAMETABLE) << 10;
+            }
+            mapper_schedule();
+            ppu_schedule();
+            break;
+        case 3:
+            ppu.oam_addr = value;
+            break;
+        case 4:
+            if (ppu.oam[ppu.oam_addr] != value) {
+                ppu_content_changed();
+                ppu_raster.lists_dirty |= (ppu.oam_addr & 3) == 0;
+                ppu_log(PPU_LOG_OAM, ppu.oam_addr, value);
+            }
+            ppu.oam[ppu.oam_addr++] = value;
+            ppu_schedule();
+            break;
+        case 5:
+            ppu_draw_until(ppu.clock);
+            // t: fine Y (bits 12-14), coarse Y (5-9), coarse X (0-4)
+            if (!ppu.w) {
+                ppu.t = (ppu.t & ~0x001F) | value >> 3;
+                ppu.x = value & 7;
+            } else {
+                ppu.t = (ppu.t & ~0x73E0) | (value & 7) << 12 | (value & 0xF8) << 2;
+            }
+            ppu.w = !ppu.w;
+            break;
+        case 6:
+            ppu_draw_until(ppu.clock);
+            if (!ppu.w) {
+                ppu.t = (ppu.t & 0x00FF) | (value & 0x3F) << 8;
+            } else {
+                ppu.t = (ppu.t & 0xFF00) | value;
+                ppu.v = ppu_raster.bg_v = ppu.t;
+            }
+            ppu.w = !ppu.w;
+            break;
+        case 7:
+            ppu_draw_until(ppu.clock);
+            ppu_vram_write(ppu.v & 0x3FFF, value);
+            ppu.v = (ppu.v + ((ppu.ctrl & PPU_CTRL_INCREMENT) ? 32 : 1)) & 0x7FFF;
+            break;
+    }
+}
+
+void ppu_oam_dma(uint8_t page) {
+    for (int i = 0; i < 256; i++) {
+        uint8_t *byte = &ppu.oam[(uint8_t)(ppu.oam_addr + i)];
+        uint8_t value = cpu_read(page << 8 | i);
+        if (*byte != value) {
+            ppu_content_changed();
+            *byte = value;
+            ppu_log(PPU_LOG_OAM, byte - ppu.oam, value);
+        }
+    }
+    ppu_raster.lists_dirty = true;
+    ppu_schedule();
+}
+
+
+/***************************** RENDERER ****************************/
+
+#define SPRITE_COLOR  0x1F    // PPUSprite.attr and spr_line: palette index
+#define SPRITE_BEHIND 0x40    // PPUSprite.attr and spr_line: behind the background
+#define SPRITE_ZERO   0x80    // PPUSprite.attr and spr_line: sprite 0
+
+// a sprite on the line being drawn
+typedef struct {
+    uint64_t pixels;          // its row, flipped as shown
+    uint8_t attr;             // 0x10 | palette << 2, SPRITE_BEHIND, SPRITE_ZERO
+    uint8_t x;
+} PPUSprite;
+
+// the render thread never runs with the logger on (see RENDER THREAD)
+static inline uint64_t ppu_chr_row(const PPURaster *r, uint16_t addr) {
+    if (cdl_enabled) {
+        cdl_log_chr(addr, CDL_CHR_DRAWN);
+        cdl_log_chr(addr + 8, CDL_CHR_DRAWN);
+    }
+    return r->chr_rows[addr >> 10][((addr & 0x3FF) >> 4) * 8 + (addr & 7)];
+}
+
+// pattern row of a background tile, opaque pixels with the attribute palette
+static inline uint64_t ppu_bg_row(const PPURaster *r, uint8_t tile, uint8_t palette, uint16_t v) {
+    uint64_t pixels = ppu_chr_row(r, (r->ppu->ctrl & PPU_CTRL_BG_TABLE) << 8 | tile << 4 | v >> 12);
+    uint64_t opaque = ((pixels | pixels >> 1) & 0x0101010101010101) * 0xFF;
+    return pixels | ((palette * 0x0101010101010101) & opaque);
+}
+
+static inline uint8_t ppu_bg_tile(const PPURaster *r, uint16_t v) {
+    return r->nametables[(v >> 10) & 3][v & 0x3FF];
+}
+
+// palette of the tile at v, shifted to bits 2-3
+static inline uint8_t ppu_bg_palette(const PPURaster *r, uint16_t v) {
+    uint8_t attr = r->nametables[(v >> 10) & 3][0x3C0 | ((v >> 4) & 0x38) | ((v >> 2) & 7)];
+    return ((attr >> (((v >> 4) & 4) | (v & 2))) & 3) << 2;
+}
+
+// coarse X of v, to the next nametable horizontally
+static inline uint16_t ppu_next_x(uint16_t v) {
+    return (v & 0x1F) == 31 ? (v & ~0x1F) ^ 0x0400 : v + 1;
+}
+
+// v two tiles back: the tile shown while v is fetched
+static inline uint16_t ppu_shown_x(uint16_t v) {
+    return (v & 0x1F) < 2 ? ((v & ~0x1F) | ((v - 2) & 0x1F)) ^ 0x0400 : v - 2;
+}
+
+// fine Y then coarse Y of v, to the next nametable vertically after row 29
+static void ppu_increment_y() {
+    if ((ppu.v & 0x7000) != 0x7000) {
+        ppu.v += 0x1000;
+        return;
+    }
+    ppu.v &= ~0x7000;
+    uint16_t y = (ppu.v >> 5) & 31;
+    if (y == 29) {
+        y = 0;
+        ppu.v ^= 0x0800;
+    } else {
+        y = (y + 1) & 31;
+    }
+    ppu.v = (ppu.v & ~0x03E0) | y << 5;
+}
+
+/*
+    Sprites of each line, as OAM indices in OAM order, all of them (the limit of
+    8 is applied when they are fetched). The lists only depend on the Y bytes of
+    OAM and the sprite height, and are built again at the next fetch after one of
+    them changes, instead of scanning OAM on every line.
+*/
+bool ppu_sprite_limit = true;
+
+static void ppu_build_lists(PPURaster *r) {
+    int height = r->ppu->ctrl & PPU_CTRL_SPRITE_16 ? 16 : 8;
+
+    memset(r->list_size, 0, sizeof(r->list_size));
+    for (int i = 0; i < 64; i++) {
+        int top = r->ppu->oam[i * 4] + 1;
+        for (int line = top; line < top + height && line < PPU_VISIBLE_LINES; line++) {
+            r->lists[line][r->list_size[line]++] = i;
+        }
+    }
+    r->lists_dirty = false;
+}
+
+// the sprites shown on `line` in OAM order, setting the overflow flag past 8;
+// returns their number
+static int ppu_line_sprites(PPURaster *r, int line, PPUSprite sprites[64]) {
+    int height = r->ppu->ctrl & PPU_CTRL_SPRITE_16 ? 16 : 8;
+    int count;
+
+    if (line >= PPU_VISIBLE_LINES) {
+        return 0;
+    }
+    if (r->lists_dirty) {
+        ppu_build_lists(r);
+    }
+    count = r->list_size[line];
+    if (count > 8) {
+        r->ppu->status |= PPU_STATUS_OVERFLOW;
+        if (*r->sprite_limit) {
+            count = 8;
+        }
+    }
+    for (int n = 0; n < count; n++) {
+        int i = r->lists[line][n];
+        const uint8_t *s = &r->ppu->oam[i * 4];
+        int row = line - s[0] - 1;
+        uint8_t attr = s[2];
+        uint16_t addr;
+
+        if (attr & 0x80) {
+            row = height - 1 - row;
+        }
+        if (height == 16) {
+            addr = (s[1] & 1) << 12 | (s[1] & 0xFE) << 4 | (row & 8) << 1 | (row & 7);
+        } else {
+            addr = (r->ppu->ctrl & PPU_CTRL_SPRITE_TABLE) << 9 | s[1] << 4 | row;
+        }
+        uint64_t pixels = ppu_chr_row(r, addr);
+        sprites[n] = (PPUSprite){
+            .pixels = attr & 0x40 ? ppu_chr_flip(pixels) : pixels,
+            .attr = 0x10 | (attr & 3) << 2 | (attr & 0x20 ? SPRITE_BEHIND : 0) | (i == 0 ? SPRITE_ZERO : 0),
+            .x = s[3],
+        };
+    }
+    return count;
+}
+
+
+/*************************** COMPOSITION ***************************/
+
+/*
+    Pixels [0, n) of a line: the sprite pixel over the background one unless behind
+    an opaque one, translated through `colors` (the 32 of palette RAM in the output
+    format). Returns true if sprite 0 hits. Each variant is built once per format,
+    from an inline body the format is a constant of.
+*/
+typedef bool (*PPUCompose)(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors);
+
+#define PPU_INLINE static inline __attribute__((always_inline))
+
+PPU_INLINE void *ppu_pixel_at(void *out, int x, PPUFormat format) {
+    return (uint8_t *)out + x * (format == PPU_FORMAT_RGB565 ? 2 : 4);
+}
+
+PPU_INLINE bool ppu_compose_scalar_as(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors,
+                                      PPUFormat format) {
+    bool hit = false;
+
+    for (int x = 0; x < n; x++) {
+        uint8_t color = bg[x];
+        uint8_t s = spr[x];
+        if (s) {
+            hit |= (s & SPRITE_ZERO) && color;
+            if (!color || !(s & SPRITE_BEHIND)) {
+                color = s & SPRITE_COLOR;
+            }
+        }
+        if (format == PPU_FORMAT_RGB565) {
+            ((uint16_t *)out)[x] = ((const uint16_t *)colors)[color];
+        } else {
+            ((uint32_t *)out)[x] = ((const uint32_t *)colors)[color];
+        }
+    }
+    return hit;
+}
+
+static bool ppu_compose_scalar(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    return ppu_compose_scalar_as(out, bg, spr, n, colors, PPU_FORMAT_XRGB8888);
+}
+
+static bool ppu_compose_scalar565(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    return ppu_compose_scalar_as(out, bg, spr, n, colors, PPU_FORMAT_RGB565);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define PPU_SIMD_X86
+
+// the colors of 16 pixels, and their sprite 0 hits as a bit mask
+__attribute__((target("sse2")))
+static inline __m128i ppu_mux_sse2(__m128i bg, __m128i spr, int *hits) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i behind = _mm_set1_epi8(SPRITE_BEHIND);
+    const __m128i sprite_0 = _mm_set1_epi8((char)SPRITE_ZERO);
+    __m128i bg_clear = _mm_cmpeq_epi8(bg, zero);
+    __m128i spr_clear = _mm_cmpeq_epi8(spr, zero);
+    __m128i spr_behind = _mm_cmpeq_epi8(_mm_and_si128(spr, behind), behind);
+    __m128i spr_0 = _mm_cmpeq_epi8(_mm_and_si128(spr, sprite_0), sprite_0);
+    // the background shows without a sprite, or with one behind it
+    __m128i show_bg = _mm_or_si128(spr_clear, _mm_andnot_si128(bg_clear, spr_behind));
+
+    *hits |= _mm_movemask_epi8(_mm_andnot_si128(bg_clear, spr_0));
+    return _mm_or_si128(_mm_and_si128(show_bg, bg),
+                        _mm_andnot_si128(show_bg, _mm_and_si128(spr, _mm_set1_epi8(SPRITE_COLOR))));
+}
+
+// SSE2 has no gather: colors are looked up one by one, out of two 64-bit halves
+__attribute__((target("sse2")))
+PPU_INLINE bool ppu_compose_sse2_as(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors,
+                                    PPUFormat format) {
+    int hits = 0, x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i c = ppu_mux_sse2(_mm_loadu_si128((const __m128i *)(bg + x)),
+                                 _mm_loadu_si128((const __m128i *)(spr + x)), &hits);
+        uint64_t pair[2];
+        _mm_storeu_si128((__m128i *)pair, c);
+        for (int h = 0; h < 2; h++) {
+            for (int i = 0; i < 8; i++, pair[h] >>= 8) {
+                if (format == PPU_FORMAT_RGB565) {
+                    ((uint16_t *)out)[x + h * 8 + i] = ((const uint16_t *)colors)[pair[h] & 0xFF];
+                } else {
+                    ((uint32_t *)out)[x + h * 8 + i] = ((const uint32_t *)colors)[pair[h] & 0xFF];
+                }
+            }
+        }
+    }
+    return ppu_compose_scalar_as(ppu_pixel_at(out, x, format), bg + x, spr + x, n - x, colors, format) || hits;
+}
+
+__attribute__((target("sse2")))
+static bool ppu_compose_sse2(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    return ppu_compose_sse2_as(out, bg, spr, n, colors, PPU_FORMAT_XRGB8888);
+}
+
+__attribute__((target("sse2")))
+static bool ppu_compose_sse2565(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    return ppu_compose_sse2_as(out, bg, spr, n, colors, PPU_FORMAT_RGB565);
+}
+
+// the colors of 32 pixels, and their sprite 0 hits as a bit mask
+__attribute__((target("avx2")))
+PPU_INLINE __m256i ppu_mux_avx2(__m256i b, __m256i s, int *hits) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i behind = _mm256_set1_epi8(SPRITE_BEHIND);
+    const __m256i sprite_0 = _mm256_set1_epi8((char)SPRITE_ZERO);
+    __m256i bg_clear = _mm256_cmpeq_epi8(b, zero);
+    __m256i spr_behind = _mm256_cmpeq_epi8(_mm256_and_si256(s, behind), behind);
+    __m256i spr_0 = _mm256_cmpeq_epi8(_mm256_and_si256(s, sprite_0), sprite_0);
+    __m256i show_bg = _mm256_or_si256(_mm256_cmpeq_epi8(s, zero), _mm256_andnot_si256(bg_clear, spr_behind));
+
+    *hits |= _mm256_movemask_epi8(_mm256_andnot_si256(bg_clear, spr_0));
+    return _mm256_blendv_epi8(_mm256_and_si256(s, _mm256_set1_epi8(SPRITE_COLOR)), b, show_bg);
+}
+
+// 32 pixels per step, colors gathered 8 at a time
+__attribute__((target("avx2")))
+static bool ppu_compose_avx2(void *out_, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    uint32_t *out = out_;
+    const int *rgb = colors;
+    int hits = 0, x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        __m256i c = ppu_mux_avx2(_mm256_loadu_si256((const __m256i *)(bg + x)),
+                                 _mm256_loadu_si256((const __m256i *)(spr + x)), &hits);
+        __m128i lo = _mm256_castsi256_si128(c);
+        __m128i hi = _mm256_extracti128_si256(c, 1);
+
+        _mm256_storeu_si256((__m256i *)(out + x),
+                            _mm256_i32gather_epi32(rgb, _mm256_cvtepu8_epi32(lo), 4));
+        _mm256_storeu_si256((__m256i *)(out + x + 8),
+                            _mm256_i32gather_epi32(rgb, _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)), 4));
+        _mm256_storeu_si256((__m256i *)(out + x + 16),
+                            _mm256_i32gather_epi32(rgb, _mm256_cvtepu8_epi32(hi), 4));
+        _mm256_storeu_si256((__m256i *)(out + x + 24),
+                            _mm256_i32gather_epi32(rgb, _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)), 4));
+    }
+    return ppu_compose_sse2(out + x, bg + x, spr + x, n - x, colors) || hits;
+}
+
+/*
+    RGB565: the 32 colors are 64 bytes, so instead of gathers the low and high byte
+    of 32 pixels are each looked up with two byte shuffles (colors 0-15 and 16-31,
+    picked by bit 4), then interleaved into pixels.
+*/
+__attribute__((target("avx2")))
+static bool ppu_compose_avx2565(void *out_, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    uint16_t *out = out_;
+    const uint16_t *rgb565 = colors;
+    int hits = 0, x = 0;
+
+    if (n < 32) {
+        return ppu_compose_sse2565(out, bg, spr, n, colors);
+    }
+    // split the table in bytes: low bytes of colors 0-15 and 16-31, then high bytes
+    const __m256i bytes = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+                                           0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    __m256i t0 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)rgb565), bytes);
+    __m256i t1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(rgb565 + 16)), bytes);
+    __m256i lo0 = _mm256_permute4x64_epi64(t0, 0x88), hi0 = _mm256_permute4x64_epi64(t0, 0xDD);
+    __m256i lo1 = _mm256_permute4x64_epi64(t1, 0x88), hi1 = _mm256_permute4x64_epi64(t1, 0xDD);
+
+    for (; x + 32 <= n; x += 32) {
+        __m256i c = ppu_mux_avx2(_mm256_loadu_si256((const __m256i *)(bg + x)),
+                                 _mm256_loadu_si256((const __m256i *)(spr + x)), &hits);
+        __m256i high = _mm256_slli_epi16(c, 3);
+        __m256i l = _mm256_blendv_epi8(_mm256_shuffle_epi8(lo0, c), _mm256_shuffle_epi8(lo1, c), high);
+        __m256i h = _mm256_blendv_epi8(_mm256_shuffle_epi8(hi0, c), _mm256_shuffle_epi8(hi1, c), high);
+        __m256i p0 = _mm256_unpacklo_epi8(l, h);
+        __m256i p1 = _mm256_unpackhi_epi8(l, h);
+
+        _mm256_storeu_si256((__m256i *)(out + x), _mm256_permute2x128_si256(p0, p1, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + x + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+    }
+    return ppu_compose_sse2565(out + x, bg + x, spr + x, n - x, colors) || hits;
+}
+#endif
+
+static bool ppu_compose_auto(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors);
+
+const char *const ppu_simd_names[PPU_SIMD_COUNT] = { "scalar", "sse2", "avx2" };
+static const PPUCompose ppu_compose_variants[PPU_FORMAT_COUNT][PPU_SIMD_COUNT] = {
+    [PPU_FORMAT_XRGB8888] = {
+        ppu_compose_scalar,
+#ifdef PPU_SIMD_X86
+        ppu_compose_sse2, ppu_compose_avx2,
+#endif
+    },
+    [PPU_FORMAT_RGB565] = {
+        ppu_compose_scalar565,
+#ifdef PPU_SIMD_X86
+        ppu_compose_sse2565, ppu_compose_avx2565,
+#endif
+    },
+};
+static PPUSimd ppu_simd;
+static PPUCompose ppu_compose = ppu_compose_auto;
+
+// the chosen variant, for the output format
+static void ppu_update_compose() {
+    if (ppu_compose != ppu_compose_auto) {
+        ppu_compose = ppu_compose_variants[ppu_output_format][ppu_simd];
+    }
+}
+
+bool ppu_set_simd(PPUSimd simd) {
+    bool supported = simd == PPU_SIMD_SCALAR;
+
+#ifdef PPU_SIMD_X86
+    __builtin_cpu_init();
+    if (simd == PPU_SIMD_SSE2) {
+        supported = __builtin_cpu_supports("sse2");
+    } else if (simd == PPU_SIMD_AVX2) {
+        supported = __builtin_cpu_supports("avx2");
+    }
+#endif
+    if (supported) {
+        ppu_simd = simd;
+        ppu_compose = ppu_compose_variants[ppu_output_format][simd];
+    }
+    return supported;
+}
+
+// the best variant the CPU has, unless one was set
+static void ppu_pick_simd() {
+    for (int simd = PPU_SIMD_COUNT - 1; ppu_compose == ppu_compose_auto && !ppu_set_simd(simd); simd--) {
+    }
+}
+
+// the first line picks the variant
+static bool ppu_compose_auto(void *out, const uint8_t *bg, const uint8_t *spr, int n, const void *colors) {
+    ppu_pick_simd();
+    return ppu_compose(out, bg, spr, n, colors);
+}
+
+
+/************************ SCANLINE RENDERER ************************/
+
+// sprites of `line` into spr_line in one pass, last to first so that the
+// first opaque pixel is the one left
+static void ppu_eval_sprites(PPURaster *r, int line) {
+    PPUSprite sprites[64];
+    int count;
+
+    memset(r->spr_line, 0, sizeof(r->spr_line));
+    r->spr_zero_x = -1;
+    if (!(r->ppu->mask & PPU_MASK_SPRITES)) {
+        return;
+    }
+    count = ppu_line_sprites(r, line, sprites);
+    r->spr_zero_x = count && (sprites[0].attr & SPRITE_ZERO) ? sprites[0].x : -1;
+    for (int i = count - 1; i >= 0; i--) {
+        uint64_t pixels = sprites[i].pixels;
+        for (int x = sprites[i].x, n = 0; n < 8 && x < PPU_WIDTH; n++, x++, pixels >>= 8) {
+            if (pixels & 3) {
+                r->spr_line[x] = sprites[i].attr | (pixels & 3);
+            }
+        }
+    }
+    if (!(r->ppu->mask & PPU_MASK_SPRITE_LEFT)) {
+        memset(r->spr_line, 0, 8);
+    }
+    // no hit on the last pixel
+    r->spr_line[PPU_WIDTH - 1] &= ~SPRITE_ZERO;
+}
+
+// pass the tiles of pixels [from, to) without fetching them
+static void ppu_skip_background(PPURaster *r, int from, int to) {
+    PPU *p = r->ppu;
+
+    for (int x = from; x < to;) {
+        int n = 8 - p->fine;
+        if (x + n > to) {
+            p->fine += to - x;
+            break;
+        }
+        x += n;
+        p->fine = 0;
+        r->bg_v = ppu_next_x(r->bg_v);
+        p->v = ppu_next_x(p->v);
+    }
+}
+
+// background pixels [from, to) of the line, tile by tile
+static void ppu_draw_background(PPURaster *r, int from, int to) {
+    PPU *p = r->ppu;
+    uint8_t *bg_line = r->bg_buf + 8;
+
+    if (!(p->mask & PPU_MASK_BG)) {
+        memset(bg_line + from, 0, to - from);
+        ppu_skip_background(r, from, to);
+        return;
+    }
+    for (int x = from; x < to;) {
+        uint64_t pixels = ppu_bg_row(r, ppu_bg_tile(r, r->bg_v), ppu_bg_palette(r, r->bg_v), r->bg_v);
+        int n = 8 - p->fine;
+
+        memcpy(bg_line + x - p->fine, &pixels, 8);
+        if (x + n > to) {
+            p->fine += to - x;
+            break;
+        }
+        x += n;
+        p->fine = 0;
+        r->bg_v = ppu_next_x(r->bg_v);
+        p->v = ppu_next_x(p->v);
+    }
+    if (from < 8 && !(p->mask & PPU_MASK_BG_LEFT)) {
+        memset(bg_line, 0, 8);
+    }
+}
+
+// headless: only the background under sprite 0 is fetched, for its hit
+static void ppu_draw_hit(PPURaster *r, int from, int to) {
+    int end = r->spr_zero_x + 8 < to ? r->spr_zero_x + 8 : to;
+    const uint8_t *bg_line = r->bg_buf + 8;
+
+    if (r->spr_zero_x < 0 || !(r->ppu->mask & PPU_MASK_BG) || (r->ppu->status & PPU_STATUS_SPRITE_0) ||
+        end <= from) {
+        ppu_skip_background(r, from, to);
+        return;
+    }
+    ppu_draw_background(r, from, to);
+    for (int x = r->spr_zero_x > from ? r->spr_zero_x : from; x < end; x++) {
+        if ((r->spr_line[x] & SPRITE_ZERO) && bg_line[x]) {
+            r->ppu->status |= PPU_STATUS_SPRITE_0;
+            break;
+        }
+    }
+}
+
+// pixels [from, to) of the line `out` points to, the backdrop with rendering
+// disabled; true if sprite 0 hits
+static bool ppu_draw_pixels(PPURaster *r, void *out, PPUFormat format, PPUCompose compose, int from, int to) {
+    const void *colors = format == PPU_FORMAT_RGB565 ? (const void *)r->rgb565 : r->rgb;
+
+    if (!(r->ppu->mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+        for (int x = from; x < to; x++) {
+            if (format == PPU_FORMAT_RGB565) {
+                ((uint16_t *)out)[x] = r->rgb565[0];
+            } else {
+                ((uint32_t *)out)[x] = r->rgb[0];
+            }
+        }
+        return false;
+    }
+    ppu_draw_background(r, from, to);
+    return compose(ppu_pixel_at(out, from, format), r->bg_buf + 8 + from, r->spr_line + from, to - from, colors);
+}
+
+// draw pixels [ppu.drawn, to) of a visible line, or log them for the render thread
+static void ppu_draw(int line, int to) {
+    PPURaster *r = &ppu_raster;
+    bool rendering = ppu.mask & (PPU_MASK_BG | PPU_MASK_SPRITES);
+    int from = ppu.drawn;
+
+    if (from >= to) {
+        return;
+    }
+    ppu.drawn = to;
+    if (rendering && from == 0) {
+        ppu.fine = ppu.x;
+        r->bg_v = ppu_shown_x(ppu.v);
+        ppu_eval_sprites(r, line);
+    }
+    if (ppu_logging && !ppu_headless) {
+        ppu_log(PPU_LOG_DRAW, line, (uint64_t)from << 16 | to);
+    }
+    if (!ppu_drawing()) {
+        if (rendering) {
+            ppu_draw_hit(r, from, to);
+        }
+        return;
+    }
+    if (ppu_draw_pixels(r, ppu_pixel_at(ppu_output, line * ppu_output_pitch, ppu_output_format), ppu_output_format,
+                        ppu_compose, from, to)) {
+        ppu.status |= PPU_STATUS_SPRITE_0;
+    }
+}
+
+// draw the current visible line up to `now`, before a register it depends on changes
+static void ppu_draw_until(uint64_t now) {
+    uint32_t line = now % PPU_DOTS_PER_FRAME / PPU_DOTS_PER_LINE;
+    uint32_t dot = now % PPU_DOTS_PER_LINE;
+
+    if (ppu_renderer == PPU_RENDERER_SCANLINE && line < PPU_VISIBLE_LINES && dot > 1) {
+        ppu_draw(line, dot <= PPU_WIDTH ? dot - 1 : PPU_WIDTH);
+    }
+}
+
+// dots [from, to) of `line`: draw it at dot 256, then the scroll updates of the dots passed
+static void ppu_scanline_run(uint32_t line, uint32_t from, uint32_t to) {
+    if (from == 0) {
+        ppu.drawn = 0;
+    }
+    if (line < PPU_VISIBLE_LINES && from <= PPU_WIDTH && to > PPU_WIDTH) {
+        ppu_draw(line, PPU_WIDTH);
+    }
+    if (!(ppu.mask & (PPU_MASK_BG | PPU_MASK_SPRITES)) ||
+        (line >= PPU_VISIBLE_LINES && line != PPU_PRERENDER_LINE)) {
+        return;
+    }
+    if (from <= 256 && to > 256) {
+        ppu_increment_y();
+    }
+    if (from <= 257 && to > 257) {
+        ppu.v = (ppu.v & ~0x041F) | (ppu.t & 0x041F);
+    }
+    if (line == PPU_PRERENDER_LINE && from <= 304 && to > 304) {
+        ppu.v = (ppu.v & ~0x7BE0) | (ppu.t & 0x7BE0);
+    }
+    // the two tiles prefetched for the next line
+    if (from <= 328 && to > 328) {
+        ppu.v = ppu_next_x(ppu.v);
+    }
+    if (from <= 336 && to > 336) {
+        ppu.v = ppu_next_x(ppu.v);
+    }
+}
+
+
+/*************************** DOT RENDERER **************************/
+
+// pipeline of the dot renderer, between fetches and pixels
+static struct {
+    uint64_t bg[2];           // next 16 background pixels, first in the low byte of bg[0]
+    uint64_t bg_next;         // tile fetched, loaded into bg[1] every 8 dots
+    uint8_t tile;             // nametable byte fetched
+    uint8_t palette;          // attribute bits fetched, shifted to bits 2-3
+    uint8_t count;            // sprites on the line
+    PPUSprite sprites[64];
+} dot;
+
+// the pipeline at the start of a line: the two tiles prefetched at dots 321-336
+static void ppu_dot_resync() {
+    uint16_t v = ppu_shown_x(ppu.v);
+
+    dot.count = 0;
+    for (int i = 0; i < 2; i++, v = ppu_next_x(v)) {
+        dot.bg[i] = ppu_bg_row(&ppu_raster, ppu_bg_tile(&ppu_raster, v), ppu_bg_palette(&ppu_raster, v), v);
+    }
+}
+
+static void ppu_dot_pixel(uint32_t line, uint32_t x) {
+    uint8_t color = 0;
+
+    if ((ppu.mask & PPU_MASK_BG) && (x >= 8 || (ppu.mask & PPU_MASK_BG_LEFT))) {
+        uint64_t window = ppu.x ? dot.bg[0] >> (ppu.x * 8) | dot.bg[1] << (64 - ppu.x * 8) : dot.bg[0];
+        color = window & 0xFF;
+    }
+    if ((ppu.mask & PPU_MASK_SPRITES) && (x >= 8 || (ppu.mask & PPU_MASK_SPRITE_LEFT))) {
+        for (int i = 0; i < dot.count; i++) {
+            uint32_t n = x - dot.sprites[i].x;
+            uint8_t pixel = n < 8 ? (dot.sprites[i].pixels >> (n * 8)) & 3 : 0;
+            if (!pixel) {
+                continue;
+            }
+            if ((dot.sprites[i].attr & SPRITE_ZERO) && color && x != 255) {
+                ppu.status |= PPU_STATUS_SPRITE_0;
+            }
+            if (!color || !(dot.sprites[i].attr & SPRITE_BEHIND)) {
+                color = (dot.sprites[i].attr & SPRITE_COLOR) | pixel;
+            }
+            break;
+        }
+    }
+    if (ppu_drawing()) {
+        ppu_put(line, x, color);
+    }
+}
+
+// dots [from, to) of `line`, one at a time: a pixel, then the fetches of the dot
+static void ppu_dot_run(uint32_t line, uint32_t from, uint32_t to) {
+    bool visible = line < PPU_VISIBLE_LINES;
+
+    if (!visible && line != PPU_PRERENDER_LINE) {
+        return;
+    }
+    for (uint32_t d = from; d < to; d++) {
+        if (!(ppu.mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+            if (visible && d >= 1 && d <= PPU_WIDTH && ppu_drawing()) {
+                ppu_put(line, d - 1, 0);
+            }
+            continue;
+        }
+        bool fetching = (d >= 1 && d <= 256) || (d >= 321 && d <= 336);
+        if (visible && d >= 1 && d <= PPU_WIDTH) {
+            ppu_dot_pixel(line, d - 1);
+        }
+        if ((d >= 1 && d <= 256) || (d >= 329 && d <= 336)) {
+            dot.bg[0] = dot.bg[0] >> 8 | dot.bg[1] << 56;
+            dot.bg[1] >>= 8;
+        }
+        if (fetching) {
+            switch (d & 7) {
+                case 1: dot.tile = ppu_bg_tile(&ppu_raster, ppu.v); break;
+                case 3: dot.palette = ppu_bg_palette(&ppu_raster, ppu.v); break;
+                case 5: dot.bg_next = ppu_bg_row(&ppu_raster, dot.tile, dot.palette, ppu.v); break;
+                case 0:
+                    dot.bg[1] = dot.bg_next;
+                    ppu.v = ppu_next_x(ppu.v);
+                    break;
+            }
+        }
+        if (d == 256) {
+            ppu_increment_y();
+        } else if (d == 257) {
+            ppu.v = (ppu.v & ~0x041F) | (ppu.t & 0x041F);
+            dot.count = visible ? ppu_line_sprites(&ppu_raster, line + 1, dot.sprites) : 0;
+        } else if (line == PPU_PRERENDER_LINE && d >= 280 && d <= 304) {
+            ppu.v = (ppu.v & ~0x7BE0) | (ppu.t & 0x7BE0);
+        }
+    }
+}
+
+
+/****************************** TIMING *****************************/
+
+PPURenderer ppu_renderer;
+
+void ppu_set_renderer(PPURenderer renderer) {
+    PPURenderer last = ppu_renderer;
+
+    if (renderer == PPU_RENDERER_DOT && last != PPU_RENDERER_DOT) {
+        ppu_dot_resync();
+    }
+    ppu_renderer = renderer;
+    if (renderer != last) {
+        ppu_changes_reset();
+    }
+}
+
+// vblank and status flags of dots [from, to) of `line`
+static void ppu_run_flags(uint32_t line, uint32_t from, uint32_t to) {
+    if (from > 1 || to <= 1) {
+        return;
+    }
+    if (line == PPU_VISIBLE_LINES + 1) {
+        ppu.status |= PPU_STATUS_VBLANK;
+        if (ppu.ctrl & PPU_CTRL_NMI) {
+            cpu_nmi = true;
+        }
+    } else if (line == PPU_PRERENDER_LINE) {
+        ppu.status &= ~(PPU_STATUS_VBLANK | PPU_STATUS_SPRITE_0 | PPU_STATUS_OVERFLOW);
+    }
+}
+
+void ppu_run(uint64_t until) {
+    while (ppu.clock < until) {
+        uint32_t dot = ppu.clock % PPU_DOTS_PER_LINE;
+        uint32_t line = ppu.clock % PPU_DOTS_PER_FRAME / PPU_DOTS_PER_LINE;
+        uint32_t end = until - ppu.clock < PPU_DOTS_PER_LINE - dot ? dot + (until - ppu.clock) : PPU_DOTS_PER_LINE;
+
+        ppu_changes_pending(line * PPU_DOTS_PER_LINE + end);
+        if (ppu_renderer == PPU_RENDERER_DOT) {
+            ppu_dot_run(line, dot, end);
+        } else {
+            ppu_scanline_run(line, dot, end);
+        }
+        ppu_run_flags(line, dot, end);
+        ppu.clock += end - dot;
+        if (ppu.clock % PPU_DOTS_PER_FRAME == 0) {
+            ppu_end_frame();
+        }
+    }
+    ppu_schedule();
+}
+
+// the boundary the frame being run ends on
+static uint64_t ppu_frame_end() {
+    return (ppu.clock / PPU_DOTS_PER_FRAME + 1) * PPU_DOTS_PER_FRAME;
+}
+
+void ppu_sync() {
+    // the instruction that ends a frame may touch the PPU a few dots past it: the
+    // frame still ends on its boundary, into the output it was given
+    uint64_t until = cpu_clock < ppu_frame_end() ? cpu_clock : ppu_frame_end();
+
+    if (ppu.clock < until) {
+        ppu_run(until);
+    }
+    ppu_draw_until(ppu.clock);
+}
+
+void ppu_run_frame() {
+    uint64_t end = ppu_frame_end();
+
+    // without a program running, the rest of the frame is idle time
+    if (cpu_clock < end) {
+        cpu_clock = end;
+    }
+    ppu_run(end);
+    ppu_draw_until(ppu.clock);
+    mapper_sync(cpu_clock);
+}
+
+
+/************************** FRAME CHANGES **************************/
+
+/*
+    A frame is drawn like the last one when it starts in the same state, with the
+    same VRAM, palette and OAM, and goes through the same changes at the same dots:
+    register accesses that affect scrolling or rendering, CHR pages or mirroring
+    switched. Each change extends a hash, checked against the last frame's after as
+    many changes; the frame is also told apart when it runs past the dot of a change
+    the last one had next. A byte of VRAM, palette or OAM written with a new value
+    sets apart the frame, and the next one from its first line.
+*/
+#define PPU_CHANGES_MAX 4096
+
+typedef struct {
+    uint64_t hash;            // of the frame's changes up to this one
+    uint32_t at;              // its dot in the frame
+} PPUChange;
+
+static PPUChange ppu_changes[2][PPU_CHANGES_MAX];
+static uint32_t ppu_change_count[2];
+static int ppu_changes_now;           // current frame in ppu_changes, the other one is the last
+static uint64_t ppu_change_hash;
+static bool ppu_changes_forced;       // this frame and the next are changed
+
+static inline uint64_t ppu_mix(uint64_t hash, uint64_t value) {
+    hash = (hash ^ value) * 0x9E3779B97F4A7C15ull;
+    return hash ^ hash >> 29;
+}
+
+static void ppu_change(uint64_t what, uint64_t value) {
+    const PPUChange *last = ppu_changes[!ppu_changes_now];
+    uint32_t n = ppu_change_count[ppu_changes_now]++;
+    uint32_t at = ppu.clock % PPU_DOTS_PER_FRAME;
+
+    ppu_change_hash = ppu_mix(ppu_mix(ppu_mix(ppu_change_hash, what), value), at);
+    if (n >= PPU_CHANGES_MAX) {
+        ppu_same = false;
+        return;
+    }
+    if (n >= ppu_change_count[!ppu_changes_now] || last[n].hash != ppu_change_hash) {
+        ppu_same = false;
+    }
+    ppu_changes[ppu_changes_now][n] = (PPUChange){ ppu_change_hash, at };
+}
+
+// before running to `at` (dot in the frame): the last frame had a change earlier
+static void ppu_changes_pending(uint32_t at) {
+    uint32_t n = ppu_change_count[ppu_changes_now];
+
+    if (ppu_same && n < ppu_change_count[!ppu_changes_now] && n < PPU_CHANGES_MAX &&
+        ppu_changes[!ppu_changes_now][n].at < at) {
+        ppu_same = false;
+    }
+}
+
+static void ppu_start_frame() {
+    uint64_t state = ppu.ctrl | ppu.mask << 8 | ppu.x << 16 | ppu.w << 19 | ppu_sprite_limit << 20 |
+                     ppu_renderer << 21 | (uint64_t)ppu.v << 32 | (uint64_t)ppu.t << 48;
+
+    for (int i = 0; i < 8; i++) {
+        state = ppu_mix(state, (uintptr_t)ppu_chr_map[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        state = ppu_mix(state, (uintptr_t)ppu_nametables[i]);
+    }
+    // the dot renderer has prefetched the first tiles
+    state = ppu_mix(ppu_mix(ppu_mix(state, dot.bg[0]), dot.bg[1]), dot.bg_next);
+    state = ppu_mix(state, dot.tile | dot.palette << 8);
+
+    ppu_changes_now ^= 1;
+    ppu_change_count[ppu_changes_now] = 0;
+    ppu_change_hash = 0;
+    ppu_same = !ppu_changes_forced;
+    ppu_changes_forced = false;
+    ppu_output_whole = true;
+    ppu_change(PPU_CHANGE(PPU_CHANGE_FRAME, 0), state);
+    ppu_log_start();
+}
+
+static void ppu_end_frame() {
+    uint32_t n = ppu_change_count[ppu_changes_now];
+
+    ppu_frame_changed = ppu_changes_forced || !ppu_same || n != ppu_change_count[!ppu_changes_now] ||
+                        n > PPU_CHANGES_MAX;
+    ppu_output_valid = ppu_output && ppu_output_whole && !ppu_headless;
+    ppu_log_end();
+    ppu_start_frame();
+}
+
+static void ppu_content_changed() {
+    ppu_changes_forced = true;
+    ppu_same = false;
+}
+
+// nothing is the same as before, and the log starts over
+static void ppu_changes_reset() {
+    ppu_content_changed();
+    ppu_output_valid = false;
+    ppu_thread_wait();
+    ppu_log_start();
+}
+
+void ppu_chr_switched(int slot) {
+    ppu_change(PPU_CHANGE(PPU_CHANGE_CHR, slot), (uintptr_t)ppu_chr_map[slot]);
+    ppu_log(PPU_LOG_CHR_PAGE, slot, (uintptr_t)ppu_chr_rows[slot]);
+    // CHR RAM changes under the thread: it gets the page as it is now
+    for (int n = 0; ppu_logging && ppu_chr_writable && n < PPU_CHR_ROWS_PER_PAGE; n++) {
+        ppu_log(PPU_LOG_CHR_ROW, slot << 9 | n, ppu_chr_rows[slot][n]);
+    }
+}
+
+
+/************************** RENDER THREAD **************************/
+
+/*
+    A frame logged for the render thread: the state it started in, then, in the
+    order they happened, the pixels drawn and every change to what they are drawn
+    from. Replayed on a copy of that state, through the same line code, the pixels
+    come out as if drawn while the frame ran.
+*/
+typedef struct {
+    uint8_t kind;
+    uint8_t ctrl, mask, fine;     // PPU_LOG_DRAW: as the pixels are drawn
+    uint16_t bg_v;
+    uint16_t addr;                // line, VRAM offset, palette or OAM index, slot << 9 | row, slot
+    uint64_t value;               // from << 16 | to, byte, decoded row, CHR rows or VRAM page
+} PPULogEntry;
+
+typedef struct {
+    PPU ppu;
+    uint8_t vram[sizeof(ppu_vram)];
+    uint8_t pages[4];                                 // VRAM page of each nametable
+    uint64_t *chr_rows[8];
+    bool chr_writable;
+    uint64_t chr_ram[8][PPU_CHR_ROWS_PER_PAGE];       // the pages when they are CHR RAM
+    PPULogEntry *entries;
+    uint32_t count, size;
+    bool complete;                // nothing failed to be logged
+    // where it is drawn, when handed to the thread
+    void *output;
+    unsigned pitch;
+    PPUFormat format;
+    PPUCompose compose;
+    bool sprite_limit;
+} PPULog;
+
+static PPULog ppu_logs[2];
+static PPULog *ppu_log_now = &ppu_logs[0];    // the other one may be drawn meanwhile
+
+// the render thread's copy of the PPU, and what it is drawing
+static struct {
+    PPU ppu;
+    uint8_t vram[sizeof(ppu_vram)];
+    uint8_t *nametables[4];
+    uint64_t *chr_rows[8];
+    uint64_t chr_ram[8][PPU_CHR_ROWS_PER_PAGE];
+    uint32_t rgb[32];
+    uint16_t rgb565[32];
+    bool sprite_limit;
+    PPURaster raster;
+    PPULog *log;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    bool running, busy, quit;
+} render = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+bool ppu_frame_pending;
+
+// a copy of the state at the first dot of a frame, when it is logged
+static void ppu_log_start() {
+    PPULog *log = ppu_log_now;
+
+    ppu_logging = render.running && ppu_renderer == PPU_RENDERER_SCANLINE && !cdl_enabled &&
+                  ppu.clock % PPU_DOTS_PER_FRAME == 0;
+    if (!ppu_logging) {
+        return;
+    }
+    log->ppu = ppu;
+    memcpy(log->vram, ppu_vram, sizeof(ppu_vram));
+    for (int i = 0; i < 4; i++) {
+        log->pages[i] = (ppu_nametables[i] - ppu_vram) / 0x400;
+    }
+    log->chr_writable = ppu_chr_writable;
+    for (int i = 0; i < 8; i++) {
+        log->chr_rows[i] = ppu_chr_rows[i];
+        if (ppu_chr_writable) {
+            memcpy(log->chr_ram[i], ppu_chr_rows[i], sizeof(log->chr_ram[i]));
+        }
+    }
+    log->count = 0;
+    log->complete = true;
+}
+
+static void ppu_log(int kind, uint16_t addr, uint64_t value) {
+    PPULog *log = ppu_log_now;
+    PPULogEntry *e;
+
+    if (!ppu_logging || !log->complete) {
+        return;
+    }
+    if (log->count == log->size) {
+        uint32_t size = log->size ? log->size * 2 : 4096;
+        PPULogEntry *entries = realloc(log->entries, size * sizeof(*entries));
+        if (!entries) {
+            log->complete = false;
+            return;
+        }
+        log->entries = entries;
+        log->size = size;
+    }
+    e = &log->entries[log->count++];
+    *e = (PPULogEntry){ .kind = kind, .addr = addr, .value = value };
+    if (kind == PPU_LOG_DRAW) {
+        e->ctrl = ppu.ctrl;
+        e->mask = ppu.mask;
+        e->fine = ppu.fine;
+        e->bg_v = ppu_raster.bg_v;
+    }
+}
+
+// a CHR RAM row decoded again, in every slot its page is mapped to
+static void ppu_log_chr_row(const uint64_t *rows, int n) {
+    for (int slot = 0; ppu_logging && slot < 8; slot++) {
+        if (ppu_chr_rows[slot] == rows) {
+            ppu_log(PPU_LOG_CHR_ROW, slot << 9 | n, rows[n]);
+        }
+    }
+}
+
+// replay a frame on the thread's copy of the PPU
+static void ppu_replay(PPULog *log) {
+    PPURaster *r = &render.raster;
+
+    render.ppu = log->ppu;
+    memcpy(render.vram, log->vram, sizeof(render.vram));
+    for (int i = 0; i < 4; i++) {
+        render.nametables[i] = render.vram + log->pages[i] * 0x400;
+    }
+    for (int i = 0; i < 8; i++) {
+        render.chr_rows[i] = log->chr_writable ? render.chr_ram[i] : log->chr_rows[i];
+    }
+    if (log->chr_writable) {
+        memcpy(render.chr_ram, log->chr_ram, sizeof(render.chr_ram));
+    }
+    render.sprite_limit = log->sprite_limit;
+    *r = (PPURaster){
+        &render.ppu, render.nametables, render.chr_rows, render.rgb, render.rgb565, &render.sprite_limit,
+        .lists_dirty = true,
+    };
+    ppu_update_rgb(r);
+
+    for (uint32_t i = 0; i < log->count; i++) {
+        const PPULogEntry *e = &log->entries[i];
+        int from = e->value >> 16, to = e->value & 0xFFFF;
+        bool gray = (render.ppu.mask ^ e->mask) & PPU_MASK_GRAYSCALE;
+
+        switch (e->kind) {
+            case PPU_LOG_DRAW:
+                if ((render.ppu.ctrl ^ e->ctrl) & PPU_CTRL_SPRITE_16) {
+                    r->lists_dirty = true;
+                }
+                render.ppu.ctrl = e->ctrl;
+                render.ppu.mask = e->mask;
+                render.ppu.fine = e->fine;
+                r->bg_v = e->bg_v;
+                if (gray) {
+                    ppu_update_rgb(r);
+                }
+                if (from == 0 && (e->mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+                    ppu_eval_sprites(r, e->addr);
+                }
+                ppu_draw_pixels(r, ppu_pixel_at(log->output, e->addr * log->pitch, log->format), log->format,
+                                log->compose, from, to);
+                break;
+            case PPU_LOG_VRAM:
+                render.vram[e->addr] = e->value;
+                break;
+            case PPU_LOG_PALETTE:
+                render.ppu.palette[e->addr] = e->value;
+                ppu_update_rgb(r);
+                break;
+            case PPU_LOG_OAM:
+                render.ppu.oam[e->addr] = e->value;
+                r->lists_dirty |= (e->addr & 3) == 0;
+                break;
+            case PPU_LOG_CHR_ROW:
+                render.chr_ram[e->addr >> 9][e->addr & 0x1FF] = e->value;
+                break;
+            case PPU_LOG_CHR_PAGE:
+                if (!log->chr_writable) {
+                    render.chr_rows[e->addr] = (uint64_t *)(uintptr_t)e->value;
+                }
+                break;
+            case PPU_LOG_NAMETABLE:
+                render.nametables[e->addr] = render.vram + e->value * 0x400;
+                break;
+        }
+    }
+}
+
+static void *ppu_thread_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&render.lock);
+    for (;;) {
+        while (!render.busy && !render.quit) {
+            pthread_cond_wait(&render.wake, &render.lock);
+        }
+        if (render.quit) {
+            break;
+        }
+        pthread_mutex_unlock(&render.lock);
+        ppu_replay(render.log);
+        pthread_mutex_lock(&render.lock);
+        render.busy = false;
+        pthread_cond_signal(&render.idle);
+    }
+    pthread_mutex_unlock(&render.lock);
+    return NULL;
+}
+
+// at the end of a logged frame: it goes to the thread once the one before is drawn
+static void ppu_log_end() {
+    PPULog *log = ppu_log_now;
+
+    ppu_frame_pending = false;
+    if (!ppu_logging) {
+        return;
+    }
+    ppu_thread_wait();
+    if (!log->complete || !ppu_output || ppu_headless || cdl_enabled) {
+        return;
+    }
+    ppu_pick_simd();
+    log->output = ppu_output;
+    log->pitch = ppu_output_pitch;
+    log->format = ppu_output_format;
+    log->compose = ppu_compose;
+    log->sprite_limit = ppu_sprite_limit;
+
+    pthread_mutex_lock(&render.lock);
+    render.log = log;
+    render.busy = true;
+    pthread_cond_signal(&render.wake);
+    pthread_mutex_unlock(&render.lock);
+    ppu_log_now = log == &ppu_logs[0] ? &ppu_logs[1] : &ppu_logs[0];
+    ppu_frame_pending = true;
+}
+
+void ppu_thread_wait() {
+    if (!render.running) {
+        return;
+    }
+    pthread_mutex_lock(&render.lock);
+    while (render.busy) {
+        pthread_cond_wait(&render.idle, &render.lock);
+    }
+    pthread_mutex_unlock(&render.lock);
+}
+
+bool ppu_set_threaded(bool threaded) {
+    if (threaded && !render.running) {
+        render.quit = false;
+        if (pthread_create(&render.thread, NULL, ppu_thread_main, NULL)) {
+            return false;
+        }
+        render.running = true;
+        ppu_log_start();
+    } else if (!threaded && render.running) {
+        ppu_thread_wait();
+        pthread_mutex_lock(&render.lock);
+        render.quit = true;
+        pthread_cond_signal(&render.wake);
+        pthread_mutex_unlock(&render.lock);
+        pthread_join(render.thread, NULL);
+        render.running = false;
+        ppu_logging = false;
+        ppu_frame_pending = false;
+        for (int i = 0; i < 2; i++) {
+            free(ppu_logs[i].entries);
+            ppu_logs[i].entries = NULL;
+            ppu_logs[i].size = 0;
+        }
+    }
+    return true;
+}
+
+
+/***************************** CATCH-UP ****************************/
+
+uint64_t ppu_event_at = PPU_NEVER;
+
+// predict the next event the CPU has to see without touching a register
+static void ppu_schedule() {
+    uint64_t frame = ppu.clock - ppu.clock % PPU_DOTS_PER_FRAME;
+    uint64_t at = PPU_NEVER;
+
+    // vblank NMI, dot 1 of line 241
+    if (ppu.ctrl & PPU_CTRL_NMI) {
+        at = frame + (PPU_VISIBLE_LINES + 1) * PPU_DOTS_PER_LINE + 2;
+        if (at <= ppu.clock) {
+            at += PPU_DOTS_PER_FRAME;
+        }
+    }
+    // first dot sprite 0 may hit the background, next frame once hit
+    if ((ppu.mask & PPU_MASK_BG) && (ppu.mask & PPU_MASK_SPRITES) && ppu.oam[0] < PPU_VISIBLE_LINES - 1) {
+        uint64_t hit = frame + (ppu.oam[0] + 1) * PPU_DOTS_PER_LINE + ppu.oam[3] + 2;
+        if (hit <= ppu.clock || (ppu.status & PPU_STATUS_SPRITE_0)) {
+            hit += PPU_DOTS_PER_FRAME;
+        }
+        if (hit < at) {
+            at = hit;
+        }
+    }
+    ppu_event_at = at;
+}
+
+
+/*************************** SAVE STATES ***************************/
+
+#define PPU_STATE_VERSION 1
+
+// version, PPU registers and memories, the VRAM page of each nametable, VRAM
+typedef struct {
+    uint32_t version;
+    PPU ppu;
+    uint8_t nametables[4];
+    uint8_t vram[sizeof(ppu_vram)];
+} PPUState;
+
+size_t ppu_state_size() {
+    return sizeof(PPUState);
+}
+
+void ppu_save_state(void *data) {
+    PPUState *s = data;
+
+    memset(s, 0, sizeof(*s));
+    s->version = PPU_STATE_VERSION;
+    s->ppu = ppu;
+    for (int i = 0; i < 4; i++) {
+        s->nametables[i] = (ppu_nametables[i] - ppu_vram) / 0x400;
+    }
+    memcpy(s->vram, ppu_vram, sizeof(ppu_vram));
+}
+
+bool ppu_load_state(const void *data, size_t size) {
+    const PPUState *s = data;
+
+    if (size < sizeof(*s) || s->version != PPU_STATE_VERSION) {
+        return false;
+    }
+    ppu = s->ppu;
+    for (int i = 0; i < 4; i++) {
+        ppu_nametables[i] = ppu_vram + (s->nametables[i] & 3) * 0x400;
+    }
+    memcpy(ppu_vram, s->vram, sizeof(ppu_vram));
+    ppu_update_rgb(&ppu_raster);
+    ppu_dot_resync();
+    ppu_raster.lists_dirty = true;
+    ppu_changes_reset();
+    ppu_schedule();
+    return true;
+}
+
+
+/****************************** PPU A12 ****************************/
+
+// dot of the A12 rise on each rendered line, 0 if there is none
+static int ppu_a12_dot() {
+    if (!(ppu.mask & (PPU_MASK_BG | PPU_MASK_SPRITES))) {
+        return 0;
+    }
+    uint8_t tables = ppu.ctrl & (PPU_CTRL_BG_TABLE | PPU_CTRL_SPRITE_TABLE);
+
+    // 8x16 sprites take their table from bit 0 of the tile, and unused slots fetch
+    // tile $FF: the sprite fetches reach $1000 whatever PPUCTRL bit 3 says
+    if (ppu.ctrl & PPU_CTRL_SPRITE_16) {
+        tables = tables & PPU_CTRL_BG_TABLE ? PPU_CTRL_BG_TABLE : PPU_CTRL_SPRITE_TABLE;
+    }
+    switch (tables) {
+        case PPU_CTRL_SPRITE_TABLE: return 260;
+        case PPU_CTRL_BG_TABLE:     return 324;
+        default:                    return 0;
+    }
+}
+
+// number of rises at or before `time` since power on
+static uint64_t ppu_a12_rises_until(uint64_t time, int dot) {
+    uint64_t frames = time / PPU_DOTS_PER_FRAME;
+    uint32_t pos = time % PPU_DOTS_PER_FRAME;
+    uint32_t line = pos / PPU_DOTS_PER_LINE;
+    uint32_t n = line < PPU_VISIBLE_LINES ? line : PPU_VISIBLE_LINES;
+
+    if ((line < PPU_VISIBLE_LINES || line == PPU_PRERENDER_LINE) && pos % PPU_DOTS_PER_LINE >= (uint32_t)dot) {
+        n++;
+    }
+    return frames * PPU_A12_RISES_PER_FRAME + n;
+}
+
+uint64_t ppu_a12_rises(uint64_t from, uint64_t to) {
+    int dot = ppu_a12_dot();
+    if (!dot || to <= from) {
+        return 0;
+    }
+    return ppu_a12_rises_until(to, dot) - ppu_a12_rises_until(from, dot);
+}
+
+uint64_t ppu_a12_rise_after(uint64_t time, uint64_t n) {
+    int dot = ppu_a12_dot();
+    if (!dot) {
+        return PPU_NEVER;
+    }
+
+    // rises are numbered from power on, 241 per frame
+    uint64_t index = ppu_a12_rises_until(time, dot) + n - 1;
+    uint32_t i = index % PPU_A12_RISES_PER_FRAME;
+    uint32_t line = i < PPU_VISIBLE_LINES ? i : PPU_PRERENDER_LINE;
+    return index / PPU_A12_RISES_PER_FRAME * PPU_DOTS_PER_FRAME + line * PPU_DOTS_PER_LINE + dot;
+}
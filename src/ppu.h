@@ -0,0 +1,310 @@
+#ifndef PPU_H
+#define PPU_H
+
+/*
+    This file implements the Ricoh 2C02 (PPU) timing and registers.
+
+    Address       Register     Access  Purpose
+    -----------------------------------------------------------------
+    $2000         PPUCTRL      write   NMI enable, sprite size, pattern tables, nametable
+    $2001         PPUMASK      write   rendering enable, color effects
+    $2002         PPUSTATUS    read    vblank, sprite 0 hit, sprite overflow
+    $2003         OAMADDR      write   OAM address
+    $2004         OAMDATA      r/w     OAM data
+    $2005         PPUSCROLL    write x2
+    $2006         PPUADDR      write x2
+    $2007         PPUDATA      r/w     VRAM data
+
+    A frame is 262 scanlines of 341 dots (NTSC): 240 visible lines, the post-render
+    line 240, vblank on lines 241-260 and the pre-render line 261. Time is counted
+    in dots since power on (`ppu.clock`), three dots per CPU cycle. The PPU runs
+    lazily behind the CPU (see PPU CATCH-UP below); retro_run() runs the CPU to
+    the end of the frame, then ppu_run_frame() ends it.
+
+    Rendering is done by scanline (see PPU RENDERER below), into the pixels set by
+    ppu_set_output(), or a frame later on a thread of its own (see PPU THREAD).
+
+    Pattern tables are read through eight 1 KB CHR pages in `ppu_chr_map`, set by the
+    mapper. Each page also has a pre-decoded copy in `ppu_chr_rows`, which is what
+    the renderer fetches (see PPU CHR below).
+
+    The four nametables at $2000, $2400, $2800 and $2C00 are read through
+    `ppu_nametables`, four pointers to 1 KB of VRAM: the console has 2 KB, which the
+    cartridge wires to the four slots (mirroring), or the cartridge adds 2 KB so all
+    four are distinct (four-screen). Fetches never test the mirroring mode, and a
+    mapper switching it at runtime only rewrites the four pointers.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PPU_DOTS_PER_LINE     341
+#define PPU_LINES_PER_FRAME   262
+#define PPU_DOTS_PER_FRAME    (PPU_DOTS_PER_LINE * PPU_LINES_PER_FRAME)
+#define PPU_VISIBLE_LINES     240
+#define PPU_PRERENDER_LINE    261
+#define PPU_NEVER             UINT64_MAX
+
+typedef enum PPUCtrl {
+    PPU_CTRL_NAMETABLE    = 0b00000011, // base nametable address
+    PPU_CTRL_INCREMENT    = 0b00000100, // VRAM increment per $2007 access: 0 for 1, 1 for 32
+    PPU_CTRL_SPRITE_TABLE = 0b00001000, // 8x8 sprite pattern table: 0 for $0000, 1 for $1000
+    PPU_CTRL_BG_TABLE     = 0b00010000, // background pattern table: 0 for $0000, 1 for $1000
+    PPU_CTRL_SPRITE_16    = 0b00100000, // sprite size: 0 for 8x8, 1 for 8x16
+    PPU_CTRL_NMI          = 0b10000000, // NMI at the start of vblank
+} PPUCtrl;
+
+typedef enum PPUMask {
+    PPU_MASK_GRAYSCALE    = 0b00000001,
+    PPU_MASK_BG_LEFT      = 0b00000010, // show background in the leftmost 8 pixels
+    PPU_MASK_SPRITE_LEFT  = 0b00000100, // show sprites in the leftmost 8 pixels
+    PPU_MASK_BG           = 0b00001000, // show background
+    PPU_MASK_SPRITES      = 0b00010000, // show sprites
+    PPU_MASK_EMPHASIS     = 0b11100000,
+} PPUMask;
+
+// arrangement of the nametables, the first two values match the header bit
+typedef enum PPUMirroring {
+    PPU_MIRROR_HORIZONTAL = 0,  // $2000 = $2400, $2800 = $2C00
+    PPU_MIRROR_VERTICAL,        // $2000 = $2800, $2400 = $2C00
+    PPU_MIRROR_SINGLE_LOW,      // all four on the first 1 KB
+    PPU_MIRROR_SINGLE_HIGH,     // all four on the second 1 KB
+    PPU_MIRROR_FOUR_SCREEN,     // 4 KB, half of it on the cartridge
+} PPUMirroring;
+
+typedef enum PPUStatus {
+    PPU_STATUS_OVERFLOW   = 0b00100000,
+    PPU_STATUS_SPRITE_0   = 0b01000000,
+    PPU_STATUS_VBLANK     = 0b10000000,
+} PPUStatus;
+
+
+/**************************** PPU STATE ****************************/
+
+typedef struct {
+    uint64_t clock;       // dots since power on
+    uint8_t ctrl;         // $2000
+    uint8_t mask;         // $2001
+    uint8_t status;       // $2002
+    uint8_t oam_addr;     // $2003
+    uint16_t v;           // current VRAM address (15 bits)
+    uint16_t t;           // temporary VRAM address, top left of the screen
+    uint8_t x;            // fine X scroll (3 bits)
+    bool w;               // $2005/$2006 write toggle, 0 for the first write
+    uint8_t read_buffer;  // $2007 reads are delayed by one
+    uint8_t oam[256];     // 64 sprites: Y, tile, attributes, X
+    uint8_t palette[32];  // background then sprite palettes, $3F10/$3F14/$3F18/$3F1C
+                          // are stored at $3F00/$3F04/$3F08/$3F0C
+    uint16_t drawn;       // pixels of the current line already drawn
+    uint8_t fine;         // position of the next pixel in its background tile
+} PPU;
+
+extern PPU ppu;
+extern uint8_t *ppu_chr_map[8];        // CHR pages mapped at $0000, $0400, ..., $1C00
+extern uint64_t *ppu_chr_rows[8];      // the same pages, pre-decoded
+extern bool ppu_chr_writable;          // the pages are CHR RAM
+extern uint8_t *ppu_nametables[4];     // nametables mapped at $2000, $2400, $2800 and $2C00
+
+// a page of ppu_chr_map was switched during a frame (after ppu_sync())
+void ppu_chr_switched(int slot);
+
+void ppu_reset();
+void ppu_set_mirroring(PPUMirroring mode);
+uint8_t ppu_read_register(uint16_t addr);
+void ppu_write_register(uint16_t addr, uint8_t value);
+// $4014: copy the CPU page `page` to OAM
+void ppu_oam_dma(uint8_t page);
+
+// advance the PPU to `until` (in dots), or to the end of the current frame: the
+// CPU ran up to it, or a few dots past it, or it is idle until then
+void ppu_run(uint64_t until);
+void ppu_run_frame();
+
+
+/**************************** PPU CATCH-UP **************************
+    The PPU does not run in step with the CPU. `ppu.clock` is how far it has run,
+    `cpu_clock` is now, and ppu_sync() runs it from one to the other (drawing the
+    current line up to now, never past the end of the frame being run) only when
+    something could tell the difference:
+      - the CPU accesses $2000-$3FFF or $4014 (cpu_read()/cpu_write())
+      - a mapper switches a CHR page or the mirroring (only if it changes)
+      - an event the CPU sees without asking is due: the CPU loop calls
+        ppu_sync() once cpu_clock reaches `ppu_event_at`
+      - the end of the frame (ppu_run_frame())
+    `ppu_event_at` is predicted after every sync and every write it depends on
+    ($2000, $2001, OAM): the vblank NMI when enabled, and the first dot sprite 0
+    can hit the background while both layers are shown. Between these points the
+    CPU runs without calling into the PPU.
+*/
+extern uint64_t ppu_event_at;          // PPU clock the CPU must sync at, PPU_NEVER if none
+
+// run the PPU up to cpu_clock
+void ppu_sync();
+
+
+/*************************** PPU RENDERER **************************
+    There are two renderers, chosen per game (ppu_set_renderer()).
+
+    The scanline renderer draws a whole scanline at once, when the line reaches dot
+    256, with the registers and VRAM as they are at that time. A game changing them
+    during dots 1-256 of a visible line (a mid-line $2005/$2006 split, a palette or
+    PPUMASK change) first has the pixels before the current dot drawn with the old
+    values, so the split lands where it would on hardware, to the nearest tile for
+    scrolling. Reading $2002 on a visible line draws up to the current dot as well,
+    so a game polling for sprite 0 hit sees it at the dot it happens.
+
+    The dot renderer steps every dot: background fetches every 8 dots into a 16
+    pixel pipeline, a pixel out per dot, sprites evaluated for the next line at dot
+    257. It is several times slower, for the few games whose effects depend on the
+    exact dot of a fetch (the game database hint GAMEDB_HINT_ACCURATE_PPU).
+
+    Both share the registers, VRAM, sprite fetches and flags, and keep `v` as the
+    hardware does at line boundaries (including the two tiles prefetched at dots
+    321-336), so a state saved between frames by one loads into the other. The dot
+    pipeline is not saved: it is fetched again from `v` when a state is loaded or
+    the dot renderer is selected, which is exact at the start of a line.
+
+    Lines are drawn as palette indexes, translated to the output format (XRGB8888
+    or RGB565) through the 32 colors of palette RAM, which are kept translated to
+    both. Color emphasis is not emulated.
+
+    Sprites are fetched from per-line lists of OAM indices, built again only after
+    a sprite's Y or the sprite height changes. Both renderers show at most 8 sprites
+    per line like the hardware, or all of them when `ppu_sprite_limit` is off (less
+    flicker); the overflow flag is set past 8 either way.
+
+    With `ppu_headless` set, nothing is drawn, for runs where nobody looks at the
+    pixels: the scanline renderer only passes the tiles (for `v`), builds the
+    sprite line (for the overflow flag), and fetches the background on lines where
+    sprite 0 is, until it hits. $2002, $2007 increments and A12 (predicted anyway)
+    are the same as when drawing. It can be switched at any time, frame to frame.
+
+    A frame that starts in the same state as the last one and goes through the
+    same register accesses, CHR and mirroring switches at the same dots, without
+    changing a byte of VRAM, palette or OAM in either, looks the same: it leaves
+    `ppu_frame_changed` false, for the frontend to show the last frame again. While
+    a frame is the same so far, and the output still holds the last one, its lines
+    are not composed: they are passed like headless ones.
+
+    Background rows are fetched pre-decoded (see PPU CHR) and get their attribute
+    palette 8 pixels at a time in a 64-bit word. The scanline renderer then composes
+    each line with vector code: the sprite/background priority and sprite 0 hit as
+    byte masks, 16 (SSE2) or 32 (AVX2) pixels per step, and the palette lookup as
+    8-wide gathers (AVX2), or byte shuffles of the 32 colors in RGB565. The variant
+    is chosen at runtime from what the CPU supports, with a scalar fallback
+    elsewhere; each is compiled once per output format.
+*/
+#define PPU_WIDTH  256
+#define PPU_HEIGHT 240
+
+typedef enum PPUFormat {
+    PPU_FORMAT_XRGB8888 = 0,
+    PPU_FORMAT_RGB565,
+    PPU_FORMAT_COUNT,
+} PPUFormat;
+
+typedef enum PPURenderer {
+    PPU_RENDERER_SCANLINE = 0,
+    PPU_RENDERER_DOT,
+} PPURenderer;
+
+extern PPURenderer ppu_renderer;
+extern bool ppu_sprite_limit;          // 8 sprites per line, true by default
+extern bool ppu_headless;              // compute what the CPU sees without drawing
+extern bool ppu_frame_changed;         // the last frame run is drawn unlike the one before
+
+// render the frame into `pixels` of `format`, `pitch` pixels apart from line to line;
+// may be changed between frames, every pixel of a visible line is written each frame
+void ppu_set_output(void *pixels, unsigned pitch, PPUFormat format);
+// switch renderer, between frames
+void ppu_set_renderer(PPURenderer renderer);
+
+typedef enum PPUSimd {
+    PPU_SIMD_SCALAR = 0,
+    PPU_SIMD_SSE2,
+    PPU_SIMD_AVX2,
+    PPU_SIMD_COUNT,
+} PPUSimd;
+
+extern const char *const ppu_simd_names[PPU_SIMD_COUNT];
+
+// compose lines with `simd`, false if the CPU lacks it (the best one is the default)
+bool ppu_set_simd(PPUSimd simd);
+
+
+/**************************** PPU THREAD ***************************
+    With the render thread started (ppu_set_threaded()), the scanline renderer
+    draws each frame on it while the next frame runs. The frame itself runs as
+    headless, so $2002, `v` and A12 come out exactly as when drawing, and logs in
+    order what its pixels depend on: each part of a line it would have drawn, with
+    PPUCTRL, PPUMASK and the scroll it is drawn with, and each byte of VRAM,
+    palette, OAM or CHR RAM changed, CHR page or mirroring switched. At the end of
+    the frame, the log and a copy of the state the frame started in go to the
+    thread, which replays them through the same line code on its own copy, into
+    the output the frame ran with.
+
+    The frame is complete when the next one has run: `ppu_frame_pending` tells to
+    show it then, and to give the next frame another output meanwhile. Headless
+    frames are not drawn, and frames on the dot renderer or with the code/data
+    logger on are drawn as they run, as without the thread.
+*/
+extern bool ppu_frame_pending;         // the last frame run is being drawn on the render thread
+
+// start or stop the render thread, between frames; false if it could not start
+bool ppu_set_threaded(bool threaded);
+// until the render thread has drawn the frame it was given (before its output or
+// the cartridge's CHR ROM go away)
+void ppu_thread_wait();
+
+// save states of the PPU: registers, OAM, palette, VRAM and mirroring
+size_t ppu_state_size();
+void ppu_save_state(void *data);
+// false if `data` is not a state of this version
+bool ppu_load_state(const void *data, size_t size);
+
+
+/***************************** PPU CHR *****************************
+    A tile is 16 bytes: 8 rows of low bitplane, then 8 rows of high bitplane. The
+    renderer does not shuffle bits: every row is pre-decoded into a uint64_t holding
+    its 8 pixels, one 2-bit color index per byte, leftmost pixel in the lowest byte.
+    A horizontally flipped row is the same value byte-swapped (ppu_chr_flip(), one
+    instruction), so only one orientation is stored. The row `y` of tile `n` of a
+    page is ppu_chr_rows[page][n * 8 + y].
+
+    CHR ROM is decoded once at load (ppu_decode_chr()). With CHR RAM, every $2007
+    write to the pattern tables decodes again the single row it touched.
+*/
+#define PPU_CHR_ROWS_PER_PAGE (0x400 / 16 * 8)
+
+// decode `size` bytes of CHR data (whole tiles) into size / 2 rows
+void ppu_decode_chr(const uint8_t *chr, uint64_t *rows, uint32_t size);
+
+static inline uint64_t ppu_chr_flip(uint64_t row) {
+    return __builtin_bswap64(row);
+}
+
+
+/***************************** PPU A12 *****************************
+    Mappers like MMC3 count the rising edges of the PPU address line A12, which
+    selects the $1000 pattern table. When background and sprites use different
+    pattern tables, A12 rises once per rendered scanline (0-239 and 261), at a dot
+    fixed by PPUCTRL:
+      - background at $0000, sprites at $1000: dot 260, first sprite fetch
+      - background at $1000, sprites at $0000: dot 324, first background fetch
+        for the next line
+    8x16 sprites are fetched from the table of bit 0 of each tile, and the unused
+    slots of a line from $1000 (tile $FF): with the background at $0000 they rise
+    at dot 260 too, with it at $1000 they are taken as the dot 324 case. With
+    rendering disabled, or both on the same table, there is no edge the mapper
+    filter would count.
+
+    These rises are computed rather than observed: ppu_a12_rises() counts the rises
+    in a time interval and ppu_a12_rise_after() predicts the n-th next one, both in
+    constant time, assuming PPUCTRL and PPUMASK keep their current values. Mappers
+    catch up before these registers change (see mapper_sync()).
+*/
+uint64_t ppu_a12_rises(uint64_t from, uint64_t to);       // rises in (from, to]
+uint64_t ppu_a12_rise_after(uint64_t time, uint64_t n);   // n-th rise after time, n >= 1
+
+#endif /* PPU_H */
@@ -1,42 +1,1029 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "disassembler.h"
 #include "../libretro/libretro.h"
+#include "../cartridge.h"
+#include "../cdl.h"
 #include "../cpu.h"
+#include "../hash.h"
 
 extern retro_log_printf_t log_cb;
 
-void disassemble() {
-    log_cb(RETRO_LOG_INFO, "DISASSEMBLING PRG ROM:\n");
-    uint16_t base_addr = CPU_CARTRIDGE_ADDR_START + 16;
-    uint8_t *prg_rom = &mem[base_addr];
-    for(int i=0; i < pgr_rom_size; i++) {
-        uint8_t opcode = prg_rom[i];
-        CPUInstruction inst = cpu_instruction_table[opcode];
-        char buf[128] = {" "};
-
-        if (inst.numBytes == 0) {
-            log_cb(RETRO_LOG_INFO, "[$%04X]: WRONG INSTRUCTION IN THIS MEMORY ADDRESS\n", base_addr+i);
+int disasm_threads;
+
+#define PENDING_CROSSING 0x80 // instruction running into the next bank
+
+// an offset to trace, with the DisasmByte flags to give it
+typedef struct {
+    uint32_t offset;
+    uint8_t flags;
+} Pending;
+
+typedef struct {
+    Pending *items;
+    uint32_t num, cap;
+} PendingList;
+
+struct Analysis;
+
+// a worker only writes the flags of the bank it traces, anything leading out of
+// the bank is queued in `out` and handed over between rounds
+typedef struct {
+    struct Analysis *a;
+    uint32_t lo, hi;          // PRG ROM offsets of the bank
+    PendingList work;         // offsets in the bank left to trace
+    PendingList out;          // offsets in other banks, and crossing instructions
+    bool ok;                  // false if out of memory
+} Bank;
+
+typedef struct Analysis {
+    DisasmCFG *cfg;
+    const uint8_t *prg;
+    const uint32_t *map;
+    Bank *banks;
+    uint32_t num_banks;
+    uint32_t next_bank;       // next bank to claim in this round
+    // the workers wait for the next round, the caller for the workers to be idle
+    pthread_mutex_t lock;
+    pthread_cond_t wake, idle;
+    uint32_t round, busy;
+    bool finished;
+} Analysis;
+
+
+/***************************** DECODER *****************************/
+
+static uint8_t flow_of(uint8_t opcode) {
+    switch (opcode) {
+        case 0x10: case 0x30: case 0x50: case 0x70:
+        case 0x90: case 0xB0: case 0xD0: case 0xF0: return DISASM_FLOW_BRANCH;
+        case 0x4C: return DISASM_FLOW_JUMP;
+        case 0x20: return DISASM_FLOW_CALL;
+        case 0x40: case 0x60: return DISASM_FLOW_RETURN;
+        case 0x00: case 0x6C: return DISASM_FLOW_INDIRECT;
+        default: return DISASM_FLOW_NEXT;
+    }
+}
+
+bool disasm_decode(DisasmInstruction *inst, const uint8_t *code, size_t avail, uint16_t addr) {
+    const CPUInstruction *c = &cpu_instruction_table[code[0]];
+
+    inst->addr = addr;
+    inst->opcode = code[0];
+    inst->length = c->numBytes;
+    inst->cycles = c->numCycles;
+    inst->mode = c->addr_mode;
+    inst->flow = flow_of(code[0]);
+    inst->operand = inst->target = 0;
+    if (!inst->length || inst->length > avail) {
+        return false;
+    }
+
+    if (inst->length == 2) {
+        inst->operand = code[1];
+    } else if (inst->length == 3) {
+        inst->operand = code[1] | code[2] << 8;
+    }
+    if (inst->flow == DISASM_FLOW_BRANCH) {
+        inst->target = addr + 2 + (int8_t)code[1];
+    } else if (inst->flow == DISASM_FLOW_JUMP || inst->flow == DISASM_FLOW_CALL) {
+        inst->target = inst->operand;
+    }
+    return true;
+}
+
+bool disasm_decode_at(DisasmInstruction *inst, uint16_t addr) {
+    uint8_t code[3];
+
+    if (addr < CPU_PRG_ROM_ADDR_START) {
+        return false;
+    }
+    // an instruction may straddle two windows
+    for (int i = 0; i < 3; i++) {
+        uint16_t a = addr + i;
+        code[i] = a >= CPU_PRG_ROM_ADDR_START ? cpu_prg_map[(a >> 13) & 3][a & 0x1FFF] : 0;
+    }
+    return disasm_decode(inst, code, 0x10000 - addr, addr);
+}
+
+void disasm_iter_init(DisasmIter *it, const uint8_t *bank, uint32_t size, uint16_t base) {
+    it->bank = bank;
+    it->size = size;
+    it->offset = 0;
+    it->base = base;
+}
+
+bool disasm_iter_next(DisasmIter *it, DisasmInstruction *inst) {
+    if (it->offset >= it->size) {
+        return false;
+    }
+    if (!disasm_decode(inst, it->bank + it->offset, it->size - it->offset, it->base + it->offset)) {
+        // undefined or truncated: a single byte of data
+        inst->length = 0;
+        inst->operand = it->bank[it->offset];
+        it->offset++;
+        return true;
+    }
+    it->offset += inst->length;
+    return true;
+}
+
+
+/**************************** ADDRESSES ****************************/
+
+// PRG ROM offset of a jump target, DISASM_NONE outside of PRG ROM
+static uint32_t resolve(const DisasmCFG *cfg, const uint32_t map[4], uint32_t from, uint16_t target,
+                        bool *far) {
+    uint32_t offset;
+
+    *far = false;
+    if (target < CPU_PRG_ROM_ADDR_START) {
+        return DISASM_NONE;
+    }
+    if ((target & 0xE000) == cfg->home[from >> 13]) {
+        offset = (from & ~0x1FFF) | (target & 0x1FFF);
+    } else if (map[(target >> 13) & 3] != DISASM_NONE) {
+        offset = map[(target >> 13) & 3] + (target & 0x1FFF);
+        *far = true;
+    } else {
+        return DISASM_NONE;
+    }
+    return offset < cfg->size ? offset : DISASM_NONE;
+}
+
+// decode the instruction at PRG ROM offset `o`, in its bank's home window
+static inline bool decode(const DisasmCFG *cfg, const uint8_t *prg, uint32_t o, DisasmInstruction *inst) {
+    return disasm_decode(inst, prg + o, cfg->size - o, disasm_addr(cfg, o));
+}
+
+
+/***************************** TRACING *****************************/
+
+static bool pend(PendingList *l, uint32_t offset, uint8_t flags) {
+    if (l->num == l->cap) {
+        Pending *p = realloc(l->items, (l->cap = l->cap ? l->cap * 2 : 256) * sizeof(Pending));
+        if (!p) {
+            return false;
+        }
+        l->items = p;
+    }
+    l->items[l->num++] = (Pending){ offset, flags };
+    return true;
+}
+
+static bool enqueue(Bank *b, uint32_t offset, uint8_t flags) {
+    if (offset == DISASM_NONE) {
+        return true;
+    }
+    if (offset < b->lo || offset >= b->hi) {
+        return pend(&b->out, offset, flags);
+    }
+    b->a->cfg->bytes[offset] |= flags;
+    return pend(&b->work, offset, flags);
+}
+
+// follow one path inside the bank, until it ends, joins code already traced or
+// leaves the bank
+static bool trace(Bank *b, uint32_t o) {
+    DisasmCFG *cfg = b->a->cfg;
+    uint8_t *bytes = cfg->bytes;
+    DisasmInstruction inst;
+    uint8_t lead = 0;
+    bool far;
+
+    for (;;) {
+        if (o >= cfg->size) {
+            return true;
+        }
+        if (o < b->lo || o >= b->hi) {
+            return pend(&b->out, o, lead);
+        }
+        bytes[o] |= lead;
+        if ((bytes[o] & (DISASM_OPCODE | DISASM_OPERAND)) || !decode(cfg, b->a->prg, o, &inst)) {
+            return true;
+        }
+        if (o + inst.length > b->hi) {
+            return pend(&b->out, o, PENDING_CROSSING);
+        }
+        for (int i = 1; i < inst.length; i++) {
+            if (bytes[o + i] & (DISASM_OPCODE | DISASM_OPERAND)) {
+                return true; // overlaps another instruction
+            }
+        }
+        bytes[o] |= DISASM_OPCODE;
+        for (int i = 1; i < inst.length; i++) {
+            bytes[o + i] |= DISASM_OPERAND;
+        }
+
+        switch (inst.flow) {
+            case DISASM_FLOW_BRANCH:
+            case DISASM_FLOW_CALL:
+                if (!enqueue(b, resolve(cfg, b->a->map, o, inst.target, &far),
+                             DISASM_LEADER | (inst.flow == DISASM_FLOW_CALL ? DISASM_CALLED : 0))) {
+                    return false;
+                }
+                // the next instruction starts a new block
+                o += inst.length;
+                lead = DISASM_LEADER;
+                break;
+            case DISASM_FLOW_JUMP:
+                return enqueue(b, resolve(cfg, b->a->map, o, inst.target, &far), DISASM_LEADER);
+            case DISASM_FLOW_RETURN:
+            case DISASM_FLOW_INDIRECT:
+                return true;
+            default:
+                o += inst.length;
+                break;
+        }
+    }
+}
+
+static void trace_banks(Analysis *a) {
+    for (;;) {
+        uint32_t i = __atomic_fetch_add(&a->next_bank, 1, __ATOMIC_RELAXED);
+        if (i >= a->num_banks) {
+            break;
+        }
+        Bank *b = &a->banks[i];
+        while (b->ok && b->work.num) {
+            b->ok = trace(b, b->work.items[--b->work.num].offset);
+        }
+    }
+}
+
+static void *bank_worker(void *arg) {
+    Analysis *a = arg;
+    uint32_t seen = 0;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        while (a->round == seen && !a->finished) {
+            pthread_cond_wait(&a->wake, &a->lock);
+        }
+        if (a->finished) {
             break;
         }
+        seen = a->round;
+        pthread_mutex_unlock(&a->lock);
+        trace_banks(a);
+        pthread_mutex_lock(&a->lock);
+        if (--a->busy == 0) {
+            pthread_cond_signal(&a->idle);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+// hand an offset over to the bank it belongs to, between rounds
+static bool route(Analysis *a, Pending p) {
+    Bank *owner = &a->banks[p.offset >> 13];
+
+    if (p.flags & PENDING_CROSSING) {
+        // trace the one instruction here, where all the banks can be written
+        Bank one = { a, p.offset, p.offset + cpu_instruction_table[a->prg[p.offset]].numBytes,
+                     { NULL, 0, 0 }, { NULL, 0, 0 }, true };
+        bool ok = trace(&one, p.offset);
+        for (uint32_t i = 0; ok && i < one.work.num; i++) {
+            ok = route(a, one.work.items[i]);
+        }
+        for (uint32_t i = 0; ok && i < one.out.num; i++) {
+            ok = route(a, one.out.items[i]);
+        }
+        free(one.work.items);
+        free(one.out.items);
+        return ok;
+    }
+    a->cfg->bytes[p.offset] |= p.flags;
+    return pend(&owner->work, p.offset, p.flags);
+}
+
+// collect what the banks queued for each other, false when there is nothing left
+// to trace or out of memory
+static bool merge(Analysis *a, bool *ok) {
+    bool more = false;
+
+    for (uint32_t i = 0; i < a->num_banks && *ok; i++) {
+        Bank *b = &a->banks[i];
+        *ok = b->ok;
+        for (uint32_t j = 0; *ok && j < b->out.num; j++) {
+            *ok = route(a, b->out.items[j]);
+        }
+        b->out.num = 0;
+    }
+    for (uint32_t i = 0; i < a->num_banks && *ok; i++) {
+        more = more || a->banks[i].work.num;
+    }
+    return *ok && more;
+}
+
+// trace every bank in rounds, on up to `threads` threads
+static bool trace_all(Analysis *a, int threads) {
+    pthread_t *pool = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    bool ok = true;
+    int started = 0;
+
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->wake, NULL);
+    pthread_cond_init(&a->idle, NULL);
+    while (pool && started < threads - 1 && pthread_create(&pool[started], NULL, bank_worker, a) == 0) {
+        started++;
+    }
+
+    while (merge(a, &ok)) {
+        a->next_bank = 0;
+        pthread_mutex_lock(&a->lock);
+        a->busy = started;
+        a->round++;
+        pthread_cond_broadcast(&a->wake);
+        pthread_mutex_unlock(&a->lock);
+
+        trace_banks(a);
+
+        pthread_mutex_lock(&a->lock);
+        while (a->busy) {
+            pthread_cond_wait(&a->idle, &a->lock);
+        }
+        pthread_mutex_unlock(&a->lock);
+    }
+
+    pthread_mutex_lock(&a->lock);
+    a->finished = true;
+    pthread_cond_broadcast(&a->wake);
+    pthread_mutex_unlock(&a->lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->wake);
+    pthread_cond_destroy(&a->idle);
+    free(pool);
+    return ok;
+}
+
+
+/****************************** BLOCKS *****************************/
+
+static bool add_edge(DisasmCFG *cfg, uint32_t *cap, uint32_t from, uint32_t to, uint8_t kind, bool far) {
+    if (to == DISASM_NONE) {
+        return true;
+    }
+    if (cfg->num_edges == *cap) {
+        DisasmEdge *e = realloc(cfg->edges, (*cap = *cap ? *cap * 2 : 1024) * sizeof(DisasmEdge));
+        if (!e) {
+            return false;
+        }
+        cfg->edges = e;
+    }
+    // cleared padding keeps cache files reproducible
+    DisasmEdge *e = &cfg->edges[cfg->num_edges++];
+    memset(e, 0, sizeof(*e));
+    e->from = from;
+    e->to = to;
+    e->kind = kind;
+    e->far = far;
+    return true;
+}
+
+// cut the traced code into basic blocks, in offset order
+static bool split_blocks(DisasmCFG *cfg, const uint8_t *prg) {
+    uint8_t *bytes = cfg->bytes;
+    uint32_t cap = 0;
+
+    for (uint32_t o = 0; o < cfg->size;) {
+        if (!(bytes[o] & DISASM_OPCODE)) {
+            o++;
+            continue;
+        }
+        if (cfg->num_blocks == cap) {
+            DisasmBlock *b = realloc(cfg->blocks, (cap = cap ? cap * 2 : 1024) * sizeof(DisasmBlock));
+            if (!b) {
+                return false;
+            }
+            cfg->blocks = b;
+        }
+
+        DisasmBlock *b = &cfg->blocks[cfg->num_blocks++];
+        memset(b, 0, sizeof(*b));
+        b->start = o;
+        b->addr = disasm_addr(cfg, o);
+        b->succ[0] = b->succ[1] = DISASM_NONE;
+
+        for (;;) {
+            uint32_t last = o;
+            uint8_t flow = flow_of(prg[o]);
+            o += cpu_instruction_table[prg[o]].numBytes;
+            b->count++;
+
+            if (flow == DISASM_FLOW_NEXT) {
+                if (o < cfg->size && (bytes[o] & DISASM_OPCODE)) {
+                    // a bank boundary ends a block too, so that a block stays within
+                    // one bank and its home window
+                    if (o >> 13 != b->start >> 13) {
+                        bytes[o] |= DISASM_LEADER;
+                    }
+                    if (!(bytes[o] & DISASM_LEADER)) {
+                        continue;
+                    }
+                    b->exit = DISASM_EXIT_FALLTHROUGH;
+                    b->succ[0] = o; // offsets for now, indices after all blocks exist
+                } else {
+                    b->exit = DISASM_EXIT_INVALID;
+                }
+            } else if (flow == DISASM_FLOW_RETURN) {
+                b->exit = DISASM_EXIT_RETURN;
+            } else if (flow == DISASM_FLOW_INDIRECT) {
+                b->exit = DISASM_EXIT_INDIRECT;
+            } else {
+                b->exit = flow == DISASM_FLOW_BRANCH ? DISASM_EXIT_BRANCH :
+                          flow == DISASM_FLOW_JUMP ? DISASM_EXIT_JUMP : DISASM_EXIT_CALL;
+                b->succ[0] = last; // the instruction, its target is resolved below
+                if (flow != DISASM_FLOW_JUMP && o < cfg->size && (bytes[o] & DISASM_OPCODE)) {
+                    b->succ[1] = o;
+                }
+            }
+            break;
+        }
+        b->size = o - b->start;
+    }
+    return true;
+}
+
+static bool link_blocks(DisasmCFG *cfg, const uint8_t *prg, const uint32_t map[4]) {
+    DisasmInstruction inst;
+    uint32_t cap = 0;
+    bool far = false;
+
+    for (uint32_t i = 0; i < cfg->num_blocks; i++) {
+        DisasmBlock *b = &cfg->blocks[i];
+        uint32_t next = b->succ[1] == DISASM_NONE ? DISASM_NONE : disasm_find_block(cfg, b->succ[1]);
+        bool ok = true;
+
+        switch (b->exit) {
+            case DISASM_EXIT_FALLTHROUGH:
+                b->succ[0] = disasm_find_block(cfg, b->succ[0]);
+                ok = add_edge(cfg, &cap, i, b->succ[0], DISASM_EDGE_FALLTHROUGH, false);
+                break;
+            case DISASM_EXIT_BRANCH:
+            case DISASM_EXIT_JUMP:
+            case DISASM_EXIT_CALL: {
+                uint32_t last = b->succ[0];
+                decode(cfg, prg, last, &inst);
+                uint32_t target = resolve(cfg, map, last, inst.target, &far);
+                b->succ[0] = target == DISASM_NONE ? DISASM_NONE : disasm_find_block(cfg, target);
+                b->succ[1] = next;
+                ok = add_edge(cfg, &cap, i, b->succ[0],
+                              b->exit == DISASM_EXIT_BRANCH ? DISASM_EDGE_TAKEN :
+                              b->exit == DISASM_EXIT_JUMP ? DISASM_EDGE_JUMP : DISASM_EDGE_CALL, far) &&
+                     add_edge(cfg, &cap, i, next,
+                              b->exit == DISASM_EXIT_BRANCH ? DISASM_EDGE_FALLTHROUGH : DISASM_EDGE_RETURN_SITE,
+                              false);
+                break;
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/****************************** PUBLIC *****************************/
+
+uint32_t disasm_find_block(const DisasmCFG *cfg, uint32_t start) {
+    uint32_t lo = 0, hi = cfg->num_blocks;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cfg->blocks[mid].start < start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < cfg->num_blocks && cfg->blocks[lo].start == start ? lo : DISASM_NONE;
+}
+
+bool disasm_build_cfg(DisasmCFG *cfg, const uint8_t *prg, uint32_t size, const uint32_t map[4],
+                      const uint8_t *cdl) {
+    Analysis a = { .cfg = cfg, .prg = prg, .map = map };
+    uint32_t banks = (size + 0x1FFF) >> 13;
+    long threads = disasm_threads > 0 ? disasm_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    bool ok = true, far;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->size = size;
+    cfg->bytes = calloc(size + 1, 1);
+    cfg->home = malloc((banks + 1) * sizeof(uint16_t));
+    a.banks = calloc(banks + 1, sizeof(Bank));
+    a.num_banks = banks;
+    if (!cfg->bytes || !cfg->home || !a.banks) {
+        free(a.banks);
+        disasm_free(cfg);
+        return false;
+    }
+
+    // banks run where they are mapped at power-on, the highest window wins for mirrors
+    for (uint32_t b = 0; b < banks; b++) {
+        cfg->home[b] = CPU_PRG_ROM_ADDR_START;
+        a.banks[b] = (Bank){ &a, b << 13, (b + 1) << 13 < size ? (b + 1) << 13 : size, { NULL, 0, 0 },
+                             { NULL, 0, 0 }, true };
+    }
+    for (int w = 0; w < 4; w++) {
+        if (map[w] < size) {
+            cfg->home[map[w] >> 13] = CPU_PRG_ROM_ADDR_START + w * 0x2000;
+        }
+    }
+
+    // NMI, RESET and IRQ vectors, in the last window
+    if (map[3] != DISASM_NONE && map[3] + 0x2000 <= size) {
+        for (uint16_t v = 0xFFFA; v >= 0xFFFA && v < 0xFFFF; v += 2) {
+            const uint8_t *p = prg + map[3] + (v & 0x1FFF);
+            uint32_t entry = resolve(cfg, map, map[3], p[0] | p[1] << 8, &far);
+            if (entry != DISASM_NONE) {
+                ok = ok && route(&a, (Pending){ entry, DISASM_LEADER | DISASM_ENTRY });
+            }
+        }
+    }
+    if (cdl) {
+        for (uint32_t i = 0; i < size && ok; i++) {
+            if (cdl[i] & CDL_OPCODE) {
+                ok = route(&a, (Pending){ i, DISASM_LEADER | DISASM_ENTRY });
+            }
+        }
+    }
+
+    // tracing is the costly part, it runs in parallel from 64 KB of PRG ROM on
+    threads = threads < (long)banks ? threads : (long)banks;
+    ok = ok && trace_all(&a, banks >= 8 ? threads : 1);
+    for (uint32_t b = 0; b < banks; b++) {
+        free(a.banks[b].work.items);
+        free(a.banks[b].out.items);
+    }
+    free(a.banks);
+
+    ok = ok && split_blocks(cfg, prg) && link_blocks(cfg, prg, map);
+    if (!ok) {
+        disasm_free(cfg);
+    }
+    return ok;
+}
+
+void disasm_free(DisasmCFG *cfg) {
+    if (cfg->mapping) {
+        munmap(cfg->mapping, cfg->mapping_size);
+    } else {
+        free(cfg->bytes);
+        free(cfg->home);
+        free(cfg->blocks);
+        free(cfg->edges);
+    }
+    memset(cfg, 0, sizeof(*cfg));
+}
+
+
+/***************************** FORMATTER ***************************/
+
+// worst case length of each kind of line
+#define LINE_HEADER      96
+#define LINE_INSTRUCTION 64
+#define LINE_DATA        48
+
+// the text of an instruction line around its address and operands:
+// "[$" address head (" 0x" operand)* tail
+typedef struct {
+    char head[16];    // "]: $A9 - LDA"
+    char tail[40];    // padding, "[immediate]", newline
+    uint8_t head_len, tail_len;
+} LineTemplate;
+
+static LineTemplate templates[256];
+static pthread_once_t templates_once = PTHREAD_ONCE_INIT;
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+static const char *exit_names[] = {
+    [DISASM_EXIT_FALLTHROUGH] = "fallthrough",
+    [DISASM_EXIT_BRANCH]      = "branch",
+    [DISASM_EXIT_JUMP]        = "jump",
+    [DISASM_EXIT_CALL]        = "call",
+    [DISASM_EXIT_RETURN]      = "return",
+    [DISASM_EXIT_INDIRECT]    = "indirect",
+    [DISASM_EXIT_INVALID]     = "invalid",
+};
+
+static inline char *put_hex2(char *p, uint8_t v) {
+    p[0] = hex_digits[v >> 4];
+    p[1] = hex_digits[v & 0xF];
+    return p + 2;
+}
+
+static inline char *put_hex4(char *p, uint16_t v) {
+    return put_hex2(put_hex2(p, v >> 8), v & 0xFF);
+}
+
+static char *put_dec(char *p, uint32_t v) {
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static inline char *put_str(char *p, const char *s) {
+    while (*s) {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static void init_templates(void) {
+    for (int op = 0; op < 256; op++) {
+        CPUInstruction inst = cpu_instruction_table[op];
+        LineTemplate *t = &templates[op];
+        char *p;
+
+        if (!inst.numBytes) {
+            continue;
+        }
+        p = put_str(put_str(put_hex2(put_str(t->head, "]: $"), op), " - "), inst.mnemonic);
+        t->head_len = p - t->head;
+
+        // the operands and the addressing mode line up in columns
+        p = t->tail;
+        for (int col = 2 + 4 + t->head_len + 5 * (inst.numBytes - 1); col < 31; col++) {
+            *p++ = ' ';
+        }
+        if (inst.addr_mode != CPU_ADDR_IMPLIED) {
+            p = put_str(put_str(put_str(p, "["), cpu_addr_mode_names[inst.addr_mode]), "]");
+        }
+        *p++ = '\n';
+        t->tail_len = p - t->tail;
+    }
+}
+
+static char *put_instruction(char *p, const uint8_t *prg, uint32_t offset, uint16_t addr) {
+    uint8_t opcode = prg[offset];
+    const LineTemplate *t = &templates[opcode];
+
+    *p++ = '[';
+    *p++ = '$';
+    p = put_hex4(p, addr);
+    memcpy(p, t->head, sizeof(t->head));
+    p += t->head_len;
+    for (uint32_t i = 1; i < cpu_instruction_table[opcode].numBytes; i++) {
+        p[0] = ' ';
+        p[1] = '0';
+        p[2] = 'x';
+        p = put_hex2(p + 3, prg[offset + i]);
+    }
+    memcpy(p, t->tail, sizeof(t->tail));
+    return p + t->tail_len;
+}
+
+static char *put_block_header(char *p, const DisasmCFG *cfg, const DisasmBlock *b) {
+    p = put_str(p, "; block $");
+    p = put_hex4(p, b->addr);
+    p = put_dec(put_str(p, " (bank "), b->start >> 13);
+    *p++ = ')';
+    if (cfg->bytes[b->start] & DISASM_ENTRY) {
+        p = put_str(p, " entry");
+    }
+    if (cfg->bytes[b->start] & DISASM_CALLED) {
+        p = put_str(p, " subroutine");
+    }
+    p = put_str(put_str(put_str(p, ": "), exit_names[b->exit]), " ->");
+    for (int s = 0; s < 2; s++) {
+        *p++ = ' ';
+        if (b->succ[s] == DISASM_NONE) {
+            *p++ = '-';
+        } else {
+            *p++ = '$';
+            p = put_hex4(p, cfg->blocks[b->succ[s]].addr);
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+static char *put_data(char *p, const DisasmCFG *cfg, uint32_t start, uint32_t end) {
+    *p++ = '[';
+    *p++ = '$';
+    p = put_hex4(p, disasm_addr(cfg, start));
+    p = put_dec(put_str(p, "]: "), end - start);
+    return put_str(p, " bytes of data\n");
+}
+
+size_t disasm_format(const DisasmCFG *cfg, const uint8_t *prg, char **text) {
+    size_t bound = LINE_HEADER + LINE_DATA;
+    uint32_t data_start = 0;
+    char *p;
+
+    pthread_once(&templates_once, init_templates);
+
+    // one buffer for the whole listing, sized for the worst case: an instruction
+    // is at least one byte, so the size of a block bounds the lines it is listed in
+    for (uint32_t i = 0; i < cfg->num_blocks; i++) {
+        bound += LINE_DATA + LINE_HEADER + (size_t)cfg->blocks[i].size * LINE_INSTRUCTION;
+    }
+    if (!(*text = p = malloc(bound))) {
+        return 0;
+    }
+
+    p = put_dec(put_str(p, "; "), cfg->num_blocks);
+    p = put_dec(put_str(p, " blocks, "), cfg->num_edges);
+    p = put_str(p, " edges\n");
+    for (uint32_t i = 0; i < cfg->num_blocks; i++) {
+        const DisasmBlock *b = &cfg->blocks[i];
+        if (b->start > data_start) {
+            p = put_data(p, cfg, data_start, b->start);
+        }
+        p = put_block_header(p, cfg, b);
+        for (uint32_t o = b->start; o < b->start + b->size; o += cpu_instruction_table[prg[o]].numBytes) {
+            p = put_instruction(p, prg, o, disasm_addr(cfg, o));
+        }
+        data_start = b->start + b->size;
+    }
+    if (cfg->size > data_start) {
+        p = put_data(p, cfg, data_start, cfg->size);
+    }
+    return p - *text;
+}
+
+/****************************** CACHE ******************************/
+
+#define CACHE_MAGIC  "aCFG"
+#define CACHE_FORMAT 3      // bump when the layout of the file, of the structs or the analysis changes
+
+typedef struct {
+    char magic[4];
+    uint32_t format;
+    DisasmCacheKey key;
+    uint32_t size, banks, num_blocks, num_edges;
+} CacheHeader;
+
+// file offsets of the sections, each aligned to 8 bytes
+typedef struct {
+    size_t home, bytes, blocks, edges, end;
+} CacheLayout;
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+static void cache_layout(CacheLayout *l, uint32_t size, uint32_t banks, uint32_t num_blocks, uint32_t num_edges) {
+    l->home = align8(sizeof(CacheHeader));
+    l->bytes = l->home + align8((banks + 1) * sizeof(uint16_t));
+    l->blocks = l->bytes + align8((size_t)size + 1);
+    l->edges = l->blocks + align8((size_t)num_blocks * sizeof(DisasmBlock));
+    l->end = l->edges + align8((size_t)num_edges * sizeof(DisasmEdge));
+}
+
+void disasm_cache_key(DisasmCacheKey *key, uint32_t rom_crc, const char *core_version, const uint32_t map[4],
+                      const uint8_t *cdl, uint32_t size) {
+    uint8_t seeds[4096];
+
+    key->rom_crc = rom_crc;
+    key->core_crc = hash_crc32(0, core_version, strlen(core_version));
+    key->seeds_crc = hash_crc32(0, map, 4 * sizeof(uint32_t));
+    for (uint32_t i = 0; cdl && i < size; i += sizeof(seeds)) {
+        uint32_t n = size - i < sizeof(seeds) ? size - i : sizeof(seeds);
+        for (uint32_t j = 0; j < n; j++) {
+            seeds[j] = cdl[i + j] & CDL_OPCODE;
+        }
+        key->seeds_crc = hash_crc32(key->seeds_crc, seeds, n);
+    }
+}
+
+// the header and the length only say the file is complete: every index and offset
+// the CFG is walked with is checked too, so a damaged file is rebuilt rather than
+// read out of bounds
+static bool cache_valid(const DisasmCFG *cfg, const uint8_t *prg) {
+    uint32_t banks = (cfg->size + 0x1FFF) >> 13, end = 0;
 
-        sprintf(buf, "[$%04X]: $%02X - %s", base_addr+i, opcode, inst.mnemonic);
-        if (inst.numBytes > 1) {
-            sprintf(&buf[18], " 0x%02X", prg_rom[++i]);
+    for (uint32_t b = 0; b < banks; b++) {
+        if (cfg->home[b] < CPU_PRG_ROM_ADDR_START || (cfg->home[b] & 0x1FFF)) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < cfg->num_blocks; i++) {
+        const DisasmBlock *b = &cfg->blocks[i];
+        uint32_t o = b->start, count = 0;
+        // sorted and disjoint, within the PRG ROM
+        if (b->start < end || !b->size || b->size > cfg->size - b->start || b->exit > DISASM_EXIT_INVALID) {
+            return false;
+        }
+        for (int s = 0; s < 2; s++) {
+            if (b->succ[s] != DISASM_NONE && b->succ[s] >= cfg->num_blocks) {
+                return false;
+            }
+        }
+        // made of whole, defined instructions, as the listing walks them
+        end = b->start + b->size;
+        for (; o < end && cpu_instruction_table[prg[o]].numBytes; o += cpu_instruction_table[prg[o]].numBytes) {
+            count++;
         }
-        if (inst.numBytes > 2) {
-            sprintf(&buf[23], " 0x%02X", prg_rom[++i]);
+        if (o != end || count != b->count) {
+            return false;
         }
+    }
+    for (uint32_t i = 0; i < cfg->num_edges; i++) {
+        if (cfg->edges[i].from >= cfg->num_blocks || cfg->edges[i].to >= cfg->num_blocks) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool disasm_cache_load(DisasmCFG *cfg, const char *path, const DisasmCacheKey *key, const uint8_t *prg,
+                       uint32_t size) {
+    const CacheHeader *h;
+    CacheLayout l;
+    struct stat st;
+    uint8_t *map;
+    int fd;
+
+    memset(cfg, 0, sizeof(*cfg));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return false;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    // private: the CFG stays writable, changes never reach the file
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    h = (const CacheHeader *)map;
+    cache_layout(&l, h->size, h->banks, h->num_blocks, h->num_edges);
+    if (memcmp(h->magic, CACHE_MAGIC, 4) || h->format != CACHE_FORMAT || memcmp(&h->key, key, sizeof(*key)) ||
+        h->size != size || h->banks != (h->size + 0x1FFF) >> 13 || l.end != (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    cfg->mapping = map;
+    cfg->mapping_size = st.st_size;
+    cfg->size = h->size;
+    cfg->home = (uint16_t *)(map + l.home);
+    cfg->bytes = map + l.bytes;
+    cfg->blocks = (DisasmBlock *)(map + l.blocks);
+    cfg->num_blocks = h->num_blocks;
+    cfg->edges = (DisasmEdge *)(map + l.edges);
+    cfg->num_edges = h->num_edges;
+    if (!cache_valid(cfg, prg)) {
+        disasm_free(cfg);
+        return false;
+    }
+    return true;
+}
+
+static bool write_section(FILE *f, const void *data, size_t size) {
+    static const uint8_t zeros[8];
+    return fwrite(data, 1, size, f) == size && fwrite(zeros, 1, align8(size) - size, f) == align8(size) - size;
+}
 
-        for(int j = strlen(buf); j < 31; j++) {
-            buf[j] = ' ';
+bool disasm_cache_save(const DisasmCFG *cfg, const char *path, const DisasmCacheKey *key) {
+    CacheHeader h = { CACHE_MAGIC, CACHE_FORMAT, *key, cfg->size, (cfg->size + 0x1FFF) >> 13,
+                      cfg->num_blocks, cfg->num_edges };
+    char tmp[4096 + 16];
+    bool ok;
+    FILE *f;
+
+    // written aside and renamed, so that a concurrent load sees the old file or the new one
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (!(f = fopen(tmp, "wb"))) {
+        return false;
+    }
+    ok = write_section(f, &h, sizeof(h)) &&
+         write_section(f, cfg->home, (h.banks + 1) * sizeof(uint16_t)) &&
+         write_section(f, cfg->bytes, cfg->size + 1) &&
+         write_section(f, cfg->blocks, (size_t)cfg->num_blocks * sizeof(DisasmBlock)) &&
+         write_section(f, cfg->edges, (size_t)cfg->num_edges * sizeof(DisasmEdge));
+    ok = fclose(f) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok) {
+        remove(tmp);
+    }
+    return ok;
+}
+
+
+/****************************** OUTPUT *****************************/
+
+// the CFG from the cache when it matches `key`, else built and cached
+static bool load_cfg(DisasmCFG *cfg, const char *cache_path, const DisasmCacheKey *key, const uint8_t *prg,
+                     uint32_t size, const uint32_t map[4], const uint8_t *cdl) {
+    if (cache_path && disasm_cache_load(cfg, cache_path, key, prg, size)) {
+        return true;
+    }
+    if (!disasm_build_cfg(cfg, prg, size, map, cdl)) {
+        return false;
+    }
+    if (cache_path && !disasm_cache_save(cfg, cache_path, key)) {
+        log_cb(RETRO_LOG_WARN, "Could not write the disassembly cache %s\n", cache_path);
+    }
+    return true;
+}
+
+static bool disassemble_to(const char *path, const char *cache_path, const DisasmCacheKey *key,
+                           const uint8_t *prg, uint32_t size, const uint32_t map[4], const uint8_t *cdl) {
+    DisasmCFG cfg;
+    char *text = NULL;
+    size_t len, done = 0;
+    int fd;
+
+    if (!load_cfg(&cfg, cache_path, key, prg, size, map, cdl)) {
+        return false;
+    }
+    len = disasm_format(&cfg, prg, &text);
+    disasm_free(&cfg);
+    if (!text || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free(text);
+        return false;
+    }
+    while (done < len) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n <= 0) {
+            break;
         }
-        sprintf(&buf[31], strcmp(inst.addr_mode, "") ? "[%s]" : "", inst.addr_mode);
+        done += n;
+    }
+    free(text);
+    return close(fd) == 0 && done == len;
+}
+
+
+/**************************** BACKGROUND ***************************/
+
+static struct {
+    pthread_t thread;
+    bool running;
+    char path[4096];
+    char cache_path[4096];
+    char core_version[64];
+    uint32_t map[4];
+    const uint8_t *cdl;
+} job;
+
+// power-on map of the loaded cartridge, in PRG ROM offsets
+static void prg_map(uint32_t map[4]) {
+    for (int w = 0; w < 4; w++) {
+        const uint8_t *p = cpu_prg_map[w];
+        map[w] = p >= prg_rom && p < prg_rom + pgr_rom_size ? (uint32_t)(p - prg_rom) : DISASM_NONE;
+    }
+}
 
-        log_cb(RETRO_LOG_INFO, "%s\n", buf);
+static void *disasm_worker(void *arg) {
+    const char *cache_path = job.cache_path[0] ? job.cache_path : NULL;
+    DisasmCacheKey key;
+
+    (void)arg;
+    disasm_cache_key(&key, rom_crc32, job.core_version, job.map, job.cdl, pgr_rom_size);
+    if (!disassemble_to(job.path, cache_path, &key, prg_rom, pgr_rom_size, job.map, job.cdl)) {
+        log_cb(RETRO_LOG_ERROR, "Could not disassemble PRG ROM to %s\n", job.path);
     }
+    return NULL;
+}
+
+bool disassemble(const char *path) {
+    uint32_t map[4];
+
+    prg_map(map);
+    return disassemble_to(path, NULL, NULL, prg_rom, pgr_rom_size, map, cdl_enabled ? cdl_prg : NULL);
 }
 
+bool disasm_start(const char *path, const char *cache_path, const char *core_version) {
+    disasm_wait();
+    snprintf(job.path, sizeof(job.path), "%s", path);
+    snprintf(job.cache_path, sizeof(job.cache_path), "%s", cache_path ? cache_path : "");
+    snprintf(job.core_version, sizeof(job.core_version), "%s", core_version);
+    prg_map(job.map);
+    job.cdl = cdl_enabled ? cdl_prg : NULL;
+    job.running = pthread_create(&job.thread, NULL, disasm_worker, NULL) == 0;
+    return job.running;
+}
+
+void disasm_wait() {
+    if (job.running) {
+        pthread_join(job.thread, NULL);
+        job.running = false;
+    }
+}
@@ -1,8 +1,214 @@
 #ifndef DISASSEMBLER_H
 #define DISASSEMBLER_H
 
-// print a disassembly of the program loaded at memory address CPU_PGR_ROM_START
-// uses global vars mem, pgr_rom_size
-void disassemble();
+/*
+    Recursive descent disassembler.
+
+    Starting from the NMI, RESET and IRQ vectors (and from every opcode flagged by
+    the code/data logger, when a log is loaded), the disassembler follows the control
+    flow: branches continue on both paths, JMP on its target, JSR on its target and
+    after it; RTS, RTI, BRK, JMP (indirect) and undefined opcodes end a path. Bytes
+    never reached stay data, so data mixed with code does not derail it.
+
+    Code is identified by its PRG ROM offset, so banks that share a CPU address are
+    kept apart. Each 8 KB bank is assumed to run at its "home" window: the window it
+    is mapped to at power-on, or $8000 for banks that are switched in later. A target
+    in the same window stays in the bank; a target in another window resolves to the
+    bank mapped there at power-on (the fixed banks of MMC1/MMC3), and the edge is
+    flagged far since a switchable window may hold another bank at that time.
+
+    The result is a control-flow graph: basic blocks, sorted by offset, and the edges
+    between them.
+
+    Tracing runs per 8 KB bank, on a pool of `disasm_threads` threads. A path that
+    leaves its bank (a far target, a fallthrough or an instruction running into the
+    next bank) is queued and handed to the bank it reaches between two rounds, so
+    each thread only writes the flags of its own bank and the result does not
+    depend on the number of threads.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISASM_NONE UINT32_MAX
+
+extern int disasm_threads;    // threads of disasm_build_cfg(), 0 for one per core
+
+
+/***************************** DECODER *****************************/
+
+// how an instruction passes control on
+typedef enum DisasmFlow {
+    DISASM_FLOW_NEXT = 0,    // to the next instruction
+    DISASM_FLOW_BRANCH,      // Bxx $rr: to `target` or the next instruction
+    DISASM_FLOW_JUMP,        // JMP $aaaa: to `target`
+    DISASM_FLOW_CALL,        // JSR $aaaa: to `target`, returning to the next instruction
+    DISASM_FLOW_RETURN,      // RTS, RTI
+    DISASM_FLOW_INDIRECT,    // JMP ($aaaa), BRK: unknown statically
+} DisasmFlow;
+
+typedef struct {
+    uint16_t addr;           // CPU address
+    uint16_t operand;        // 8 or 16 bit operand, 0 if none
+    uint16_t target;         // CPU address of a branch, jump or call target
+    uint8_t opcode;
+    uint8_t length;          // in bytes, 0 for an undefined opcode
+    uint8_t cycles;          // base cycles, without page crossing or branch penalties
+    uint8_t mode;            // CPUAddrMode
+    uint8_t flow;            // DisasmFlow
+} DisasmInstruction;
+
+/*
+    Decode the instruction in `code` (at least 1 byte, `avail` bytes readable)
+    running at CPU address `addr`. Returns false for an undefined opcode or one
+    truncated by `avail`; the fields from the opcode are filled in either case.
+    The decoder keeps no state and only reads cpu_instruction_table.
+*/
+bool disasm_decode(DisasmInstruction *inst, const uint8_t *code, size_t avail, uint16_t addr);
+// same, at a CPU address of PRG ROM, through the current banks of cpu_prg_map
+bool disasm_decode_at(DisasmInstruction *inst, uint16_t addr);
+
+// linear sweep over the instructions of a bank of PRG ROM
+typedef struct {
+    const uint8_t *bank;
+    uint32_t size;
+    uint32_t offset;         // of the next instruction in the bank
+    uint16_t base;           // CPU address of the bank
+} DisasmIter;
+
+void disasm_iter_init(DisasmIter *it, const uint8_t *bank, uint32_t size, uint16_t base);
+// false at the end of the bank; an undefined opcode comes out as a single byte
+// with length 0 and the byte in `operand`
+bool disasm_iter_next(DisasmIter *it, DisasmInstruction *inst);
+
+
+/*************************** CONTROL FLOW **************************/
+
+// flags of each PRG ROM byte
+typedef enum DisasmByte {
+    DISASM_OPCODE  = 0b00000001, // first byte of an instruction
+    DISASM_OPERAND = 0b00000010, // following bytes of an instruction
+    DISASM_LEADER  = 0b00000100, // first instruction of a basic block
+    DISASM_ENTRY   = 0b00001000, // vector or CDL seed
+    DISASM_CALLED  = 0b00010000, // target of a JSR
+} DisasmByte;
+
+// how control leaves a basic block
+typedef enum DisasmExit {
+    DISASM_EXIT_FALLTHROUGH = 0,  // into the next block, a branch/jump target or the next bank
+    DISASM_EXIT_BRANCH,           // conditional: taken, then not taken
+    DISASM_EXIT_JUMP,             // JMP $aaaa
+    DISASM_EXIT_CALL,             // JSR $aaaa, then returns to the next block
+    DISASM_EXIT_RETURN,           // RTS, RTI
+    DISASM_EXIT_INDIRECT,         // JMP ($aaaa), BRK: target unknown statically
+    DISASM_EXIT_INVALID,          // undefined opcode, end of ROM or overlapping code
+} DisasmExit;
+
+typedef enum DisasmEdgeKind {
+    DISASM_EDGE_FALLTHROUGH = 0,
+    DISASM_EDGE_TAKEN,
+    DISASM_EDGE_JUMP,
+    DISASM_EDGE_CALL,
+    DISASM_EDGE_RETURN_SITE,      // from a JSR block to the instruction after it
+} DisasmEdgeKind;
+
+typedef struct {
+    uint32_t start;       // PRG ROM offset of the first instruction
+    uint16_t addr;        // CPU address of the first instruction
+    uint16_t size;        // in bytes
+    uint16_t count;       // number of instructions
+    uint8_t exit;         // DisasmExit
+    uint32_t succ[2];     // successor blocks (see DisasmExit), DISASM_NONE if unknown
+} DisasmBlock;
+
+typedef struct {
+    uint32_t from, to;    // block indices
+    uint8_t kind;         // DisasmEdgeKind
+    bool far;             // resolved through another CPU window
+} DisasmEdge;
+
+typedef struct {
+    uint8_t *bytes;           // DisasmByte flags, one per PRG ROM byte
+    uint32_t size;            // PRG ROM size
+    uint16_t *home;           // CPU window ($8000, $A000, ...) of each 8 KB bank
+    DisasmBlock *blocks;      // sorted by start
+    uint32_t num_blocks;
+    DisasmEdge *edges;        // sorted by `from`
+    uint32_t num_edges;
+    void *mapping;            // cache file holding all of the above, NULL if built
+    size_t mapping_size;
+} DisasmCFG;
+
+/*
+    Build the CFG of `size` bytes of PRG ROM. `map` holds the ROM offset of the bank
+    mapped at $8000, $A000, $C000 and $E000 at power-on; `cdl` may be NULL or point
+    to `size` code/data logger flags whose opcodes are used as extra entry points.
+    Returns false if out of memory. Release with disasm_free().
+*/
+bool disasm_build_cfg(DisasmCFG *cfg, const uint8_t *prg, uint32_t size, const uint32_t map[4],
+                      const uint8_t *cdl);
+void disasm_free(DisasmCFG *cfg);
+
+// index of the block starting at PRG ROM offset `start`, or DISASM_NONE
+uint32_t disasm_find_block(const DisasmCFG *cfg, uint32_t start);
+
+// CPU address of a PRG ROM offset, in its bank's home window
+static inline uint16_t disasm_addr(const DisasmCFG *cfg, uint32_t offset) {
+    return cfg->home[offset >> 13] | (offset & 0x1FFF);
+}
+
+
+/****************************** CACHE ******************************/
+
+/*
+    A CFG can be stored in a binary cache file, so that the same rom is analysed
+    once. The file holds the arrays of DisasmCFG as they are in memory, and loading
+    it maps it (private, copy-on-write) instead of reading it: disasm_free() then
+    unmaps it. A cache is only used when its key matches, that is for the same rom,
+    the same core version, and the same entry points (power-on banks and CDL opcode
+    flags); any other file, or one whose blocks and edges do not fit the rom, is
+    ignored and rebuilt.
+*/
+typedef struct {
+    uint32_t rom_crc;         // CRC-32 of the rom (rom_crc32)
+    uint32_t core_crc;        // CRC-32 of the core version
+    uint32_t seeds_crc;       // CRC-32 of the power-on map and the CDL opcode flags
+} DisasmCacheKey;
+
+void disasm_cache_key(DisasmCacheKey *key, uint32_t rom_crc, const char *core_version, const uint32_t map[4],
+                      const uint8_t *cdl, uint32_t size);
+// false if there is no cache for `key` at `path`, or it does not hold a valid CFG
+// of the `size` bytes of `prg`
+bool disasm_cache_load(DisasmCFG *cfg, const char *path, const DisasmCacheKey *key, const uint8_t *prg,
+                       uint32_t size);
+// replaces the file atomically
+bool disasm_cache_save(const DisasmCFG *cfg, const char *path, const DisasmCacheKey *key);
+
+
+/****************************** OUTPUT *****************************/
+
+/*
+    Format the listing of a CFG into a new buffer (`*text`, to free), returning its
+    length; 0 and NULL if out of memory. The text is built from per-opcode line
+    templates, without printf, and is meant to be written out in one go.
+*/
+size_t disasm_format(const DisasmCFG *cfg, const uint8_t *prg, char **text);
+
+/*
+    Listing of the loaded PRG ROM, block by block, written to a text file.
+    Uses global vars prg_rom, pgr_rom_size, cpu_prg_map and cdl_prg.
+
+    disassemble() runs on the calling thread. disasm_start() returns right away and
+    writes the file from a background thread, so loading a game does not wait for
+    it; disasm_wait() must be called before the cartridge or the code/data log are
+    released. The worker only reads the ROM, and the CDL flags it seeds from are
+    only ever OR-ed in by the running game. With a `cache_path`, the worker takes
+    the CFG from that cache file, or builds it and writes the file, keyed with
+    `core_version`.
+*/
+bool disassemble(const char *path);
+bool disasm_start(const char *path, const char *cache_path, const char *core_version);
+void disasm_wait();
 
 #endif /* DISASSEMBLER_H */
@@ -0,0 +1,347 @@
+/*
+    aioNES_bench: throughput of the hot paths of the core, on a given rom.
+
+    usage: aioNES_bench [-n iterations] [-j threads] <rom file>
+
+    The file is read once, then every benchmark that applies to it runs `iterations`
+    times and reports the best run, in MB/s of the data it produces:
+      crc32    CRC-32 of the whole file (hash.c)
+      inflate  decode of the rom inside a .zip/.gz (inflate.c)
+      cfg      control-flow analysis of the PRG ROM of a .nes, traced from every byte
+               so that all banks are covered, on `threads` threads (test/disassembler.c)
+      disasm   listing of that analysis, in MB/s of text
+      ppu-*    scanline rendering of frames of the rom's tiles (nametables, palette
+               and sprites filled from PRG ROM), once per line composition variant
+               the CPU supports, in XRGB8888 then RGB565 (-565), in millions of
+               pixels per second; ppu-none is the same frames headless,
+               ppu-same frames left unchanged (not composed again), and
+               ppu-thread frames drawn on the render thread as the next ones run
+*/
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../archive.h"
+#include "../hash.h"
+#include "../cdl.h"
+#include "../libretro/libretro.h"
+#include "../ppu.h"
+#include "../test/disassembler.h"
+
+static int iterations = 20;
+
+
+/***************************** LOGGING *****************************/
+
+static void tool_log(enum retro_log_level level, const char *fmt, ...) {
+    va_list va;
+    if (level < RETRO_LOG_WARN) {
+        return;
+    }
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+}
+
+// cartridge.c logs through the libretro callback
+retro_log_printf_t log_cb = tool_log;
+
+
+/****************************** TIMING *****************************/
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, size_t bytes, double best) {
+    printf("%-14s %10zu bytes  %9.3f ms  %9.1f MB/s\n", name, bytes, best * 1e3, bytes / best / 1e6);
+}
+
+static void report_pixels(const char *name, size_t pixels, double best) {
+    printf("%-14s %10zu pixels %9.3f ms  %9.1f Mpx/s\n", name, pixels, best * 1e3, pixels / best / 1e6);
+}
+
+
+/**************************** BENCHMARKS ***************************/
+
+static volatile uint32_t sink;
+
+static void bench_crc32(const uint8_t *data, size_t size) {
+    double best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        double t = now();
+        sink = hash_crc32(0, data, size);
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    report("crc32", size, best);
+}
+
+static bool bench_inflate(const uint8_t *data, size_t size) {
+    ArchiveMember m;
+    double best = 1e30;
+    uint8_t *out;
+
+    if (!archive_find_rom(data, size, &m)) {
+        fprintf(stderr, "no rom found in the archive\n");
+        return false;
+    }
+    if (m.stored) {
+        printf("%-14s member is stored, nothing to decode\n", "inflate");
+        return true;
+    }
+
+    out = malloc(m.size ? m.size : 1);
+    for (int i = 0; i < iterations; i++) {
+        double t = now();
+        bool ok = archive_extract(&m, out);
+        t = now() - t;
+        if (!ok) {
+            fprintf(stderr, "corrupted archive\n");
+            free(out);
+            return false;
+        }
+        best = t < best ? t : best;
+    }
+    free(out);
+    report("inflate", m.size, best);
+    return true;
+}
+
+static bool bench_disasm(const uint8_t *data, size_t size) {
+    const uint8_t *prg = data + 16 + (data[6] & 0b100 ? 512 : 0);
+    uint32_t prg_size = data[4] * 0x4000;
+    uint32_t map[4];
+    uint8_t *seeds;
+    double best = 1e30, best_cfg = 1e30;
+    size_t len = 0;
+
+    if (prg_size < 0x4000 || prg + prg_size > data + size) {
+        fprintf(stderr, "PRG ROM is truncated\n");
+        return false;
+    }
+    // first banks at $8000, last 16 KB fixed at $C000
+    map[0] = 0;
+    map[1] = 0x2000;
+    map[2] = prg_size - 0x4000;
+    map[3] = prg_size - 0x2000;
+    seeds = malloc(prg_size);
+    memset(seeds, CDL_OPCODE, prg_size);
+
+    for (int i = 0; i < iterations; i++) {
+        DisasmCFG cfg;
+        char *text;
+        double t = now();
+        bool ok = disasm_build_cfg(&cfg, prg, prg_size, map, seeds);
+        double t_cfg = now() - t;
+        t = now();
+        len = ok ? disasm_format(&cfg, prg, &text) : 0;
+        t = now() - t;
+        if (ok) {
+            disasm_free(&cfg);
+        }
+        if (!len) {
+            fprintf(stderr, "out of memory\n");
+            free(seeds);
+            return false;
+        }
+        free(text);
+        best = t < best ? t : best;
+        best_cfg = t_cfg < best_cfg ? t_cfg : best_cfg;
+    }
+    free(seeds);
+    report("cfg", prg_size, best_cfg);
+    report("disasm", len, best);
+    return true;
+}
+
+#define BENCH_FRAMES 10
+
+// a frame scrolled unlike the one before, so that it is drawn
+static void bench_ppu_scroll(int frame) {
+    ppu_write_register(0x2005, frame);
+    ppu_write_register(0x2005, 0);
+}
+
+static void bench_ppu(const uint8_t *data, size_t size) {
+    const uint8_t *prg = data + 16 + (data[6] & 0b100 ? 512 : 0);
+    uint32_t prg_size = data[4] * 0x4000;
+    static uint8_t chr[0x2000];
+    static uint64_t rows[0x2000 / 2];
+    static uint32_t pixels[PPU_WIDTH * PPU_HEIGHT];    // either format
+    uint32_t n = 0;
+
+    // CHR ROM, or PRG ROM as tiles for CHR RAM games
+    if (data[5] && prg + prg_size + 0x2000 <= data + size) {
+        memcpy(chr, prg + prg_size, 0x2000);
+    } else {
+        memcpy(chr, prg, 0x2000);
+    }
+    ppu_decode_chr(chr, rows, 0x2000);
+    for (int i = 0; i < 8; i++) {
+        ppu_chr_map[i] = chr + i * 0x400;
+        ppu_chr_rows[i] = rows + i * PPU_CHR_ROWS_PER_PAGE;
+    }
+    ppu_reset();
+    ppu_set_output(pixels, PPU_WIDTH, PPU_FORMAT_XRGB8888);
+
+    ppu_write_register(0x2006, 0x20);
+    ppu_write_register(0x2006, 0x00);
+    for (int i = 0; i < 0x1000; i++) {
+        ppu_write_register(0x2007, prg[n++ % prg_size]);
+    }
+    for (int i = 0; i < 32; i++) {
+        ppu_write_register(0x2007, prg[n++ % prg_size]);
+    }
+    for (int i = 0; i < 256; i++) {
+        ppu_write_register(0x2004, prg[n++ % prg_size] % (i % 4 ? 256 : PPU_HEIGHT));
+    }
+    ppu_write_register(0x2001, PPU_MASK_BG | PPU_MASK_SPRITES | PPU_MASK_BG_LEFT | PPU_MASK_SPRITE_LEFT);
+
+    for (int format = 0; format < PPU_FORMAT_COUNT; format++) {
+        ppu_set_output(pixels, PPU_WIDTH, format);
+        for (int simd = 0; simd < PPU_SIMD_COUNT; simd++) {
+            double best = 1e30;
+            char name[24];
+
+            snprintf(name, sizeof(name), "ppu-%s%s", ppu_simd_names[simd], format == PPU_FORMAT_RGB565 ? "-565" : "");
+            if (!ppu_set_simd(simd)) {
+                printf("%-14s not supported by this CPU\n", name);
+                continue;
+            }
+            for (int i = 0; i < iterations; i++) {
+                double t = now();
+                for (int f = 0; f < BENCH_FRAMES; f++) {
+                    bench_ppu_scroll(f);
+                    ppu_run_frame();
+                }
+                t = now() - t;
+                best = t < best ? t : best;
+            }
+            report_pixels(name, BENCH_FRAMES * PPU_WIDTH * PPU_HEIGHT, best);
+        }
+    }
+
+    // the same frames not drawn, in pixels that would have been
+    double best = 1e30;
+    ppu_headless = true;
+    for (int i = 0; i < iterations; i++) {
+        double t = now();
+        for (int f = 0; f < BENCH_FRAMES; f++) {
+            bench_ppu_scroll(f);
+            ppu_run_frame();
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    ppu_headless = false;
+    report_pixels("ppu-none", BENCH_FRAMES * PPU_WIDTH * PPU_HEIGHT, best);
+
+    // frames that do not scroll are drawn like the one before
+    best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        double t = now();
+        for (int f = 0; f < BENCH_FRAMES; f++) {
+            ppu_run_frame();
+        }
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    report_pixels("ppu-same", BENCH_FRAMES * PPU_WIDTH * PPU_HEIGHT, best);
+
+    // drawn a frame behind, on another core
+    if (!ppu_set_threaded(true)) {
+        printf("%-14s could not start the thread\n", "ppu-thread");
+        return;
+    }
+    best = 1e30;
+    for (int i = 0; i < iterations; i++) {
+        double t = now();
+        for (int f = 0; f < BENCH_FRAMES; f++) {
+            bench_ppu_scroll(f);
+            ppu_run_frame();
+        }
+        ppu_thread_wait();
+        t = now() - t;
+        best = t < best ? t : best;
+    }
+    ppu_set_threaded(false);
+    report_pixels("ppu-thread", BENCH_FRAMES * PPU_WIDTH * PPU_HEIGHT, best);
+}
+
+
+/****************************** MAIN *******************************/
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    uint8_t *data;
+    long n;
+
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(n > 0 ? n : 1);
+    if (n < 0 || fread(data, 1, n, f) != (size_t)n) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = n;
+    return data;
+}
+
+int main(int argc, char **argv) {
+    uint8_t *data;
+    size_t size;
+    int opt;
+    bool ok = true;
+
+    while ((opt = getopt(argc, argv, "n:j:")) != -1) {
+        if (opt == 'n' && (iterations = atoi(optarg)) > 0) {
+            continue;
+        }
+        if (opt == 'j' && (disasm_threads = atoi(optarg)) > 0) {
+            continue;
+        }
+        goto usage;
+    }
+    if (optind != argc - 1) {
+        goto usage;
+    }
+
+    data = read_file(argv[optind], &size);
+    if (!data) {
+        fprintf(stderr, "could not read %s\n", argv[optind]);
+        return 1;
+    }
+
+    hash_init();
+    bench_crc32(data, size);
+    if (archive_type(data, size) != ARCHIVE_NONE) {
+        ok = bench_inflate(data, size);
+    } else if (size >= 16 && !memcmp(data, "NES\x1a", 4)) {
+        ok = bench_disasm(data, size);
+        if (ok) {
+            bench_ppu(data, size);
+        }
+    }
+
+    free(data);
+    return ok ? 0 : 1;
+
+usage:
+    fprintf(stderr, "usage: %s [-n iterations] [-j threads] <rom file>\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,72 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+/*
+    Binary rom catalog written by aioNES_romindex.
+
+    The file is meant to be mmap'd and read in place, all integers are little endian
+    and every section is 8-byte aligned:
+
+    Offset          Size                Content
+    ---------------------------------------------------------------------
+    0               sizeof(header)      CatalogHeader
+    records_offset  count * 64          CatalogRecord[count], sorted by path (strcmp)
+    strings_offset  strings_size        NUL-terminated paths, relative to the root
+
+    Records are sorted so a reader can bisect the array by path, which is also how the
+    indexer finds the previous state of a file when it runs incrementally.
+*/
+
+#include <stdint.h>
+
+#define CATALOG_MAGIC   "AIONESC"   // 8 bytes with the NUL terminator
+// bump when the records or their flags change, so that an older catalog is
+// rebuilt instead of reused with the new fields missing
+#define CATALOG_VERSION 3
+
+typedef enum CatalogFlags {
+    CATALOG_FLAG_VALID       = 0b00000001, // the file has an iNES header
+    CATALOG_FLAG_NES2        = 0b00000010, // NES 2.0 header
+    CATALOG_FLAG_VERTICAL    = 0b00000100, // vertical mirroring
+    CATALOG_FLAG_TRAINER     = 0b00001000, // 512-byte trainer present
+    CATALOG_FLAG_TRUNCATED   = 0b00010000, // file shorter than the header says
+    CATALOG_FLAG_GAMEDB      = 0b00100000, // found in the game database (overrides applied)
+    CATALOG_FLAG_BATTERY     = 0b01000000, // battery-backed PRG RAM
+    CATALOG_FLAG_FOUR_SCREEN = 0b10000000, // four-screen nametables
+} CatalogFlags;
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t count;           // number of records
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t created;         // unix time
+} CatalogHeader;
+
+typedef struct {
+    uint64_t mtime_ns;        // file modification time, nanoseconds since the epoch
+    uint64_t file_size;
+    uint32_t path_offset;     // into the string table
+    uint32_t crc32;           // CRC-32 of PRG ROM + CHR ROM, the game database key
+    uint32_t prg_rom_size;    // in bytes
+    uint32_t chr_rom_size;    // in bytes
+    uint16_t mapper;
+    uint8_t  submapper;
+    uint8_t  timing;          // 0 for NTSC, 1 for PAL, 2 for multi, 3 for dendy
+    uint8_t  flags;           // CatalogFlags
+    uint8_t  reserved[27];
+} CatalogRecord;
+
+_Static_assert(sizeof(CatalogRecord) == 64, "CatalogRecord must stay 64 bytes");
+
+static inline const CatalogRecord *catalog_records(const CatalogHeader *cat) {
+    return (const CatalogRecord *)((const char *)cat + cat->records_offset);
+}
+
+static inline const char *catalog_path(const CatalogHeader *cat, const CatalogRecord *rec) {
+    return (const char *)cat + cat->strings_offset + rec->path_offset;
+}
+
+#endif /* CATALOG_H */
@@ -0,0 +1,628 @@
+/*
+    aioNES_check: regression checks of the core on crafted inputs, run by ctest.
+
+    usage: aioNES_check
+
+    Each check builds a small malformed or corner case input in memory, or a tiny
+    rom loaded like retro_load_game() does, and verifies the core rejects it,
+    handles it within bounds or gets the result the hardware would; the exit status
+    is the number of failed checks. The last byte of a resized image is read, so a
+    build with -fsanitize=address also catches a size reported larger than the
+    buffer.
+*/
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../cartridge.h"
+#include "../cdl.h"
+#include "../cpu.h"
+#include "../gamedb.h"
+#include "../libretro/libretro.h"
+#include "../mapper.h"
+#include "../patch.h"
+#include "../ppu.h"
+#include "../test/disassembler.h"
+
+static int failed;
+
+
+/***************************** LOGGING *****************************/
+
+static void tool_log(enum retro_log_level level, const char *fmt, ...) {
+    va_list va;
+    if (level < RETRO_LOG_WARN) {
+        return;
+    }
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+}
+
+// cartridge.c logs through the libretro callback
+retro_log_printf_t log_cb = tool_log;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failed++;
+    }
+}
+
+
+/******************************* ROMS ******************************/
+
+// load an iNES rom of `prg_size` bytes of PRG ROM (zeroed if `prg` is NULL) and
+// `chr_size` bytes of blank CHR ROM, the PPU reset first as retro_load_game() does;
+// release with cartridge_unload()
+static bool load_rom(int number, const uint8_t *prg, uint32_t prg_size, uint32_t chr_size) {
+    char path[] = "/tmp/aioNES_check_XXXXXX";
+    uint8_t header[16] = { 'N', 'E', 'S', 0x1A, prg_size >> 14, chr_size >> 13, (number & 0x0F) << 4,
+                           number & 0xF0 };
+    uint8_t *image = calloc(prg_size + chr_size, 1);
+    struct retro_game_info info = { .path = path };
+    bool ok;
+    FILE *f;
+    int fd;
+
+    if (!image || (fd = mkstemp(path)) < 0) {
+        free(image);
+        return false;
+    }
+    if (prg) {
+        memcpy(image, prg, prg_size);
+    }
+    ok = (f = fdopen(fd, "wb")) && fwrite(header, 16, 1, f) == 1 && fwrite(image, prg_size + chr_size, 1, f) == 1;
+    ok = f && fclose(f) == 0 && ok;
+    free(image);
+
+    ppu_reset();
+    ok = ok && cartridge_parse_header(&info, NULL);
+    remove(path);
+    return ok;
+}
+
+
+/****************************** PATCH ******************************/
+
+// apply an IPS patch to a zeroed 16 bytes image, returning the result size or -1
+static long ips(const uint8_t *patch, size_t patch_size, uint8_t **image) {
+    uint32_t size = 16;
+    *image = calloc(size, 1);
+    if (!patch_apply(patch, patch_size, image, &size)) {
+        return -1;
+    }
+    return size;
+}
+
+static void check_ips() {
+    uint8_t *image;
+    long size;
+
+    // a truncation size larger than the image extends it, zero filled
+    static const uint8_t grow[] = "PATCH\0\0\0\0\1\x42" "EOF\x10\0\0";
+    size = ips(grow, sizeof(grow) - 1, &image);
+    check(size == 0x100000 && image[0] == 0x42 && image[size - 1] == 0,
+          "ips: truncation past the end of the image");
+    free(image);
+
+    // a truncation size shrinks the image
+    static const uint8_t shrink[] = "PATCH\0\0\0\0\1\x42" "EOF\0\0\x04";
+    size = ips(shrink, sizeof(shrink) - 1, &image);
+    check(size == 4 && image[0] == 0x42, "ips: truncation");
+    free(image);
+
+    // anything but exactly 3 bytes after EOF is not a truncation size
+    static const uint8_t trailing[] = "PATCH\0\0\0\0\1\x42" "EOF\x10\0\0\0";
+    size = ips(trailing, sizeof(trailing) - 1, &image);
+    check(size == 16, "ips: trailing bytes after EOF");
+    free(image);
+}
+
+
+/******************************* CPU *******************************/
+
+// NROM program: sum 10..1 in a loop, store it from a subroutine at $A000 that
+// also reads a byte of data at $C000, then spin
+static const uint8_t cpu_program[] = {
+    0xA2, 0x0A,             // $8000  LDX #$0A
+    0xA9, 0x00,             // $8002  LDA #$00
+    0x86, 0x10,             // $8004  STX $10
+    0x18,                   // $8006  CLC
+    0x65, 0x10,             // $8007  ADC $10
+    0xCA,                   // $8009  DEX
+    0xD0, 0xF8,             // $800A  BNE $8004
+    0x20, 0x00, 0xA0,       // $800C  JSR $A000
+    0x4C, 0x0F, 0x80,       // $800F  JMP $800F
+};
+static const uint8_t cpu_subroutine[] = {
+    0xAE, 0x00, 0xC0,       // $A000  LDX $C000
+    0x8D, 0x00, 0x02,       // $A003  STA $0200
+    0x60,                   // $A006  RTS
+};
+
+static void check_cpu() {
+    char path[] = "/tmp/aioNES_check_XXXXXX";
+    uint8_t *prg = calloc(32 << 10, 1), log[32 << 10];
+    bool ok;
+    FILE *f;
+    int fd;
+
+    memcpy(prg, cpu_program, sizeof(cpu_program));
+    memcpy(prg + 0x2000, cpu_subroutine, sizeof(cpu_subroutine));
+    prg[0x4000] = 0x5A;
+    prg[0x7FFD] = 0x80;  // RESET vector, $8000
+    ok = load_rom(0, prg, 32 << 10, 0);
+    free(prg);
+    if (!ok || !cdl_enable()) {
+        check(false, "cpu: load");
+        cartridge_unload();
+        return;
+    }
+
+    cpu_reset();
+    cpu_run(1000 * CPU_DOTS_PER_CYCLE);
+    check(mem[0x200] == 55 && reg_x == 0x5A && reg_pc == 0x800F && reg_sp == 0xFD, "cpu: program");
+
+    // opcodes keep the opcode bit in memory only; B is the window accessed through
+    check(cdl_prg[0x0000] == (CDL_CODE | CDL_OPCODE) && cdl_prg[0x0001] == CDL_CODE, "cdl: code at $8000");
+    check(cdl_prg[0x2000] == (CDL_CODE | CDL_OPCODE | 1 << 2), "cdl: code at $A000");
+    check(cdl_prg[0x4000] == (CDL_DATA | 2 << 2), "cdl: data at $C000");
+    check(cdl_prg[0x7FFC] == (CDL_DATA | 3 << 2), "cdl: RESET vector");
+    check(cdl_prg[0x0012] == 0, "cdl: bytes never accessed");
+
+    ok = (fd = mkstemp(path)) >= 0;
+    if (ok) {
+        close(fd);
+    }
+    ok = ok && cdl_save(path) && (f = fopen(path, "rb"));
+    ok = ok && fread(log, 1, sizeof(log), f) == sizeof(log) && fclose(f) == 0;
+    check(ok && log[0x0000] == CDL_CODE && log[0x2000] == (CDL_CODE | 1 << 2) && log[0x4000] == (CDL_DATA | 2 << 2),
+          "cdl: exported without the opcode bit");
+    remove(path);
+    cdl_disable();
+    cartridge_unload();
+}
+
+// MMC3 program, in the fixed bank at $E000: NMI every vblank, the NMI handler
+// sets up one scanline IRQ per frame and the IRQ handler acknowledges it
+static const uint8_t irq_program[] = {
+    0xA9, 0x88,             // $E000  LDA #$88          NMI on, sprites at $1000
+    0x8D, 0x00, 0x20,       // $E002  STA $2000
+    0xA9, 0x18,             // $E005  LDA #$18
+    0x8D, 0x01, 0x20,       // $E007  STA $2001
+    0x58,                   // $E00A  CLI
+    0x4C, 0x0B, 0xE0,       // $E00B  JMP $E00B
+    0xE6, 0x10,             // $E00E  INC $10           NMI
+    0xA9, 0x40,             // $E010  LDA #$40
+    0x8D, 0x00, 0xC0,       // $E012  STA $C000
+    0x8D, 0x01, 0xC0,       // $E015  STA $C001
+    0x8D, 0x01, 0xE0,       // $E018  STA $E001
+    0x40,                   // $E01B  RTI
+    0xE6, 0x11,             // $E01C  INC $11           IRQ
+    0x8D, 0x00, 0xE0,       // $E01E  STA $E000
+    0x40,                   // $E021  RTI
+};
+
+static void check_interrupts() {
+    uint8_t *prg = calloc(32 << 10, 1);
+    bool ok;
+
+    memcpy(prg + 0x6000, irq_program, sizeof(irq_program));
+    memcpy(prg + 0x7FFA, (const uint8_t[]){ 0x0E, 0xE0, 0x00, 0xE0, 0x1C, 0xE0 }, 6);
+    ok = load_rom(4, prg, 32 << 10, 8 << 10);
+    free(prg);
+    if (!ok) {
+        check(false, "interrupts: load");
+        cartridge_unload();
+        return;
+    }
+
+    cpu_reset();
+    for (int i = 0; i < 10; i++) {
+        cpu_run_frame();
+    }
+    // the first IRQ is set up by the first NMI
+    check(mem[0x10] == 10 && mem[0x11] == 9, "interrupts: one NMI and one mapper IRQ per frame");
+    check(reg_pc >= 0xE00B && reg_pc <= 0xE00D && !(flags & CPU_FLAG_INTERRUPT), "interrupts: return to the program");
+    cartridge_unload();
+}
+
+
+/****************************** MMC3 *******************************/
+
+// MMC3 with the IRQ latch at `latch`, rendering on with PPUCTRL `ctrl`
+static uint64_t mmc3_irq_at(uint8_t ctrl, uint8_t latch) {
+    uint64_t at;
+
+    if (!load_rom(4, NULL, 32 << 10, 8 << 10)) {
+        return 0;
+    }
+    cpu_write(0x2000, ctrl);
+    cpu_write(0x2001, PPU_MASK_BG | PPU_MASK_SPRITES);
+    cpu_write(0xC000, latch);
+    cpu_write(0xC001, 0);
+    cpu_write(0xE001, 0);
+    at = mapper_irq_at;
+    ppu_run_frame();
+    if ((at == PPU_NEVER) != !(cpu_irq & CPU_IRQ_MAPPER)) {
+        at = 0;  // fired without being predicted, or the other way round
+    }
+    cartridge_unload();
+    return at;
+}
+
+static void check_mmc3() {
+    // counter reloaded at the rise of line 0, fires at the rise of line 9
+    uint64_t line_9 = 9 * PPU_DOTS_PER_LINE;
+
+    check(mmc3_irq_at(PPU_CTRL_SPRITE_TABLE, 9) == line_9 + 260, "mmc3: IRQ, sprites at $1000");
+    check(mmc3_irq_at(PPU_CTRL_BG_TABLE, 9) == line_9 + 324, "mmc3: IRQ, background at $1000");
+    check(mmc3_irq_at(0, 9) == PPU_NEVER, "mmc3: no IRQ, both tables at $0000");
+    // 8x16 sprites fetch from $1000 whatever bit 3 says
+    check(mmc3_irq_at(PPU_CTRL_SPRITE_16, 9) == line_9 + 260, "mmc3: IRQ, 8x16 sprites, background at $0000");
+    check(mmc3_irq_at(PPU_CTRL_SPRITE_16 | PPU_CTRL_BG_TABLE, 9) == line_9 + 324,
+          "mmc3: IRQ, 8x16 sprites, background at $1000");
+}
+
+
+/******************************* PPU *******************************/
+
+static uint32_t frame_a[PPU_WIDTH * PPU_HEIGHT], frame_b[PPU_WIDTH * PPU_HEIGHT];
+
+// NROM with CHR RAM, the pattern tables, nametables, palette and OAM filled with
+// distinct values, rendering on into `pixels` of `format` and the first frame run;
+// release with cartridge_unload()
+static bool load_scene(void *pixels, PPUFormat format) {
+    if (!load_rom(0, NULL, 32 << 10, 0)) {
+        return false;
+    }
+    ppu_set_output(pixels, PPU_WIDTH, format);
+    cpu_write(0x2006, 0x00);
+    cpu_write(0x2006, 0x00);
+    for (int i = 0; i < 0x2000; i++) {
+        cpu_write(0x2007, i * 37 ^ i >> 4);
+    }
+    for (int i = 0; i < 0x800; i++) {
+        cpu_write(0x2007, i * 7);  // $2000-$27FF, both nametables
+    }
+    cpu_write(0x2006, 0x3F);
+    cpu_write(0x2006, 0x00);
+    for (int i = 0; i < 32; i++) {
+        cpu_write(0x2007, i * 3 + 1);
+    }
+    // sprite s at line 10 + 3s, tile s, priority and palette from s
+    cpu_write(0x2003, 0);
+    for (int s = 0; s < 64; s++) {
+        cpu_write(0x2004, 10 + 3 * s);
+        cpu_write(0x2004, s);
+        cpu_write(0x2004, s & 0x23);
+        cpu_write(0x2004, s * 13);
+    }
+    cpu_write(0x2000, PPU_CTRL_NMI | PPU_CTRL_SPRITE_TABLE);
+    cpu_write(0x2001, PPU_MASK_BG | PPU_MASK_SPRITES | PPU_MASK_BG_LEFT | PPU_MASK_SPRITE_LEFT);
+    ppu_run_frame();
+    return true;
+}
+
+// register writes during a frame, at PPU dots from its start: a mid-line scroll,
+// a split through $2006, a nametable switch and sprites turned off mid-line
+static const struct { uint32_t dot; uint16_t addr; uint8_t value; } frame_writes[] = {
+    { 40 * PPU_DOTS_PER_LINE + 270, 0x2005, 0x23 },
+    { 40 * PPU_DOTS_PER_LINE + 273, 0x2005, 0x11 },
+    { 90 * PPU_DOTS_PER_LINE + 300, 0x2006, 0x24 },
+    { 90 * PPU_DOTS_PER_LINE + 303, 0x2006, 0x4A },
+    { 150 * PPU_DOTS_PER_LINE + 20, 0x2000, PPU_CTRL_NMI | PPU_CTRL_SPRITE_TABLE | 2 },
+    { 200 * PPU_DOTS_PER_LINE + 128, 0x2001, PPU_MASK_BG | PPU_MASK_BG_LEFT | PPU_MASK_SPRITE_LEFT },
+};
+
+// $2002 as a program polling it at the end of the last frame of run_writes() saw it
+static uint8_t frame_status;
+
+// bring `cpu_clock` to `at`, syncing the PPU every CPU cycle on the way if `lockstep`
+static void run_until(bool lockstep, uint64_t at) {
+    while (lockstep && cpu_clock + CPU_DOTS_PER_CYCLE < at) {
+        cpu_clock += CPU_DOTS_PER_CYCLE;
+        ppu_sync();
+    }
+    cpu_clock = at;
+}
+
+// run a frame of the scene with `frame_writes` and a read of $2002 on its last
+// visible line, syncing the PPU every CPU cycle if `lockstep`, only at the accesses
+// and the end of the frame otherwise
+static bool run_writes(bool lockstep, void *pixels, PPUFormat format) {
+    uint64_t start;
+
+    if (!load_scene(pixels, format)) {
+        return false;
+    }
+    start = ppu.clock;
+    for (size_t i = 0; i < sizeof(frame_writes) / sizeof(frame_writes[0]); i++) {
+        run_until(lockstep, start + frame_writes[i].dot);
+        cpu_write(frame_writes[i].addr, frame_writes[i].value);
+    }
+    run_until(lockstep, start + (PPU_VISIBLE_LINES - 1) * PPU_DOTS_PER_LINE + 300);
+    frame_status = cpu_read(0x2002);
+    run_until(lockstep, start + PPU_DOTS_PER_FRAME);
+    ppu_run_frame();
+    return true;
+}
+
+static void check_lazy_ppu() {
+    for (int renderer = PPU_RENDERER_SCANLINE; renderer <= PPU_RENDERER_DOT; renderer++) {
+        PPU lazy;
+        uint8_t status;
+        bool nmi;
+        bool ok;
+
+        ppu_set_renderer(renderer);
+        ok = run_writes(false, frame_a, PPU_FORMAT_XRGB8888);
+        lazy = ppu;
+        status = frame_status;
+        nmi = cpu_nmi;
+        cartridge_unload();
+        ok = ok && run_writes(true, frame_b, PPU_FORMAT_XRGB8888);
+        cartridge_unload();
+        check(ok && memcmp(frame_a, frame_b, sizeof(frame_a)) == 0 && lazy.clock == ppu.clock &&
+              lazy.v == ppu.v && status == frame_status && nmi == cpu_nmi,
+              renderer == PPU_RENDERER_SCANLINE ? "ppu: lazy sync as lockstep, scanline renderer"
+                                                : "ppu: lazy sync as lockstep, dot renderer");
+    }
+    ppu_set_renderer(PPU_RENDERER_SCANLINE);
+}
+
+// the frame of `frame_writes` looks the same drawn by scanline or dot by dot: its
+// splits land between tiles or lines, where the scanline renderer is exact
+static void check_renderers() {
+    uint8_t status;
+    bool ok;
+
+    ppu_set_renderer(PPU_RENDERER_SCANLINE);
+    ok = run_writes(false, frame_a, PPU_FORMAT_XRGB8888);
+    status = frame_status;
+    cartridge_unload();
+    ppu_set_renderer(PPU_RENDERER_DOT);
+    ok = ok && run_writes(false, frame_b, PPU_FORMAT_XRGB8888);
+    cartridge_unload();
+    ppu_set_renderer(PPU_RENDERER_SCANLINE);
+    check(ok && (status & PPU_STATUS_SPRITE_0), "ppu: sprite 0 hit in the split scroll frame");
+    check(ok && memcmp(frame_a, frame_b, sizeof(frame_a)) == 0 && frame_status == status,
+          "ppu: scanline renderer as dot renderer, split scroll");
+}
+
+// RGB565 frames are the XRGB8888 ones with each channel truncated, on both renderers
+static void check_rgb565() {
+    const uint16_t *rgb565 = (const uint16_t *)frame_b;
+
+    for (int renderer = PPU_RENDERER_SCANLINE; renderer <= PPU_RENDERER_DOT; renderer++) {
+        bool ok;
+
+        ppu_set_renderer(renderer);
+        ok = run_writes(false, frame_a, PPU_FORMAT_XRGB8888);
+        cartridge_unload();
+        ok = ok && run_writes(false, frame_b, PPU_FORMAT_RGB565);
+        cartridge_unload();
+        for (int i = 0; ok && i < PPU_WIDTH * PPU_HEIGHT; i++) {
+            uint32_t rgb = frame_a[i];
+            ok = rgb565[i] == ((rgb >> 8 & 0xF800) | (rgb >> 5 & 0x07E0) | (rgb >> 3 & 0x001F));
+        }
+        check(ok, renderer == PPU_RENDERER_SCANLINE ? "ppu: RGB565 as XRGB8888, scanline renderer"
+                                                    : "ppu: RGB565 as XRGB8888, dot renderer");
+    }
+    ppu_set_renderer(PPU_RENDERER_SCANLINE);
+}
+
+// a frame of the scene with `frame_writes` and nothing else, at the same dots each
+// time, sprites turned back on as load_scene() had them
+static void run_frame_writes() {
+    uint64_t start = ppu.clock;
+
+    cpu_write(0x2001, PPU_MASK_BG | PPU_MASK_SPRITES | PPU_MASK_BG_LEFT | PPU_MASK_SPRITE_LEFT);
+    for (size_t i = 0; i < sizeof(frame_writes) / sizeof(frame_writes[0]); i++) {
+        cpu_clock = start + frame_writes[i].dot;
+        cpu_write(frame_writes[i].addr, frame_writes[i].value);
+    }
+    ppu_run_frame();
+}
+
+// a frame repeating the last one is reported unchanged and its pixels are left as
+// they were, one with a sprite moved is reported and drawn
+static void check_dupe() {
+    bool same, changed;
+
+    if (!load_scene(frame_a, PPU_FORMAT_XRGB8888)) {
+        check(false, "dupe: load");
+        cartridge_unload();
+        return;
+    }
+    run_frame_writes();
+    run_frame_writes();
+    memcpy(frame_b, frame_a, sizeof(frame_a));
+    run_frame_writes();
+    same = !ppu_frame_changed && memcmp(frame_a, frame_b, sizeof(frame_a)) == 0;
+
+    cpu_write(0x2003, 7);
+    cpu_write(0x2004, 200);  // sprite 1 moved
+    run_frame_writes();
+    changed = ppu_frame_changed && memcmp(frame_a, frame_b, sizeof(frame_a)) != 0;
+    cartridge_unload();
+
+    check(same, "dupe: repeated frame");
+    check(changed, "dupe: frame with a sprite moved");
+}
+
+// save a state after the frame of `frame_writes` under `from`, load it into a fresh
+// scene under `to`: the next frame is drawn the same as without the round trip
+static bool state_round_trip(PPURenderer from, PPURenderer to) {
+    uint8_t *state = malloc(ppu_state_size());
+    bool ok;
+
+    ppu_set_renderer(from);
+    ok = state && run_writes(false, frame_a, PPU_FORMAT_XRGB8888);
+    if (ok) {
+        ppu_save_state(state);
+        ppu_run_frame();
+    }
+    cartridge_unload();
+
+    ppu_set_renderer(to);
+    ok = ok && load_scene(frame_b, PPU_FORMAT_XRGB8888) && ppu_load_state(state, ppu_state_size());
+    if (ok) {
+        cpu_clock = ppu.clock;
+        ppu_run_frame();
+        ok = memcmp(frame_a, frame_b, sizeof(frame_a)) == 0;
+    }
+    cartridge_unload();
+    ppu_set_renderer(PPU_RENDERER_SCANLINE);
+    free(state);
+    return ok;
+}
+
+static void check_ppu_state() {
+    uint8_t state[16] = { 0 };
+
+    check(state_round_trip(PPU_RENDERER_SCANLINE, PPU_RENDERER_DOT), "ppu: state saved by scanline, loaded by dot");
+    check(state_round_trip(PPU_RENDERER_DOT, PPU_RENDERER_SCANLINE), "ppu: state saved by dot, loaded by scanline");
+    check(!ppu_load_state(state, sizeof(state)), "ppu: truncated state");
+}
+
+// every variant composes the frame of `frame_writes` (priority, sprite 0 hit and the
+// palette lookup) like the scalar code, in both formats
+static void check_simd() {
+    for (int format = 0; format < PPU_FORMAT_COUNT; format++) {
+        size_t size = PPU_WIDTH * PPU_HEIGHT * (format == PPU_FORMAT_RGB565 ? 2 : 4);
+        uint8_t status;
+        bool ok;
+
+        ppu_set_simd(PPU_SIMD_SCALAR);
+        ok = run_writes(false, frame_a, format);
+        status = frame_status;
+        cartridge_unload();
+        for (int simd = PPU_SIMD_SCALAR + 1; ok && simd < PPU_SIMD_COUNT; simd++) {
+            char what[64];
+
+            if (!ppu_set_simd(simd)) {
+                continue;
+            }
+            snprintf(what, sizeof(what), "ppu: %s compose as scalar%s", ppu_simd_names[simd],
+                     format == PPU_FORMAT_RGB565 ? ", RGB565" : "");
+            memset(frame_b, 0, sizeof(frame_b));
+            check(run_writes(false, frame_b, format) && memcmp(frame_a, frame_b, size) == 0 && frame_status == status,
+                  what);
+            cartridge_unload();
+        }
+        check(ok, "ppu: scalar compose");
+    }
+}
+
+
+/***************************** GAMEDB ******************************/
+
+static void check_gamedb() {
+    check(gamedb_sorted(), "gamedb: table sorted by crc32");
+}
+
+
+/*************************** DISASSEMBLER **************************/
+
+// save `cfg` to a cache file and load it back
+static bool cache_loads(const DisasmCFG *cfg, const uint8_t *prg) {
+    static const DisasmCacheKey key = { 1, 2, 3 };
+    char path[] = "/tmp/aioNES_check_XXXXXX";
+    DisasmCFG loaded;
+    bool ok;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0) {
+        return false;
+    }
+    close(fd);
+    ok = disasm_cache_save(cfg, path, &key) && disasm_cache_load(&loaded, path, &key, prg, cfg->size);
+    disasm_free(&loaded);
+    remove(path);
+    return ok;
+}
+
+// a cache with `field` set to `value` must be rejected
+#define CHECK_DAMAGED(field, value, what)           \
+    do {                                            \
+        __typeof__(field) saved = field;            \
+        field = value;                              \
+        check(!cache_loads(cfg, prg), what);        \
+        field = saved;                              \
+    } while (0)
+
+static void check_disasm_cache(DisasmCFG *cfg, const uint8_t *prg) {
+    DisasmBlock *b = &cfg->blocks[1], *lda = &cfg->blocks[cfg->num_blocks - 1];
+
+    check(cache_loads(cfg, prg), "disasm cache: load");
+    CHECK_DAMAGED(b->start, cfg->blocks[0].start, "disasm cache: unsorted blocks");
+    CHECK_DAMAGED(b->size, cfg->size, "disasm cache: block past the rom");
+    CHECK_DAMAGED(lda->size, lda->size - 1, "disasm cache: block of partial instructions");
+    CHECK_DAMAGED(b->count, b->count + 1, "disasm cache: instruction count");
+    CHECK_DAMAGED(b->exit, 0xFF, "disasm cache: exit");
+    CHECK_DAMAGED(b->succ[0], cfg->num_blocks, "disasm cache: successor");
+    CHECK_DAMAGED(cfg->edges[0].from, cfg->num_blocks, "disasm cache: edge");
+    CHECK_DAMAGED(cfg->edges[0].to, cfg->num_blocks, "disasm cache: edge");
+    CHECK_DAMAGED(cfg->home[0], 0x9000, "disasm cache: home window");
+}
+
+static void check_disasm() {
+    static const uint32_t map[4] = { 0, 0x2000, 0x1C000, 0x1E000 };
+    uint32_t size = 128 << 10;
+    uint8_t *prg = malloc(size);
+    DisasmCFG cfg;
+    char *text;
+    bool ok = true;
+
+    // 64 KB of NOP from the reset vector, then LDA $0000 up to the vectors: code
+    // falling through all the banks
+    memset(prg, 0xEA, 64 << 10);
+    for (uint32_t o = 64 << 10; o + 3 <= size - 6; o += 3) {
+        memcpy(prg + o, "\xAD\0\0", 3);
+    }
+    memcpy(prg + size - 6, "\0\x80\0\x80\0\x80", 6);
+
+    if (!disasm_build_cfg(&cfg, prg, size, map, NULL)) {
+        check(false, "disasm: build");
+        free(prg);
+        return;
+    }
+    for (uint32_t i = 0; i < cfg.num_blocks; i++) {
+        const DisasmBlock *b = &cfg.blocks[i];
+        ok = ok && b->size <= 0x2000 + 2; // a bank, and an instruction crossing its end
+    }
+    check(ok && cfg.num_blocks >= 8, "disasm: blocks end at bank boundaries");
+    check(disasm_format(&cfg, prg, &text) > 0, "disasm: format");
+    free(text);
+    check_disasm_cache(&cfg, prg);
+    disasm_free(&cfg);
+    free(prg);
+}
+
+
+int main() {
+    check_ips();
+    check_cpu();
+    check_interrupts();
+    check_mmc3();
+    check_lazy_ppu();
+    check_renderers();
+    check_ppu_state();
+    check_simd();
+    check_rgb565();
+    check_dupe();
+    check_gamedb();
+    check_disasm();
+    if (!failed) {
+        printf("all checks passed\n");
+    }
+    return failed;
+}
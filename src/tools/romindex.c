@@ -0,0 +1,450 @@
+/*
+    aioNES_romindex: walk a rom directory tree and write a binary catalog (see catalog.h).
+
+    usage: aioNES_romindex [-j threads] <rom directory> <catalog file>
+           aioNES_romindex -q <catalog file> [mapper]
+
+    Roms may be plain .nes files or packed in a .zip/.gz. Headers are parsed with
+    cartridge_parse_ines() and PRG+CHR are hashed with the same CRC-32 used by the
+    game database, on a pool of worker threads. When the catalog already exists, files
+    whose size and mtime did not change are copied from it instead of being opened again.
+*/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "catalog.h"
+#include "../archive.h"
+#include "../cartridge.h"
+#include "../gamedb.h"
+#include "../hash.h"
+#include "../libretro/libretro.h"
+
+typedef struct {
+    char *path;               // relative to the root directory
+    uint64_t mtime_ns;
+    uint64_t file_size;
+    bool dirty;               // must be (re)hashed
+    CatalogRecord rec;
+} Entry;
+
+static Entry *entries;
+static size_t num_entries, cap_entries;
+static int root_fd;
+static size_t next_job;
+
+
+/***************************** LOGGING *****************************/
+
+static void tool_log(enum retro_log_level level, const char *fmt, ...) {
+    va_list va;
+    if (level < RETRO_LOG_WARN) {
+        return;
+    }
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+}
+
+// cartridge.c logs through the libretro callback
+retro_log_printf_t log_cb = tool_log;
+
+
+/***************************** WALKING *****************************/
+
+static bool is_rom(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && (strcasecmp(ext, ".nes") == 0 || strcasecmp(ext, ".zip") == 0 ||
+                   strcasecmp(ext, ".gz") == 0);
+}
+
+static void add_entry(const char *path, const struct stat *st) {
+    if (num_entries == cap_entries) {
+        cap_entries = cap_entries ? cap_entries * 2 : 1024;
+        entries = realloc(entries, cap_entries * sizeof(Entry));
+    }
+    Entry *e = &entries[num_entries++];
+    memset(e, 0, sizeof(*e));
+    e->path = strdup(path);
+    e->mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+    e->file_size = st->st_size;
+    e->dirty = true;
+}
+
+static void walk(const char *rel) {
+    int fd = openat(root_fd, *rel ? rel : ".", O_RDONLY | O_DIRECTORY);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    struct dirent *de;
+    char path[4096];
+    struct stat st;
+
+    if (!dir) {
+        fprintf(stderr, "cannot open directory %s: %s\n", *rel ? rel : ".", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s%s%s", rel, *rel ? "/" : "", de->d_name);
+
+        // d_type saves a stat() per directory entry on most file systems
+        if (de->d_type == DT_DIR) {
+            walk(path);
+            continue;
+        }
+        if (de->d_type != DT_REG && de->d_type != DT_UNKNOWN) {
+            continue;
+        }
+        if (de->d_type == DT_REG && !is_rom(de->d_name)) {
+            continue;
+        }
+        if (fstatat(root_fd, path, &st, 0) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            walk(path);
+        } else if (S_ISREG(st.st_mode) && is_rom(de->d_name)) {
+            add_entry(path, &st);
+        }
+    }
+    closedir(dir);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    return strcmp(((const Entry *)a)->path, ((const Entry *)b)->path);
+}
+
+
+/************************** OLD CATALOG ***************************/
+
+// the sections lie within the `size` bytes of the file (compared without summing
+// offsets, which could overflow) and every path is a string of the string table
+static bool catalog_valid(const CatalogHeader *cat, uint64_t size) {
+    const CatalogRecord *recs;
+    const char *strings;
+
+    if (memcmp(cat->magic, CATALOG_MAGIC, 8) != 0 || cat->version != CATALOG_VERSION) {
+        return false;
+    }
+    if (cat->records_offset > size || cat->count > (size - cat->records_offset) / sizeof(CatalogRecord) ||
+        cat->strings_offset > size || cat->strings_size > size - cat->strings_offset) {
+        return false;
+    }
+    if (!cat->count) {
+        return true;
+    }
+    // the last path ends the table, the others end before it
+    strings = (const char *)cat + cat->strings_offset;
+    if (!cat->strings_size || strings[cat->strings_size - 1] != '\0') {
+        return false;
+    }
+    recs = catalog_records(cat);
+    for (uint32_t i = 0; i < cat->count; i++) {
+        if (recs[i].path_offset >= cat->strings_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// map an existing catalog, NULL if missing or incompatible
+static const CatalogHeader *catalog_map(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const CatalogHeader *cat;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CatalogHeader)) {
+        close(fd);
+        return NULL;
+    }
+    cat = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cat == MAP_FAILED) {
+        return NULL;
+    }
+    if (!catalog_valid(cat, st.st_size)) {
+        munmap((void *)cat, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return cat;
+}
+
+static const CatalogRecord *catalog_find(const CatalogHeader *cat, const char *path) {
+    const CatalogRecord *recs = catalog_records(cat);
+    size_t lo = 0, hi = cat->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(catalog_path(cat, &recs[mid]), path);
+        if (cmp == 0) {
+            return &recs[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+
+/***************************** HASHING *****************************/
+
+static void index_file(Entry *e, uint8_t **buf, size_t *cap) {
+    CartridgeHeader h;
+    const GameDBEntry *db;
+    CatalogRecord *rec = &e->rec;
+    size_t done = 0;
+    int fd;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->mtime_ns = e->mtime_ns;
+    rec->file_size = e->file_size;
+
+    fd = openat(root_fd, e->path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (*cap < e->file_size) {
+        *cap = e->file_size;
+        free(*buf);
+        *buf = malloc(*cap);
+    }
+    while (done < e->file_size) {
+        ssize_t n = read(fd, *buf + done, e->file_size - done);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close(fd);
+
+    // compressed roms are decoded into a second buffer, the catalog describes the rom inside
+    const uint8_t *rom = *buf;
+    uint8_t *unpacked = NULL;
+    if (archive_type(*buf, done) != ARCHIVE_NONE) {
+        ArchiveMember m;
+        if (!archive_find_rom(*buf, done, &m) || !(unpacked = malloc(m.size ? m.size : 1)) ||
+            !archive_extract(&m, unpacked)) {
+            free(unpacked);
+            return;
+        }
+        rom = unpacked;
+        done = m.size;
+    }
+
+    if (!cartridge_parse_ines(rom, done, &h)) {
+        free(unpacked);
+        return;
+    }
+
+    rec->crc32 = hash_crc32(0, rom + h.prg_offset, h.prg_rom_size + h.chr_rom_size);
+    free(unpacked);
+    rec->flags = CATALOG_FLAG_VALID;
+    db = gamedb_lookup(rec->crc32);
+    if (db) {
+        cartridge_apply_gamedb(&h, db);
+        rec->flags |= CATALOG_FLAG_GAMEDB;
+    }
+
+    rec->prg_rom_size = h.prg_rom_size;
+    rec->chr_rom_size = h.chr_rom_size;
+    rec->mapper = h.mapper;
+    rec->submapper = h.submapper;
+    rec->timing = h.timing;
+    rec->flags |= (h.nes2 ? CATALOG_FLAG_NES2 : 0) | (h.mirroring ? CATALOG_FLAG_VERTICAL : 0) |
+                  (h.trainer ? CATALOG_FLAG_TRAINER : 0) | (h.truncated ? CATALOG_FLAG_TRUNCATED : 0) |
+                  (h.battery ? CATALOG_FLAG_BATTERY : 0) | (h.four_screen ? CATALOG_FLAG_FOUR_SCREEN : 0);
+}
+
+static void *worker(void *arg) {
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    (void)arg;
+
+    for (;;) {
+        size_t i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (i >= num_entries) {
+            break;
+        }
+        if (entries[i].dirty) {
+            index_file(&entries[i], &buf, &cap);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+/***************************** WRITING *****************************/
+
+static bool catalog_write(const char *path) {
+    CatalogHeader hdr = { .magic = CATALOG_MAGIC, .version = CATALOG_VERSION };
+    char tmp[4096];
+    uint64_t strings_size = 0;
+    FILE *f;
+
+    for (size_t i = 0; i < num_entries; i++) {
+        entries[i].rec.path_offset = strings_size;
+        strings_size += strlen(entries[i].path) + 1;
+    }
+
+    hdr.count = num_entries;
+    hdr.records_offset = sizeof(CatalogHeader);
+    hdr.strings_offset = hdr.records_offset + num_entries * sizeof(CatalogRecord);
+    hdr.strings_size = strings_size;
+    hdr.created = time(NULL);
+
+    // write next to the destination and rename, readers never see a partial file
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "cannot write %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (size_t i = 0; i < num_entries; i++) {
+        fwrite(&entries[i].rec, sizeof(CatalogRecord), 1, f);
+    }
+    for (size_t i = 0; i < num_entries; i++) {
+        fwrite(entries[i].path, strlen(entries[i].path) + 1, 1, f);
+    }
+    if (fclose(f) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+
+/***************************** QUERYING ****************************/
+
+static int query(const char *path, int mapper_filter) {
+    static const char *const timings[4] = { "NTSC", "PAL", "multi", "Dendy" };
+    size_t size;
+    const CatalogHeader *cat = catalog_map(path, &size);
+    if (!cat) {
+        fprintf(stderr, "%s is not a catalog\n", path);
+        return 1;
+    }
+
+    const CatalogRecord *recs = catalog_records(cat);
+    for (uint32_t i = 0; i < cat->count; i++) {
+        const CatalogRecord *r = &recs[i];
+        if (mapper_filter >= 0 && (!(r->flags & CATALOG_FLAG_VALID) || r->mapper != mapper_filter)) {
+            continue;
+        }
+        printf("%08X\t%3u.%u\t%7u\t%7u\t%s\t%s\n", r->crc32, r->mapper, r->submapper,
+               r->prg_rom_size, r->chr_rom_size, timings[r->timing & 3],
+               catalog_path(cat, r));
+    }
+    munmap((void *)cat, size);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const CatalogHeader *old;
+    size_t old_size = 0, dirty = 0;
+    pthread_t *pool;
+    struct timespec t0, t1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:q")) != -1) {
+        switch (opt) {
+            case 'j':
+                threads = atol(optarg);
+                break;
+            case 'q':
+                if (optind >= argc) {
+                    goto usage;
+                }
+                return query(argv[optind], optind + 1 < argc ? atoi(argv[optind + 1]) : -1);
+            default:
+                goto usage;
+        }
+    }
+    if (argc - optind != 2) {
+        goto usage;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hash_init();
+
+    root_fd = open(argv[optind], O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        fprintf(stderr, "cannot open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    walk("");
+    qsort(entries, num_entries, sizeof(Entry), entry_cmp);
+
+    // reuse the records of unchanged files
+    old = catalog_map(argv[optind + 1], &old_size);
+    for (size_t i = 0; i < num_entries; i++) {
+        const CatalogRecord *r = old ? catalog_find(old, entries[i].path) : NULL;
+        if (r && r->mtime_ns == entries[i].mtime_ns && r->file_size == entries[i].file_size) {
+            entries[i].rec = *r;
+            entries[i].dirty = false;
+        } else {
+            dirty++;
+        }
+    }
+    if (old) {
+        munmap((void *)old, old_size);
+    }
+
+    pool = malloc(threads * sizeof(pthread_t));
+    for (long i = 0; i < threads; i++) {
+        pthread_create(&pool[i], NULL, worker, NULL);
+    }
+    for (long i = 0; i < threads; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+
+    if (!catalog_write(argv[optind + 1])) {
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "%zu roms, %zu hashed, %ld threads, %.3f s\n", num_entries, dirty, threads,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-j threads] <rom directory> <catalog file>\n"
+                    "       %s -q <catalog file> [mapper]\n", argv[0], argv[0]);
+    return 1;
+}